@@ -8,7 +8,7 @@ extern "C" {
 #endif
 
 #define JANICE_VERSION_MAJOR 7
-#define JANICE_VERSION_MINOR 0
+#define JANICE_VERSION_MINOR 1
 #define JANICE_VERSION_PATCH 0
 
 // ----------------------------------------------------------------------------
@@ -131,14 +131,6 @@ JANICE_EXPORT JaniceError janice_free_buffer(uint8_t** buffer);
 // Structs
 typedef struct JaniceDetectionType* JaniceDetection;
 
-struct JaniceRect
-{
-    int x;
-    int y;
-    int width; 
-    int height;
-};
-
 struct JaniceTrack
 {
     JaniceRect* rects;
@@ -24,6 +24,42 @@ struct JaniceImage
     bool owner;
 };
 
+struct JaniceRect
+{
+    int x;
+    int y;
+    int width; 
+    int height;
+};
+
+// ----------------------------------------------------------------------------
+// Image Format
+
+enum JaniceChannelOrder
+{
+    JaniceChannelsBGR = 0,
+    JaniceChannelsRGB = 1,
+    JaniceChannelsGray = 2
+};
+
+enum JanicePixelType
+{
+    JanicePixelUInt8 = 0,
+    JanicePixelFloat32 = 1
+};
+
+struct JaniceImageFormat
+{
+    uint32_t rows; // 0 keeps the size of the media
+    uint32_t cols;
+    JaniceChannelOrder channel_order;
+    bool planar;
+    JanicePixelType pixel_type;
+
+    float mean[3];
+    float scale[3];
+};
+
 // ----------------------------------------------------------------------------
 // Media Iterator
 
@@ -47,6 +83,15 @@ struct JANICE_EXPORT JaniceMediaIterator
     JaniceError (*free)(JaniceMediaIterator*);
 
     JaniceMediaIteratorState _internal;
+
+    // Optional entries added since version 7.0. They come after the original
+    // members so those keep their offsets. Anything that fills in a
+    // JaniceMediaIterator should zero-initialize it first, so entries it
+    // doesn't know about are NULL.
+    JaniceError (*get_roi)(JaniceMediaIterator*, JaniceImage*, uint32_t, const JaniceRect*);
+    JaniceError (*next_batch)(JaniceMediaIterator*, JaniceImage*, uint32_t, uint32_t*);
+    JaniceError (*set_format)(JaniceMediaIterator*, const JaniceImageFormat*);
+    JaniceError (*get_pyramid)(JaniceMediaIterator*, JaniceImage*, uint32_t, uint32_t);
 };
 
 struct JaniceMediaIterators
@@ -55,9 +55,9 @@ author = u'Noblis'
 # built documents.
 #
 # The short X.Y version.
-version = u'7.0.0'
+version = u'7.1.0'
 # The full version, including alpha/beta/rc tags.
-release = u'7.0.0'
+release = u'7.1.0'
 
 # The language for content autogenerated by Sphinx. Refer to documentation
 # for a list of supported languages.
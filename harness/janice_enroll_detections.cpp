@@ -8,6 +8,7 @@
 #include <unordered_map>
 #include <iostream>
 #include <chrono>
+#include <algorithm>
 
 int main(int argc, char* argv[])
 {
@@ -26,6 +27,7 @@ int main(int argc, char* argv[])
     args::ValueFlag<std::string> algorithm(parser, "string", "Optional additional parameters for the implementation. The format and content of this string is implementation defined.", {'a', "algorithm"}, "");
     args::ValueFlag<int>         num_threads(parser, "int", "The number of threads the implementation should use while running detection.", {'j', "num_threads"}, 1);
     args::ValueFlag<int>         batch_size(parser, "int", "The size of a single batch. A larger batch size may run faster but will use more CPU resources.", {'b', "batch_size"}, 128);
+    args::ValueFlag<int>         media_cache(parser, "int", "The memory, in MB, used to keep decoded images that appear in more than one template, so each is only decoded once. 0, the default, decodes images every time they are used.", {'c', "media_cache"}, 0);
     args::Flag                   include_size(parser, "include_size", "Compute and include the template size in the output of this program. If false, 0 is used.", {'s', "include_size"});
     args::ValueFlag<std::vector<int>, ListReader<int>> gpus(parser, "int,int,int", "The GPU indices of the CUDA-compliant GPU cards the implementation should use while running detection", {'g', "gpus"}, std::vector<int>());
     args::ValueFlag<std::vector<std::string>, ListReader<std::string>> nonfatal_errors(parser, "JaniceError,JaniceError", "Comma-separated list of nonfatal JanusError codes", {'n', "nonfatal_errors"}, std::vector<std::string>());
@@ -83,6 +85,9 @@ int main(int argc, char* argv[])
 
     context.batch_policy = JaniceFlagAndFinish;
 
+    // Images can be shared by many templates, optionally decode each of them once
+    JANICE_ASSERT(janice_io_opencv_set_still_cache_size((size_t) std::max(0, args::get(media_cache)) * 1024 * 1024), ignored_errors);
+
     // Parse the metadata file
     io::CSVReader<8> metadata(args::get(media_file));
     metadata.read_header(io::ignore_extra_column, "FILENAME", "TEMPLATE_ID", "SUBJECT_ID", "SIGHTING_ID", "FACE_X", "FACE_Y", "FACE_WIDTH", "FACE_HEIGHT");
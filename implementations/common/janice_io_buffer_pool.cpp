@@ -0,0 +1,7 @@
+#include <janice_io_buffer_pool.hpp>
+
+io_utils::BufferPool& io_utils::BufferPool::instance()
+{
+    static BufferPool pool;
+    return pool;
+}
@@ -0,0 +1,221 @@
+#ifndef JANICE_IO_BUFFER_POOL_HPP
+#define JANICE_IO_BUFFER_POOL_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// The pool is defined in the janice_io_common shared library, which every I/O
+// backend links, so a process has one pool however many backends it loads
+#if defined JANICE_IO_COMMON_LIBRARY
+#  if defined _WIN32 || defined __CYGWIN__
+#    define JANICE_IO_COMMON_EXPORT __declspec(dllexport)
+#  else
+#    define JANICE_IO_COMMON_EXPORT __attribute__((visibility("default")))
+#  endif
+#else
+#  if defined _WIN32 || defined __CYGWIN__
+#    define JANICE_IO_COMMON_EXPORT __declspec(dllimport)
+#  else
+#    define JANICE_IO_COMMON_EXPORT
+#  endif
+#endif
+
+namespace io_utils
+{
+
+// A size-bucketed cache of pixel buffers shared by the I/O backends. Frames of a
+// video are all the same size, so after the first few frames every allocation
+// is served from a previously released buffer instead of the system allocator.
+//
+// Each buffer is prefixed with a small header recording its bucket so it can
+// be returned to the pool without knowing the dimensions of the image it held.
+// The pool also remembers every buffer it handed out, so an owned image whose
+// buffer came from malloc instead is passed to free, as before the pool.
+//
+// Batches of frames share a single buffer. Each frame in the batch gets its own
+// header pointing back at the batch, which returns to the pool once all of its
+// frames have been released.
+class BufferPool
+{
+public:
+    // Buffers acquired by one backend are released by another, so this must
+    // not be inlined into each of them
+    JANICE_IO_COMMON_EXPORT static BufferPool& instance();
+
+    uint8_t* acquire(size_t size)
+    {
+        const size_t capacity = bucket_size(size);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            std::vector<Header*>& buffers = free_buffers[capacity];
+            if (!buffers.empty()) {
+                Header* header = buffers.back();
+                buffers.pop_back();
+                cached_bytes -= capacity;
+                ++hits;
+
+                return (uint8_t*) header + header_size;
+            }
+        }
+
+        ++misses;
+
+        void* memory = malloc(header_size + capacity);
+        if (memory == nullptr) {
+            return nullptr;
+        }
+        Header* header = new (memory) Header(capacity, nullptr);
+
+        uint8_t* data = (uint8_t*) header + header_size;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.insert(data);
+        }
+
+        return data;
+    }
+
+    // Allocate num_buffers buffers with the given sizes from one contiguous
+    // block. Each buffer is released on its own.
+    bool acquire_batch(const size_t* sizes, size_t num_buffers, uint8_t** buffers)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < num_buffers; ++i) {
+            total += header_size + slice_size(sizes[i]);
+        }
+
+        uint8_t* block = acquire(total);
+        if (block == nullptr) {
+            return false;
+        }
+        header_of(block)->refs = num_buffers;
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        uint8_t* slice = block;
+        for (size_t i = 0; i < num_buffers; ++i) {
+            new (slice) Header(slice_size(sizes[i]), block);
+            buffers[i] = slice + header_size;
+            this->buffers.insert(buffers[i]);
+            slice += header_size + slice_size(sizes[i]);
+        }
+
+        return true;
+    }
+
+    void release(uint8_t* data)
+    {
+        if (data == nullptr) {
+            return;
+        }
+
+        Header* header = header_of(data);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            // Not ours, owned images built outside the pool use malloc
+            auto buffer = buffers.find(data);
+            if (buffer == buffers.end()) {
+                free(data);
+                return;
+            }
+
+            if (header->parent == nullptr && cached_bytes + header->capacity <= max_cached_bytes) {
+                free_buffers[header->capacity].push_back(header);
+                cached_bytes += header->capacity;
+                return;
+            }
+            buffers.erase(buffer);
+        }
+
+        // Part of a batch, release the batch with its last frame
+        if (header->parent != nullptr) {
+            if (--header_of(header->parent)->refs == 0) {
+                release(header->parent);
+            }
+            return;
+        }
+
+        header->~Header();
+        free(header);
+    }
+
+    void stats(uint64_t* num_hits, uint64_t* num_misses, size_t* num_cached_bytes)
+    {
+        if (num_hits) {
+            *num_hits = hits;
+        }
+        if (num_misses) {
+            *num_misses = misses;
+        }
+        if (num_cached_bytes) {
+            std::lock_guard<std::mutex> lock(mutex);
+            *num_cached_bytes = cached_bytes;
+        }
+    }
+
+private:
+    struct Header
+    {
+        Header(size_t capacity, uint8_t* parent) : capacity(capacity), parent(parent), refs(0) {}
+
+        size_t capacity;
+        uint8_t* parent;          // the batch this buffer belongs to, or NULL
+        std::atomic<size_t> refs; // buffers still using this batch
+    };
+
+    // A full cache line keeps the pixel data at the alignment malloc provides
+    static const size_t header_size = 64;
+
+    static Header* header_of(uint8_t* data)
+    {
+        return (Header*) (data - header_size);
+    }
+
+    // Keep each buffer in a batch at the same alignment as a pooled buffer
+    static size_t slice_size(size_t size)
+    {
+        return (size + header_size - 1) / header_size * header_size;
+    }
+
+    // Round small buffers up to a cache line and large ones up to a page so
+    // frames with nearly identical sizes can share a bucket
+    static size_t bucket_size(size_t size)
+    {
+        const size_t granularity = size < 4096 ? 64 : 4096;
+        return (size + granularity - 1) / granularity * granularity;
+    }
+
+    BufferPool() : cached_bytes(0), max_cached_bytes(size_t(256) << 20), hits(0), misses(0) {}
+
+    ~BufferPool()
+    {
+        for (auto& bucket : free_buffers) {
+            for (Header* header : bucket.second) {
+                header->~Header();
+                free(header);
+            }
+        }
+    }
+
+    std::mutex mutex;
+    std::unordered_map<size_t, std::vector<Header*>> free_buffers;
+    std::unordered_set<const uint8_t*> buffers; // handed out or cached, by data pointer
+    size_t cached_bytes;
+    size_t max_cached_bytes;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+};
+
+} // namespace io_utils
+
+#endif // JANICE_IO_BUFFER_POOL_HPP
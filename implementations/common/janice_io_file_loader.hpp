@@ -0,0 +1,512 @@
+#ifndef JANICE_IO_FILE_LOADER_HPP
+#define JANICE_IO_FILE_LOADER_HPP
+
+#include <janice_io_thread_pool.hpp>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef JANICE_IO_WITH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace io_utils
+{
+
+// Read a whole file with pread, retrying short reads. Returns false if the
+// file can't be opened or read.
+inline bool read_file(const std::string& filename, std::vector<uint8_t>& data)
+{
+    const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0;
+    if (ok) {
+        data.resize(info.st_size);
+
+        size_t done = 0;
+        while (ok && done < data.size()) {
+            const ssize_t count = pread(fd, data.data() + done, data.size() - done, done);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = count > 0;
+            done += ok ? count : 0;
+        }
+    }
+
+    close(fd);
+    return ok;
+}
+
+// Reads whole files into memory in batches, so decoders can start on bytes
+// that are already there. Where the kernel supports io_uring, the reads of a
+// batch are queued on a ring with a single system call and completed by one
+// loader thread, otherwise each file is read with pread on the shared thread
+// pool. Files are still opened one at a time by the caller of load.
+class FileLoader
+{
+public:
+    // Called with the contents of a file, or with ok false if it couldn't be
+    // read, from a loader thread or from load itself if the file can't be
+    // opened. It may take the data by swapping it out.
+    typedef std::function<void(std::vector<uint8_t>& data, bool ok)> Callback;
+
+    static FileLoader& instance()
+    {
+        static FileLoader loader;
+        return loader;
+    }
+
+    // Start reading every file and call its callback once it is in memory
+    void load(const std::vector<std::string>& filenames, const std::vector<Callback>& callbacks)
+    {
+#ifdef JANICE_IO_WITH_IO_URING
+        if (batched()) {
+            load_batch(filenames, callbacks);
+            return;
+        }
+#endif
+
+        for (size_t i = 0; i < filenames.size(); ++i) {
+            const std::string filename = filenames[i];
+            const Callback callback = callbacks[i];
+
+            ThreadPool::instance().submit([filename, callback]() {
+                std::vector<uint8_t> data;
+                const bool ok = read_file(filename, data);
+                callback(data, ok);
+            });
+        }
+    }
+
+    // Whether batches go through io_uring. Once the ring fails, batches fall
+    // back to pread for the rest of the process.
+    bool batched() const
+    {
+#ifdef JANICE_IO_WITH_IO_URING
+        return ring_fd >= 0 && !failed;
+#else
+        return false;
+#endif
+    }
+
+private:
+#ifndef JANICE_IO_WITH_IO_URING
+    FileLoader() {}
+#else
+    // Queue depth of the ring. Larger batches wait in overflow until reads
+    // complete.
+    static const unsigned ring_entries = 64;
+
+    // A file being read. Reads are resubmitted from where they stopped until
+    // the whole file is in data.
+    struct Request
+    {
+        int fd;
+        std::vector<uint8_t> data;
+        size_t done;
+        struct iovec iov;
+        Callback callback;
+    };
+
+    FileLoader() : ring_fd(-1), failed(false), stop(false), reaping(false), polling(false), in_flight(0)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        // Not available before Linux 5.1, and often blocked in containers
+        ring_fd = (int) syscall(__NR_io_uring_setup, ring_entries, &params);
+        if (ring_fd < 0) {
+            return;
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        sq_ring = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? sq_ring
+                : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes = (struct io_uring_sqe*) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+            unmap();
+            close(ring_fd);
+            ring_fd = -1;
+            return;
+        }
+
+        uint8_t* sq = (uint8_t*) sq_ring;
+        sq_head  = (unsigned*) (sq + params.sq_off.head);
+        sq_tail  = (unsigned*) (sq + params.sq_off.tail);
+        sq_mask  = *(unsigned*) (sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*) (sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+
+        uint8_t* cq = (uint8_t*) cq_ring;
+        cq_head = (unsigned*) (cq + params.cq_off.head);
+        cq_tail = (unsigned*) (cq + params.cq_off.tail);
+        cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+        cqes    = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+        reaping = true;
+        reaper = std::thread(&FileLoader::reap, this);
+    }
+
+    ~FileLoader()
+    {
+        if (ring_fd < 0) {
+            return;
+        }
+
+        bool woken = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            // Wake the reaper with a request that completes right away. One
+            // the kernel didn't take yet is only seen if the reaper polls.
+            if (!failed) {
+                if (struct io_uring_sqe* sqe = next_sqe()) {
+                    sqe->opcode = IORING_OP_NOP;
+                    sqe->user_data = 0;
+                    woken = submit() && (unsubmitted() == 0 || polling);
+                }
+            }
+            woken = woken || !reaping;
+        }
+
+        // A failed ring may never wake the reaper again. The process is
+        // exiting, leave the thread and the ring to it.
+        if (!woken) {
+            reaper.detach();
+            return;
+        }
+        reaper.join();
+
+        // Tearing down the ring cancels reads we gave up on before their
+        // buffers go
+        unmap();
+        close(ring_fd);
+
+        for (Request* request : overflow) {
+            close(request->fd);
+            delete request;
+        }
+        for (Request* request : abandoned) {
+            close(request->fd);
+            delete request;
+        }
+    }
+
+    void unmap()
+    {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_size);
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_size);
+        }
+    }
+
+    void load_batch(const std::vector<std::string>& filenames, const std::vector<Callback>& callbacks)
+    {
+        std::vector<Request*> requests;
+        for (size_t i = 0; i < filenames.size(); ++i) {
+            const int fd = open(filenames[i].c_str(), O_RDONLY | O_CLOEXEC);
+
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+
+                std::vector<uint8_t> empty;
+                callbacks[i](empty, false);
+                continue;
+            }
+
+            Request* request = new Request();
+            request->fd = fd;
+            request->data.resize(info.st_size);
+            request->done = 0;
+            request->callback = callbacks[i];
+
+            if (request->data.empty()) {
+                finish(request, true);
+                continue;
+            }
+
+            requests.push_back(request);
+        }
+
+        std::vector<Callback> lost;
+        bool queued;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            overflow.insert(overflow.end(), requests.begin(), requests.end());
+            if (failed || !submit_overflow()) {
+                abandon(lost);
+            }
+            queued = unsubmitted() > 0;
+        }
+        fail(lost);
+
+        // The kernel was busy. The reaper resubmits after its next completion,
+        // but if nothing is being read there is none, so retry until the
+        // entries are taken without holding the lock the reaper needs.
+        while (queued) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+            std::vector<Callback> dropped;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!failed && !submit()) {
+                    abandon(dropped);
+                }
+                queued = !failed && unsubmitted() > 0;
+            }
+            fail(dropped);
+        }
+    }
+
+    // The next free submission queue entry, or NULL if the ring is full. mutex
+    // must be held.
+    struct io_uring_sqe* next_sqe()
+    {
+        const unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+            return nullptr;
+        }
+
+        const unsigned index = tail & sq_mask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        return sqe;
+    }
+
+    // Entries in the submission queue the kernel hasn't taken yet. mutex must
+    // be held.
+    unsigned unsubmitted() const
+    {
+        return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    // Hand queued entries to the kernel. If it is out of resources or its
+    // completion queue is full, the rest are left queued for a later call.
+    // Returns false if the ring failed. mutex must be held.
+    bool submit()
+    {
+        while (unsubmitted() > 0) {
+            const int submitted = (int) syscall(__NR_io_uring_enter, ring_fd, unsubmitted(), 0, 0, nullptr, 0);
+            if (submitted < 0 && errno == EINTR) {
+                continue;
+            } else if (submitted < 0) {
+                return errno == EAGAIN || errno == EBUSY;
+            } else if (submitted == 0) {
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    // Queue reads for waiting requests while there is room, and submit them
+    // along with any entries left queued before. Returns false if the ring
+    // failed. mutex must be held.
+    bool submit_overflow()
+    {
+        while (!overflow.empty() && in_flight < sq_entries) {
+            struct io_uring_sqe* sqe = next_sqe();
+            if (sqe == nullptr) {
+                break;
+            }
+
+            Request* request = overflow.front();
+            overflow.pop_front();
+
+            request->iov.iov_base = request->data.data() + request->done;
+            request->iov.iov_len  = request->data.size() - request->done;
+
+            sqe->opcode    = IORING_OP_READV;
+            sqe->fd        = request->fd;
+            sqe->off       = request->done;
+            sqe->addr      = (uint64_t) &request->iov;
+            sqe->len       = 1;
+            sqe->user_data = (uint64_t) request;
+
+            submitted.insert(request);
+            ++in_flight;
+        }
+
+        return submit();
+    }
+
+    // Give up on the ring after an error. Waiting requests are dropped, and
+    // requests the kernel may still be reading into are kept until the loader
+    // is destroyed. Their callbacks are returned in lost, to be called with
+    // fail once mutex is released. Later batches are read with pread. mutex
+    // must be held.
+    void abandon(std::vector<Callback>& lost)
+    {
+        failed = true;
+
+        for (Request* request : overflow) {
+            lost.push_back(request->callback);
+            close(request->fd);
+            delete request;
+        }
+        overflow.clear();
+
+        for (Request* request : submitted) {
+            lost.push_back(request->callback);
+            abandoned.push_back(request);
+        }
+        submitted.clear();
+        in_flight = 0;
+    }
+
+    static void fail(const std::vector<Callback>& lost)
+    {
+        for (const Callback& callback : lost) {
+            std::vector<uint8_t> empty;
+            callback(empty, false);
+        }
+    }
+
+    static void finish(Request* request, bool ok)
+    {
+        close(request->fd);
+        request->callback(request->data, ok);
+        delete request;
+    }
+
+    // Wait for completions and hand finished files to their callbacks
+    void reap()
+    {
+        bool poll = false;
+        while (true) {
+            // While entries are left queued there may be no completion to wait
+            // for, so check back for them instead
+            if (poll) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+            const int ret = (int) syscall(__NR_io_uring_enter, ring_fd, 0, poll ? 0 : 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            const bool ring_failed = ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY;
+
+            std::vector<std::pair<Request*, bool>> finished;
+            std::vector<Callback> lost;
+            bool exit = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                unsigned head = *cq_head;
+                while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                    const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+                    ++head;
+
+                    // The wake up from the destructor, or a read we gave up on
+                    Request* request = (Request*) cqe.user_data;
+                    if (request == nullptr || submitted.erase(request) == 0) {
+                        continue;
+                    }
+                    --in_flight;
+
+                    if (cqe.res < 0 && (cqe.res == -EINTR || cqe.res == -EAGAIN)) {
+                        overflow.push_front(request);
+                    } else if (cqe.res <= 0) {
+                        finished.emplace_back(request, false); // an error, or the file shrank
+                    } else if (request->done + cqe.res < request->data.size()) {
+                        request->done += cqe.res; // a short read, read the rest
+                        overflow.push_front(request);
+                    } else {
+                        finished.emplace_back(request, true);
+                    }
+                }
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+                if (ring_failed || (!failed && !submit_overflow())) {
+                    abandon(lost);
+                }
+
+                exit = failed || (stop && in_flight == 0);
+                reaping = !exit;
+                poll = polling = !exit && unsubmitted() > 0;
+            }
+
+            // Callbacks run without the lock so they can queue more files
+            for (auto& entry : finished) {
+                finish(entry.first, entry.second);
+            }
+            fail(lost);
+
+            if (exit) {
+                return;
+            }
+        }
+    }
+
+    int ring_fd;
+    void* sq_ring = MAP_FAILED;
+    void* cq_ring = MAP_FAILED;
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*) MAP_FAILED;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_cqe* cqes;
+    unsigned cq_mask;
+
+    std::atomic<bool> failed; // set once, batches use pread from then on
+
+    std::mutex mutex; // guards the submission queue and everything below
+    std::thread reaper;
+    bool stop;
+    bool reaping; // the reaper is still waiting for completions
+    bool polling; // the reaper checks back for entries left queued
+    unsigned in_flight;
+    std::deque<Request*> overflow;          // requests waiting for room in the ring
+    std::unordered_set<Request*> submitted; // requests the kernel is reading
+    std::vector<Request*> abandoned;        // given up on, the kernel may still write to them
+#endif // JANICE_IO_WITH_IO_URING
+};
+
+} // namespace io_utils
+
+#endif // JANICE_IO_FILE_LOADER_HPP
@@ -0,0 +1,53 @@
+#ifndef JANICE_IO_FORMAT_HPP
+#define JANICE_IO_FORMAT_HPP
+
+#include <janice_io.h>
+
+namespace io_utils
+{
+
+inline bool valid_format(const JaniceImageFormat& format)
+{
+    return (format.rows == 0) == (format.cols == 0)
+        && format.channel_order >= JaniceChannelsBGR && format.channel_order <= JaniceChannelsGray
+        && format.pixel_type >= JanicePixelUInt8 && format.pixel_type <= JanicePixelFloat32;
+}
+
+// The output format of an iterator, as requested with set_format. Converting
+// frames needs OpenCV, see janice_io_format_opencv.hpp.
+class OutputFormat
+{
+public:
+    OutputFormat() : requested(false) {}
+
+    // Request format, or the native format if format is NULL
+    JaniceError set(const JaniceImageFormat* format)
+    {
+        if (format == nullptr) {
+            requested = false;
+            return JANICE_SUCCESS;
+        }
+
+        if (!valid_format(*format)) {
+            return JANICE_BAD_ARGUMENT;
+        }
+
+        this->format = *format;
+        requested = true;
+        return JANICE_SUCCESS;
+    }
+
+    // The requested format, or NULL for the native format
+    const JaniceImageFormat* get() const
+    {
+        return requested ? &format : nullptr;
+    }
+
+private:
+    bool requested;
+    JaniceImageFormat format;
+};
+
+} // namespace io_utils
+
+#endif // JANICE_IO_FORMAT_HPP
@@ -0,0 +1,158 @@
+#ifndef JANICE_IO_FORMAT_OPENCV_HPP
+#define JANICE_IO_FORMAT_OPENCV_HPP
+
+#include <janice_io.h>
+#include <janice_io_buffer_pool.hpp>
+#include <janice_io_format.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <vector>
+
+namespace io_utils
+{
+
+// Conversion of decoded frames to the format requested with set_format. Frames
+// are resized first, so color conversion and normalization only touch the
+// pixels we keep, and the result is written once into a pool buffer. Every
+// step is one of OpenCV's vectorized kernels.
+
+// A cv::Mat header over the pixels of a JaniceImage, without a copy
+inline cv::Mat janice_image_to_cv_mat(const JaniceImage& image)
+{
+    return cv::Mat(image.rows, image.cols, CV_8UC(image.channels), image.data);
+}
+
+// The cvtColor code taking a BGR, BGRA or grayscale frame to channel_order, or
+// -1 if it is already there
+inline int color_conversion(int channels, JaniceChannelOrder channel_order)
+{
+    switch (channel_order) {
+        case JaniceChannelsRGB:
+            return channels == 1 ? cv::COLOR_GRAY2RGB : channels == 4 ? cv::COLOR_BGRA2RGB : cv::COLOR_BGR2RGB;
+        case JaniceChannelsGray:
+            return channels == 1 ? -1 : channels == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY;
+        default:
+            return channels == 1 ? cv::COLOR_GRAY2BGR : channels == 4 ? cv::COLOR_BGRA2BGR : -1;
+    }
+}
+
+// Resize, color convert and normalize frame. converted may share pixels with
+// frame if nothing had to change. Returns false if frame isn't BGR, BGRA or
+// grayscale.
+inline bool convert_format(const cv::Mat& frame, const JaniceImageFormat& format, cv::Mat& converted)
+{
+    if (frame.channels() != 1 && frame.channels() != 3 && frame.channels() != 4) {
+        return false;
+    }
+
+    converted = frame;
+
+    if (format.rows != 0 && (converted.rows != (int) format.rows || converted.cols != (int) format.cols)) {
+        const bool shrinking = format.rows * format.cols < converted.total();
+
+        cv::Mat resized;
+        cv::resize(converted, resized, cv::Size(format.cols, format.rows), 0, 0,
+                   shrinking ? cv::INTER_AREA : cv::INTER_LINEAR);
+        converted = resized;
+    }
+
+    const int code = color_conversion(converted.channels(), format.channel_order);
+    if (code >= 0) {
+        cv::Mat colored;
+        cv::cvtColor(converted, colored, code);
+        converted = colored;
+    }
+
+    if (format.pixel_type == JanicePixelFloat32) {
+        cv::Mat normalized;
+        converted.convertTo(normalized, CV_32F);
+        cv::subtract(normalized, cv::Scalar(format.mean[0], format.mean[1], format.mean[2]), normalized);
+        cv::multiply(normalized, cv::Scalar(format.scale[0], format.scale[1], format.scale[2]), normalized);
+        converted = normalized;
+    }
+
+    return true;
+}
+
+// The size in bytes of a converted frame
+inline size_t formatted_size(const cv::Mat& converted)
+{
+    return converted.total() * converted.elemSize();
+}
+
+// Write a converted frame to data, one plane per channel if planar
+inline void store_formatted(const cv::Mat& converted, bool planar, uint8_t* data)
+{
+    if (!planar || converted.channels() == 1) {
+        cv::Mat stored(converted.rows, converted.cols, converted.type(), data);
+        converted.copyTo(stored);
+        return;
+    }
+
+    // split writes straight into the planes of the output
+    const size_t plane_size = converted.total() * converted.elemSize1();
+    std::vector<cv::Mat> planes;
+    for (int c = 0; c < converted.channels(); ++c) {
+        planes.emplace_back(converted.rows, converted.cols, converted.depth(), data + c * plane_size);
+    }
+    cv::split(converted, planes);
+}
+
+inline void describe_formatted(const cv::Mat& converted, uint8_t* data, JaniceImage& image)
+{
+    image.channels = converted.channels();
+    image.rows     = converted.rows;
+    image.cols     = converted.cols;
+    image.data     = data;
+    image.owner    = true;
+}
+
+// Convert a frame to format in a new buffer from the pool
+inline JaniceError format_janice_image(const cv::Mat& frame, const JaniceImageFormat& format, JaniceImage& image)
+{
+    cv::Mat converted;
+    if (!convert_format(frame, format, converted)) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    uint8_t* data = BufferPool::instance().acquire(formatted_size(converted));
+    if (data == nullptr) {
+        return JANICE_OUT_OF_MEMORY;
+    }
+
+    store_formatted(converted, format.planar, data);
+    describe_formatted(converted, data, image);
+
+    return JANICE_SUCCESS;
+}
+
+// Convert a batch of frames to format in one contiguous buffer from the pool.
+// Each image in the batch owns its slice, like an unformatted batch.
+inline JaniceError format_janice_batch(const std::vector<cv::Mat>& frames, const JaniceImageFormat& format, JaniceImage* images)
+{
+    std::vector<cv::Mat> converted(frames.size());
+    std::vector<size_t> sizes(frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+        if (!convert_format(frames[i], format, converted[i])) {
+            return JANICE_INVALID_MEDIA;
+        }
+        sizes[i] = formatted_size(converted[i]);
+    }
+
+    std::vector<uint8_t*> buffers(frames.size());
+    if (!BufferPool::instance().acquire_batch(sizes.data(), frames.size(), buffers.data())) {
+        return JANICE_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = 0; i < frames.size(); ++i) {
+        store_formatted(converted[i], format.planar, buffers[i]);
+        describe_formatted(converted[i], buffers[i], images[i]);
+    }
+
+    return JANICE_SUCCESS;
+}
+
+} // namespace io_utils
+
+#endif // JANICE_IO_FORMAT_OPENCV_HPP
@@ -0,0 +1,83 @@
+#ifndef JANICE_IO_PYRAMID_OPENCV_HPP
+#define JANICE_IO_PYRAMID_OPENCV_HPP
+
+#include <janice_io.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <vector>
+
+namespace io_utils
+{
+
+// The image pyramid of one frame, as returned by get_pyramid. Levels are
+// built on demand, each with cv::pyrDown from the level before, so asking
+// for a deeper level never resamples the full frame again.
+class FramePyramid
+{
+public:
+    FramePyramid() : requested(false), frame(0) {}
+
+    // Whether a pyramid was ever asked for, so frames should be offered
+    bool active() const
+    {
+        return requested;
+    }
+
+    bool has(uint32_t frame) const
+    {
+        return !levels.empty() && this->frame == frame;
+    }
+
+    // Start the pyramid of frame. image must not be written to afterwards,
+    // decoded frames are kept by reference.
+    void set(uint32_t frame, const cv::Mat& image)
+    {
+        requested = true;
+        this->frame = frame;
+        levels.assign(1, image);
+    }
+
+    // Called with every frame an iterator returns from next. Once a pyramid
+    // has been asked for, the latest frame is kept so its pyramid doesn't need
+    // another decode.
+    void offer(uint32_t frame, const cv::Mat& image)
+    {
+        if (requested) {
+            set(frame, image);
+        }
+    }
+
+    void clear()
+    {
+        levels.clear();
+    }
+
+    // Get level of the pyramid, 0 being the frame itself. Returns false once
+    // the levels are down to a single pixel.
+    bool level(uint32_t level, cv::Mat& image)
+    {
+        while (levels.size() <= level) {
+            const cv::Mat& last = levels.back();
+            if (last.rows <= 1 && last.cols <= 1) {
+                return false;
+            }
+
+            cv::Mat down;
+            cv::pyrDown(last, down);
+            levels.push_back(down);
+        }
+
+        image = levels[level];
+        return true;
+    }
+
+private:
+    bool requested;
+    uint32_t frame;
+    std::vector<cv::Mat> levels;
+};
+
+} // namespace io_utils
+
+#endif // JANICE_IO_PYRAMID_OPENCV_HPP
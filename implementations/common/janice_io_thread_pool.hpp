@@ -0,0 +1,91 @@
+#ifndef JANICE_IO_THREAD_POOL_HPP
+#define JANICE_IO_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace io_utils
+{
+
+// A process-wide pool of worker threads for background decoding and file I/O.
+// Iterators submit small, independent tasks so many iterators can share a
+// fixed number of threads instead of each starting their own.
+class ThreadPool
+{
+public:
+    static ThreadPool& instance()
+    {
+        static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    size_t size() const
+    {
+        return workers.size();
+    }
+
+private:
+    explicit ThreadPool(unsigned num_threads) : stop(false)
+    {
+        for (unsigned i = 0; i < num_threads; ++i) {
+            workers.emplace_back(&ThreadPool::run, this);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void run()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return stop || !tasks.empty(); });
+
+                if (stop && tasks.empty()) {
+                    return;
+                }
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> workers;
+    bool stop;
+};
+
+} // namespace io_utils
+
+#endif // JANICE_IO_THREAD_POOL_HPP
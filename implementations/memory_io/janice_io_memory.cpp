@@ -7,7 +7,10 @@ namespace
 struct JaniceMediaIteratorStateType
 {
     JaniceImage image;
+    bool borrowed; // image is the caller's, see janice_io_memory_create_borrowed_media_iterator
     bool at_end;
+    io_utils::OutputFormat format; // set with set_format
+    mem_utils::FramePyramid pyramid; // see get_pyramid
 };
 
 
@@ -35,7 +38,7 @@ JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
         return JANICE_MEDIA_AT_END;
     }
 
-    JaniceError ret = mem_utils::copy_janice_image(state->image, *image);
+    JaniceError ret = mem_utils::output_janice_image(state->image, *image, state->borrowed, state->format.get());
     if (ret == JANICE_SUCCESS) { // Don't mark finished unless the copy succeeded
         state->at_end = true;
     }
@@ -43,6 +46,35 @@ JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
     return ret;
 }
 
+// a still image is a batch of one
+JaniceError next_batch(JaniceMediaIterator* it, JaniceImage* images, uint32_t max_images, uint32_t* num_images)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (images == NULL || num_images == NULL) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    *num_images = 0;
+
+    if (state->at_end) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    if (max_images == 0) {
+        return JANICE_SUCCESS;
+    }
+
+    JaniceError ret = state->borrowed && !state->format.get() ? mem_utils::read_janice_image(state->image, images[0], true)
+                                                              : mem_utils::output_janice_batch(&state->image, 1, images, state->format.get());
+    if (ret == JANICE_SUCCESS) {
+        state->at_end = true;
+        *num_images = 1;
+    }
+
+    return ret;
+}
+
 // seek to the specified frame number
 JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
 {
@@ -62,7 +94,22 @@ JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
     }
 
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
-    return mem_utils::copy_janice_image(state->image, *image);
+    return mem_utils::output_janice_image(state->image, *image, state->borrowed, state->format.get());
+}
+
+// get a region of the specified frame. Only the region is copied.
+JaniceError get_roi(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, const JaniceRect* rect)
+{
+    if (frame != 0) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    if (rect == NULL) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return mem_utils::output_janice_image_roi(state->image, *rect, *image, state->format.get());
 }
 
 // say what frame we are currently on.
@@ -83,14 +130,29 @@ JaniceError physical_frame(JaniceMediaIterator*, uint32_t logical, uint32_t *phy
     return JANICE_SUCCESS;
 }
 
-JaniceError free_image(JaniceImage* image)
+JaniceError get_pyramid(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, uint32_t level)
 {
-    if (image && image->owner) {
-        free(image->data);
-        image->data = nullptr;
+    if (frame != 0) {
+        return JANICE_INVALID_MEDIA;
     }
 
-    return JANICE_SUCCESS;
+    if (image == NULL) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return mem_utils::output_pyramid_level(state->pyramid, frame, state->image, level, *image);
+}
+
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->format.set(format);
+}
+
+JaniceError free_image(JaniceImage* image)
+{
+    return mem_utils::free_janice_image(image);
 }
 
 JaniceError free_iterator(JaniceMediaIterator* it)
@@ -98,6 +160,9 @@ JaniceError free_iterator(JaniceMediaIterator* it)
     if (it && it->_internal) {
         JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
         free_image(&state->image);
+
+        delete state;
+        it->_internal = nullptr;
     }
 
     return JANICE_SUCCESS;
@@ -111,22 +176,21 @@ JaniceError reset(JaniceMediaIterator* it)
     return JANICE_SUCCESS;
 }
 
-} // anoymous namespace
-
-// ----------------------------------------------------------------------------
-// OpenCV I/O only, create an opencv_io media iterator 
-
-JaniceError janice_io_memory_create_media_iterator(const JaniceImage* image, JaniceMediaIterator* it)
+static JaniceError create_iterator(const JaniceImage* image, bool borrow, JaniceMediaIterator* it)
 {
     it->is_video = &is_video;
     it->get_frame_rate =  &get_frame_rate;
     it->get_physical_frame_rate =  &get_physical_frame_rate;
 
     it->next = &next;
+    it->next_batch = &next_batch;
     it->seek = &seek;
     it->get  = &get;
+    it->get_roi = &get_roi;
     it->tell = &tell;
     it->physical_frame = &physical_frame;
+    it->set_format = mem_utils::formats_supported ? &set_format : nullptr;
+    it->get_pyramid = mem_utils::pyramids_supported ? &get_pyramid : nullptr;
 
     it->free_image = &free_image;
     it->free       = &free_iterator;
@@ -134,12 +198,39 @@ JaniceError janice_io_memory_create_media_iterator(const JaniceImage* image, Jan
     it->reset      = &reset;
 
     JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
-    JaniceError ret = mem_utils::copy_janice_image(*image, state->image);
+    JaniceError ret = mem_utils::read_janice_image(*image, state->image, borrow);
     if (ret != JANICE_SUCCESS) {
+        delete state;
         return ret;
     }
+    state->borrowed = borrow;
+    state->at_end = false;
 
     it->_internal = (void*) (state);
 
     return JANICE_SUCCESS;
 }
+
+} // anoymous namespace
+
+// ----------------------------------------------------------------------------
+// OpenCV I/O only, create an opencv_io media iterator 
+
+JaniceError janice_io_memory_create_media_iterator(const JaniceImage* image, JaniceMediaIterator* it)
+{
+    return create_iterator(image, false, it);
+}
+
+JaniceError janice_io_memory_create_borrowed_media_iterator(const JaniceImage* image, JaniceMediaIterator* it)
+{
+    return create_iterator(image, true, it);
+}
+
+// ----------------------------------------------------------------------------
+// Frame buffer pool statistics
+
+JaniceError janice_io_memory_get_buffer_pool_stats(uint64_t* hits, uint64_t* misses, size_t* cached_bytes)
+{
+    io_utils::BufferPool::instance().stats(hits, misses, cached_bytes);
+    return JANICE_SUCCESS;
+}
@@ -35,6 +35,192 @@ JANICE_EXPORT JaniceError janice_io_memory_create_sparse_media_iterator(const Ja
                                                                         size_t num_images,
                                                                         JaniceMediaIterator* it);
 
+/*!
+ * \brief Create a sparse iterator over frames extracted from known positions of
+ *        a video, for example its keyframes.
+ *
+ * The images are stored in the iterator in increasing frame order. Logical
+ * frames, as used by seek, get and tell, are positions in that order, and
+ * physical_frame maps them back to the given frame numbers so results can be
+ * related to the original video.
+ * \param images An array of JaniceImage structs. Each struct is copied into the iterator.
+ * \param frames An array of frame numbers associated with the given images.
+ * \param num_images The number of elements in *images* and *frames*.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *          an error code.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_create_sparse_media_iterator_with_frames(const JaniceImage* images,
+                                                                                    const uint32_t* frames,
+                                                                                    size_t num_images,
+                                                                                    JaniceMediaIterator* it);
+
+/*!
+ * \brief Find the image of a sparse iterator taken from a frame of the video,
+ *        the inverse of physical_frame.
+ *
+ * Returns the first image whose frame is at or after *frame*, found by binary
+ * search over the frame numbers. Compare its physical_frame with *frame* to
+ * tell whether the frame itself is in the iterator. Without frame numbers,
+ * logical and physical frames are the same.
+ * \param it An iterator created by janice_io_memory_create_sparse_media_iterator,
+ *        janice_io_memory_create_sparse_media_iterator_with_frames or
+ *        janice_io_memory_create_sparse_borrowed_media_iterator.
+ * \param frame A frame of the video.
+ * \param logical Set to the logical frame, as used by seek, get and tell, of the
+ *        first image at or after *frame*.
+ * \returns JANICE_SUCCESS on success, JANICE_BAD_ARGUMENT if *it* is not a memory
+ *          sparse iterator or JANICE_OUT_OF_BOUNDS_ACCESS if every image comes
+ *          before *frame*.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_sparse_find_frame(JaniceMediaIterator* it,
+                                                             uint32_t frame,
+                                                             uint32_t* logical);
+
+/*!
+ * \brief Create a JaniceMediaIterator that borrows an image in memory instead of
+ *        copying it. next and get return views of the caller's pixels with
+ *        owner == false, so reading a frame costs nothing. get_roi still
+ *        copies, since a region can't be described without a stride.
+ *
+ * The caller keeps ownership of image->data. It must stay valid, and should
+ * not be modified, until the iterator and every image returned by it have been
+ * freed. free_image must still be called on returned images but never frees
+ * the caller's buffer.
+ * \param image A pointer to a JaniceImage containing a buffer. Only the struct is
+ *        copied into the iterator.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *      error code.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_create_borrowed_media_iterator(const JaniceImage* image,
+                                                                          JaniceMediaIterator* it);
+
+/*!
+ * \brief Create a sparse iterator that borrows a collection of images in memory
+ *        instead of copying them. The same lifetime rules as
+ *        janice_io_memory_create_borrowed_media_iterator apply to every image.
+ *        Images returned by next_batch are views too, so they are only
+ *        contiguous if the caller's images are.
+ * \param images An array of JaniceImage structs. Only the structs are copied
+ *        into the iterator.
+ * \param num_images The number of elements in *images*.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *          an error code.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_create_sparse_borrowed_media_iterator(const JaniceImage* images,
+                                                                                 size_t num_images,
+                                                                                 JaniceMediaIterator* it);
+
+/*!
+ * \brief Create a JaniceMediaIterator from an encoded image in memory, for
+ *        example the bytes of a JPEG or PNG file. The image is decoded each
+ *        time it is read, so only the compressed bytes are held between reads.
+ *        Decoded images are in the same BGR channel order as images read from
+ *        disk by opencv_io. Requires memory_io to be built with OpenCV,
+ *        otherwise JANICE_NOT_IMPLEMENTED is returned.
+ * \param buffer The encoded image.
+ * \param length The size of buffer in bytes. Must be > 0 and at most INT_MAX.
+ * \param share If true the iterator reads buffer in place, and buffer must stay
+ *        valid and unchanged until the iterator is freed. Otherwise buffer is
+ *        copied into the iterator and can be safely deleted after this call.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *      error code. A buffer that can't be decoded is reported when it is read.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_create_encoded_media_iterator(const uint8_t* buffer,
+                                                                         size_t length,
+                                                                         bool share,
+                                                                         JaniceMediaIterator* it);
+
+/*!
+ * \brief Create a sparse iterator over a collection of encoded images in
+ *        memory. Each image is decoded when it is read, see
+ *        janice_io_memory_create_encoded_media_iterator.
+ * \param buffers An array of encoded images.
+ * \param lengths The size of each buffer in bytes. Each must be > 0 and at most
+ *        INT_MAX.
+ * \param num_buffers The number of elements in *buffers* and *lengths*.
+ * \param share If true the iterator reads the buffers in place, and they must
+ *        stay valid and unchanged until the iterator is freed. Otherwise they
+ *        are copied into the iterator.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *          an error code.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_create_sparse_encoded_media_iterator(const uint8_t* const* buffers,
+                                                                                const size_t* lengths,
+                                                                                size_t num_buffers,
+                                                                                bool share,
+                                                                                JaniceMediaIterator* it);
+
+/*!
+ * \brief Create a JaniceMediaIterator over frames pushed by a producer, for
+ *        example a thread reading a live camera. Frames are queued in a
+ *        bounded lock-free ring between one producer and one consumer.
+ *
+ * next blocks until a frame is pushed and returns JANICE_MEDIA_AT_END once
+ * the iterator is closed and every queued frame has been read. Frames are
+ * numbered in the order they are pushed, tell returns the number of the oldest
+ * queued frame. The iterator can't seek, get or reset, those return
+ * JANICE_NOT_IMPLEMENTED.
+ * \param capacity The maximum number of frames waiting to be read. Must be > 0.
+ * \param drop_oldest What to do when a frame is pushed to a full ring. If true
+ *        the oldest waiting frame is discarded, which bounds latency. If false
+ *        janice_io_memory_push_frame blocks until the consumer reads a frame.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *          an error code.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_create_live_media_iterator(uint32_t capacity,
+                                                                      bool drop_oldest,
+                                                                      JaniceMediaIterator* it);
+
+/*!
+ * \brief Push a frame to an iterator created with
+ *        janice_io_memory_create_live_media_iterator. The frame is copied and
+ *        can be safely deleted after this call. Only one thread may push frames
+ *        to an iterator, and it must stop before the iterator is freed.
+ * \param it A live media iterator.
+ * \param image The frame to push.
+ * \returns JANICE_SUCCESS if the frame was queued, JANICE_MEDIA_AT_END if the
+ *          iterator was closed, JANICE_BAD_ARGUMENT if it is not a live iterator.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_push_frame(JaniceMediaIterator* it,
+                                                      const JaniceImage* image);
+
+/*!
+ * \brief Mark the end of the frames pushed to a live iterator. Frames already
+ *        queued can still be read, after which next returns JANICE_MEDIA_AT_END.
+ *        Must be called from the thread that pushes frames.
+ * \param it A live media iterator.
+ * \returns JANICE_SUCCESS, or JANICE_BAD_ARGUMENT if it is not a live iterator.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_close_live_media_iterator(JaniceMediaIterator* it);
+
+/*!
+ * \brief Query the frame buffer pool shared by the opencv_io and memory_io
+ *        backends. Image buffers released with free_image are kept in the pool
+ *        and reused by later frames of a similar size, so images returned with
+ *        owner == true must be released with free_image and never passed to
+ *        free. free_image still frees owned images the caller allocated with
+ *        malloc.
+ * \param hits Set to the number of allocations served from the pool. May be NULL.
+ * \param misses Set to the number of allocations that required a new buffer. May be NULL.
+ * \param cached_bytes Set to the number of bytes currently held in the pool. May be NULL.
+ * \returns JANICE_SUCCESS
+ */
+JANICE_EXPORT JaniceError janice_io_memory_get_buffer_pool_stats(uint64_t* hits,
+                                                                 uint64_t* misses,
+                                                                 size_t* cached_bytes);
+
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,397 @@
+#include <janice_io_memory.h>
+#include <janice_io_memory_utils.hpp>
+
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+namespace
+{
+
+// Compressed images (JPEG, PNG, ...) held in memory and decoded on access. A
+// single image iterates like janice_io_memory_create_media_iterator, several
+// like janice_io_memory_create_sparse_media_iterator.
+struct JaniceMediaIteratorStateType
+{
+    std::vector<const uint8_t*> buffers;
+    std::vector<size_t> lengths;
+    std::vector<std::vector<uint8_t>> copies; // backs buffers unless shared
+
+    bool sparse;
+    size_t pos;
+    io_utils::OutputFormat format; // set with set_format
+    io_utils::FramePyramid pyramid; // of the last image, see get_pyramid
+};
+
+static JaniceError decode(const JaniceMediaIteratorStateType* state, size_t index, cv::Mat& image)
+{
+    const cv::Mat encoded(1, (int) state->lengths[index], CV_8U, (void*) state->buffers[index]);
+
+    try {
+        image = cv::imdecode(encoded, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
+    } catch (...) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    if (!image.data) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+// A JaniceImage header over the pixels of a decoded image. imdecode always
+// returns a continuous image.
+static JaniceImage view(const cv::Mat& m)
+{
+    JaniceImage image;
+    image.channels = m.channels();
+    image.rows     = m.rows;
+    image.cols     = m.cols;
+    image.data     = m.data;
+    image.owner    = false;
+
+    return image;
+}
+
+// Copy a decoded image, converting it to the requested format if there is one
+static JaniceError output(const JaniceMediaIteratorStateType* state, const cv::Mat& decoded, JaniceImage& image)
+{
+    if (const JaniceImageFormat* format = state->format.get()) {
+        return io_utils::format_janice_image(decoded, *format, image);
+    }
+
+    return mem_utils::copy_janice_image(view(decoded), image);
+}
+
+static bool valid_frame(const JaniceMediaIteratorStateType* state, uint32_t frame)
+{
+    return frame < state->buffers.size();
+}
+
+JaniceError is_video(JaniceMediaIterator* it, bool* video)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    *video = state->sparse; // Treat several images as a video
+    return JANICE_SUCCESS;
+}
+
+JaniceError get_frame_rate(JaniceMediaIterator*, float*)
+{
+    return JANICE_INVALID_MEDIA;
+}
+
+JaniceError get_physical_frame_rate(JaniceMediaIterator* it, float* frame_rate)
+{
+    return get_frame_rate(it, frame_rate);
+}
+
+JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (state->pos == state->buffers.size()) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    cv::Mat decoded;
+    JaniceError ret = decode(state, state->pos, decoded);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    ret = output(state, decoded, *image);
+    if (ret == JANICE_SUCCESS) {
+        state->pyramid.offer(state->pos, decoded);
+        ++state->pos;
+    }
+
+    return ret;
+}
+
+JaniceError next_batch(JaniceMediaIterator* it, JaniceImage* images, uint32_t max_images, uint32_t* num_images)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (images == nullptr || num_images == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    *num_images = 0;
+
+    if (state->pos == state->buffers.size()) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    const size_t count = std::min((size_t) max_images, state->buffers.size() - state->pos);
+
+    std::vector<cv::Mat> decoded;
+    std::vector<JaniceImage> views;
+    while (decoded.size() < count) {
+        cv::Mat image;
+        JaniceError ret = decode(state, state->pos + decoded.size(), image);
+        if (ret != JANICE_SUCCESS) {
+            // Return the images we have, the error repeats on the next call
+            if (!decoded.empty()) {
+                break;
+            }
+            return ret;
+        }
+
+        decoded.push_back(image);
+        views.push_back(view(image));
+    }
+
+    if (views.empty()) {
+        return JANICE_SUCCESS;
+    }
+
+    JaniceError ret = state->format.get() ? io_utils::format_janice_batch(decoded, *state->format.get(), images)
+                                          : mem_utils::copy_janice_images_batch(views.data(), views.size(), images);
+    if (ret == JANICE_SUCCESS) {
+        state->pyramid.offer(state->pos + decoded.size() - 1, decoded.back());
+        state->pos += views.size();
+        *num_images = views.size();
+    }
+
+    return ret;
+}
+
+JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (!valid_frame(state, frame)) {
+        return state->sparse ? JANICE_BAD_ARGUMENT : JANICE_INVALID_MEDIA;
+    }
+
+    state->pos = frame;
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (!valid_frame(state, frame)) {
+        return state->sparse ? JANICE_BAD_ARGUMENT : JANICE_INVALID_MEDIA;
+    }
+
+    cv::Mat decoded;
+    JaniceError ret = decode(state, frame, decoded);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    return output(state, decoded, *image);
+}
+
+JaniceError get_roi(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, const JaniceRect* rect)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (!valid_frame(state, frame)) {
+        return state->sparse ? JANICE_BAD_ARGUMENT : JANICE_INVALID_MEDIA;
+    }
+
+    if (rect == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    cv::Mat decoded;
+    JaniceError ret = decode(state, frame, decoded);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    return mem_utils::output_janice_image_roi(view(decoded), *rect, *image, state->format.get());
+}
+
+JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (!state->sparse) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    if (state->pos == state->buffers.size()) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    *frame = state->pos;
+
+    return JANICE_SUCCESS;
+}
+
+// Map a logical frame number (as from tell) to a physical frame number, allowing
+// for downsampling, clipping, etc. on videos. Here, we just return the physical frame.
+JaniceError physical_frame(JaniceMediaIterator*, uint32_t logical, uint32_t *physical)
+{
+    if (physical == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    *physical = logical;
+    return JANICE_SUCCESS;
+}
+
+// The image last returned by next is kept once a pyramid has been asked for,
+// so it isn't decoded again
+JaniceError get_pyramid(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, uint32_t level)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (!valid_frame(state, frame)) {
+        return state->sparse ? JANICE_BAD_ARGUMENT : JANICE_INVALID_MEDIA;
+    }
+
+    if (image == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    if (!state->pyramid.has(frame)) {
+        cv::Mat decoded;
+        JaniceError ret = decode(state, frame, decoded);
+        if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+
+        state->pyramid.set(frame, decoded);
+    }
+
+    return mem_utils::output_pyramid_level(state->pyramid, level, *image);
+}
+
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->format.set(format);
+}
+
+JaniceError free_image(JaniceImage* image)
+{
+    return mem_utils::free_janice_image(image);
+}
+
+JaniceError free_iterator(JaniceMediaIterator* it)
+{
+    if (it && it->_internal) {
+        delete (JaniceMediaIteratorStateType*) it->_internal;
+        it->_internal = nullptr;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError reset(JaniceMediaIterator* it)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    state->pos = 0;
+
+    return JANICE_SUCCESS;
+}
+
+static JaniceError create_iterator(const uint8_t* const* buffers,
+                                   const size_t* lengths,
+                                   size_t num_buffers,
+                                   bool share,
+                                   bool sparse,
+                                   JaniceMediaIterator* it)
+{
+    if (buffers == nullptr || lengths == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    // cv::imdecode takes the buffer as a cv::Mat, which counts columns in an int
+    for (size_t i = 0; i < num_buffers; ++i) {
+        if (buffers[i] == nullptr || lengths[i] == 0 || lengths[i] > INT_MAX) {
+            return JANICE_BAD_ARGUMENT;
+        }
+    }
+
+    it->is_video = &is_video;
+    it->get_frame_rate =  &get_frame_rate;
+    it->get_physical_frame_rate =  &get_physical_frame_rate;
+
+    it->next = &next;
+    it->next_batch = &next_batch;
+    it->seek = &seek;
+    it->get  = &get;
+    it->get_roi = &get_roi;
+    it->tell = &tell;
+    it->physical_frame = &physical_frame;
+    it->set_format = &set_format;
+    it->get_pyramid = &get_pyramid;
+
+    it->free_image = &free_image;
+    it->free       = &free_iterator;
+
+    it->reset      = &reset;
+
+    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    state->lengths.assign(lengths, lengths + num_buffers);
+    if (share) {
+        state->buffers.assign(buffers, buffers + num_buffers);
+    } else {
+        for (size_t i = 0; i < num_buffers; ++i) {
+            state->copies.emplace_back(buffers[i], buffers[i] + lengths[i]);
+            state->buffers.push_back(state->copies.back().data());
+        }
+    }
+    state->sparse = sparse;
+    state->pos = 0;
+
+    it->_internal = (void*) (state);
+
+    return JANICE_SUCCESS;
+}
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+// Create media iterators over encoded images
+
+JaniceError janice_io_memory_create_encoded_media_iterator(const uint8_t* buffer,
+                                                           size_t length,
+                                                           bool share,
+                                                           JaniceMediaIterator* it)
+{
+    return create_iterator(&buffer, &length, 1, share, false, it);
+}
+
+JaniceError janice_io_memory_create_sparse_encoded_media_iterator(const uint8_t* const* buffers,
+                                                                  const size_t* lengths,
+                                                                  size_t num_buffers,
+                                                                  bool share,
+                                                                  JaniceMediaIterator* it)
+{
+    return create_iterator(buffers, lengths, num_buffers, share, true, it);
+}
+
+#else // JANICE_IO_MEMORY_WITH_OPENCV
+
+// Decoding needs OpenCV, which wasn't available when memory_io was built
+
+JaniceError janice_io_memory_create_encoded_media_iterator(const uint8_t*, size_t, bool, JaniceMediaIterator*)
+{
+    return JANICE_NOT_IMPLEMENTED;
+}
+
+JaniceError janice_io_memory_create_sparse_encoded_media_iterator(const uint8_t* const*,
+                                                                  const size_t*,
+                                                                  size_t,
+                                                                  bool,
+                                                                  JaniceMediaIterator*)
+{
+    return JANICE_NOT_IMPLEMENTED;
+}
+
+#endif // JANICE_IO_MEMORY_WITH_OPENCV
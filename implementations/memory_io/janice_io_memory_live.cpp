@@ -0,0 +1,285 @@
+#include <janice_io_memory.h>
+#include <janice_io_memory_utils.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+namespace
+{
+
+// Frames pushed by a producer thread, held in a bounded single-producer,
+// single-consumer ring. Frame numbers count pushed frames, so a frame's
+// number is its position in the ring: head is the next frame to read and
+// tail the next frame to write. Both only grow.
+//
+// Slots hold pointers so a frame can be claimed by swinging head with a
+// compare and swap. Normally only the consumer moves head, but when the ring
+// is full and drop_oldest is set the producer claims the oldest frame the
+// same way to discard it. Whoever wins the exchange owns the frame.
+//
+// The ring itself is lock-free. wait_mutex and wait_cv are only used to sleep
+// while the ring is empty, or full without drop_oldest.
+struct JaniceMediaIteratorStateType
+{
+    JaniceMediaIteratorStateType(uint32_t capacity, bool drop_oldest)
+        : slots(new std::atomic<JaniceImage*>[capacity]),
+          capacity(capacity),
+          drop_oldest(drop_oldest),
+          head(0),
+          tail(0),
+          closed(false)
+    {
+        for (uint32_t i = 0; i < capacity; ++i) {
+            slots[i] = nullptr;
+        }
+    }
+
+    std::unique_ptr<std::atomic<JaniceImage*>[]> slots;
+    const uint32_t capacity;
+    const bool drop_oldest;
+
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<bool> closed;
+
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;
+
+    io_utils::OutputFormat format; // set with set_format, only used by the consumer
+};
+
+static void free_frame(JaniceImage* frame)
+{
+    mem_utils::free_janice_image(frame);
+    delete frame;
+}
+
+// Take the oldest frame out of the ring, or return NULL if it is empty
+static JaniceImage* pop(JaniceMediaIteratorStateType* state)
+{
+    uint64_t head = state->head.load();
+    while (head != state->tail.load(std::memory_order_acquire)) {
+        JaniceImage* frame = state->slots[head % state->capacity].load(std::memory_order_acquire);
+        if (state->head.compare_exchange_weak(head, head + 1)) {
+            return frame;
+        }
+    }
+
+    return nullptr;
+}
+
+// Wake the other side if it is sleeping. Taking the lock orders the update
+// with its check of the ring, so the wakeup can't be lost.
+static void notify(JaniceMediaIteratorStateType* state)
+{
+    { std::lock_guard<std::mutex> lock(state->wait_mutex); }
+    state->wait_cv.notify_all();
+}
+
+JaniceError is_video(JaniceMediaIterator*, bool* video)
+{
+    *video = true;
+    return JANICE_SUCCESS;
+}
+
+JaniceError get_frame_rate(JaniceMediaIterator*, float*)
+{
+    return JANICE_INVALID_MEDIA;
+}
+
+JaniceError get_physical_frame_rate(JaniceMediaIterator* it, float* frame_rate)
+{
+    return get_frame_rate(it, frame_rate);
+}
+
+// wait for the next frame. Returns JANICE_MEDIA_AT_END once the producer has
+// closed the iterator and every frame it pushed has been read.
+JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    JaniceImage* frame = pop(state);
+    if (frame == nullptr) {
+        std::unique_lock<std::mutex> lock(state->wait_mutex);
+        state->wait_cv.wait(lock, [&]() {
+            frame = pop(state);
+            return frame != nullptr || state->closed;
+        });
+    }
+
+    // closed could be set right after a last push, check once more
+    if (frame == nullptr && (frame = pop(state)) == nullptr) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    // The frame's buffer is handed to the caller as is, unless it has to be converted
+    JaniceError ret = JANICE_SUCCESS;
+    if (const JaniceImageFormat* format = state->format.get()) {
+        ret = mem_utils::output_janice_image(*frame, *image, false, format);
+        free_frame(frame);
+    } else {
+        *image = *frame;
+        delete frame;
+    }
+
+    if (!state->drop_oldest) {
+        notify(state); // the producer may be waiting for room
+    }
+
+    return ret;
+}
+
+// Frames are gone once read, so there is no random access
+JaniceError seek(JaniceMediaIterator*, uint32_t)
+{
+    return JANICE_NOT_IMPLEMENTED;
+}
+
+JaniceError get(JaniceMediaIterator*, JaniceImage*, uint32_t)
+{
+    return JANICE_NOT_IMPLEMENTED;
+}
+
+// the number of frames pushed before the oldest one still waiting to be read,
+// including frames that were dropped
+JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    *frame = (uint32_t) state->head.load();
+    return JANICE_SUCCESS;
+}
+
+// Map a logical frame number (as from tell) to a physical frame number, allowing
+// for downsampling, clipping, etc. on videos. Here, we just return the physical frame.
+JaniceError physical_frame(JaniceMediaIterator*, uint32_t logical, uint32_t *physical)
+{
+    if (physical == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    *physical = logical;
+    return JANICE_SUCCESS;
+}
+
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->format.set(format);
+}
+
+JaniceError free_image(JaniceImage* image)
+{
+    return mem_utils::free_janice_image(image);
+}
+
+JaniceError free_iterator(JaniceMediaIterator* it)
+{
+    if (it && it->_internal) {
+        JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+        while (JaniceImage* frame = pop(state)) {
+            free_frame(frame);
+        }
+
+        delete state;
+        it->_internal = nullptr;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError reset(JaniceMediaIterator*)
+{
+    return JANICE_NOT_IMPLEMENTED;
+}
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+// Create a live media iterator and feed it frames
+
+JaniceError janice_io_memory_create_live_media_iterator(uint32_t capacity, bool drop_oldest, JaniceMediaIterator* it)
+{
+    if (capacity == 0) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    it->is_video = &is_video;
+    it->get_frame_rate =  &get_frame_rate;
+    it->get_physical_frame_rate =  &get_physical_frame_rate;
+
+    it->next = &next;
+    it->next_batch = nullptr;
+    it->seek = &seek;
+    it->get  = &get;
+    it->get_roi = nullptr;
+    it->tell = &tell;
+    it->physical_frame = &physical_frame;
+    it->set_format = mem_utils::formats_supported ? &set_format : nullptr;
+    it->get_pyramid = nullptr; // frames can't be read again once they are returned
+
+    it->free_image = &free_image;
+    it->free       = &free_iterator;
+
+    it->reset      = &reset;
+
+    it->_internal = (void*) new JaniceMediaIteratorStateType(capacity, drop_oldest);
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError janice_io_memory_push_frame(JaniceMediaIterator* it, const JaniceImage* image)
+{
+    if (it == nullptr || it->free != &free_iterator || image == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    if (state->closed) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    JaniceImage* frame = new JaniceImage();
+    JaniceError ret = mem_utils::copy_janice_image(*image, *frame);
+    if (ret != JANICE_SUCCESS) {
+        delete frame;
+        return ret;
+    }
+
+    const uint64_t tail = state->tail.load();
+    while (tail - state->head.load() >= state->capacity) {
+        if (state->drop_oldest) {
+            if (JaniceImage* oldest = pop(state)) {
+                free_frame(oldest);
+            }
+        } else {
+            std::unique_lock<std::mutex> lock(state->wait_mutex);
+            state->wait_cv.wait(lock, [&]() {
+                return tail - state->head.load() < state->capacity;
+            });
+        }
+    }
+
+    state->slots[tail % state->capacity].store(frame, std::memory_order_release);
+    state->tail.store(tail + 1, std::memory_order_release);
+
+    notify(state);
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError janice_io_memory_close_live_media_iterator(JaniceMediaIterator* it)
+{
+    if (it == nullptr || it->free != &free_iterator) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    state->closed = true;
+    notify(state);
+
+    return JANICE_SUCCESS;
+}
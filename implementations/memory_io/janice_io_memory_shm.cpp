@@ -0,0 +1,451 @@
+#include <janice_io_memory_shm.h>
+#include <janice_io_memory_utils.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static_assert(sizeof(JaniceShmHeader) == 64, "JaniceShmHeader must be 64 bytes");
+static_assert(sizeof(JaniceShmSlot) == 64, "JaniceShmSlot must be 64 bytes");
+
+struct JaniceShmProducer
+{
+    std::string name;
+    uint8_t* segment;
+    size_t segment_size;
+    uint64_t sequence; // the frame being written
+    bool acquired;
+};
+
+namespace
+{
+
+// The atomic fields of the protocol are plain integers so the layout can be
+// shared with C producers
+template <typename T>
+static T load(const T* field)
+{
+    return __atomic_load_n(field, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+static void store(T* field, T value)
+{
+    __atomic_store_n(field, value, __ATOMIC_RELEASE);
+}
+
+static JaniceShmHeader* header_of(uint8_t* segment)
+{
+    return (JaniceShmHeader*) segment;
+}
+
+static JaniceShmSlot* slot_of(uint8_t* segment, uint32_t num_slots, uint64_t slot_size, uint64_t sequence)
+{
+    return (JaniceShmSlot*) (segment + sizeof(JaniceShmHeader) +
+                             (sequence % num_slots) * (sizeof(JaniceShmSlot) + slot_size));
+}
+
+static JaniceShmSlot* slot_of(uint8_t* segment, uint64_t sequence)
+{
+    JaniceShmHeader* header = header_of(segment);
+    return slot_of(segment, header->num_slots, header->slot_size, sequence);
+}
+
+// The other process can't signal us, so poll. Spin briefly for low latency,
+// then back off to short sleeps.
+static void backoff(uint32_t& attempts)
+{
+    if (++attempts < 64) {
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+struct JaniceMediaIteratorStateType
+{
+    uint8_t* segment;
+    size_t segment_size;
+    uint64_t pos; // the frame next() returns
+
+    // The layout of the segment, checked against its size when it was opened.
+    // Any process can write to the segment, so the header isn't trusted after.
+    uint32_t num_slots;
+    uint64_t slot_size;
+
+    // producer frame numbers of the last num_slots frames, by sequence
+    std::vector<uint64_t> sequences;
+    std::vector<uint64_t> frames;
+
+    io_utils::OutputFormat format; // set with set_format
+};
+
+JaniceError is_video(JaniceMediaIterator*, bool* video)
+{
+    *video = true;
+    return JANICE_SUCCESS;
+}
+
+JaniceError get_frame_rate(JaniceMediaIterator*, float*)
+{
+    return JANICE_INVALID_MEDIA;
+}
+
+JaniceError get_physical_frame_rate(JaniceMediaIterator* it, float* frame_rate)
+{
+    return get_frame_rate(it, frame_rate);
+}
+
+// wait for the next frame to be published and lend it to the caller
+JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    JaniceShmHeader* header = header_of(state->segment);
+    JaniceShmSlot* slot = slot_of(state->segment, state->num_slots, state->slot_size, state->pos);
+
+    uint32_t attempts = 0;
+    while (load(&header->write_sequence) <= state->pos) {
+        // Check the sequence again, the producer may have published a last
+        // frame just before closing
+        if (load(&header->closed) && load(&header->write_sequence) <= state->pos) {
+            return JANICE_MEDIA_AT_END;
+        }
+        backoff(attempts);
+    }
+
+    // write_sequence is only advanced after the slot is ready
+    if (load(&slot->state) != JANICE_SHM_SLOT_READY || slot->sequence != state->pos) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    // Read the dimensions once, a bad producer could change them after the check
+    const uint32_t channels = slot->channels;
+    const uint32_t rows     = slot->rows;
+    const uint32_t cols     = slot->cols;
+    if ((uint64_t) channels * rows * cols > state->slot_size) {
+        return JANICE_INVALID_MEDIA;
+    }
+    store(&slot->state, (uint32_t) JANICE_SHM_SLOT_LENT);
+
+    image->channels = channels;
+    image->rows     = rows;
+    image->cols     = cols;
+    image->data     = (uint8_t*) slot + sizeof(JaniceShmSlot);
+    image->owner    = false;
+
+    const size_t index = state->pos % state->sequences.size();
+    state->sequences[index] = state->pos;
+    state->frames[index] = slot->frame;
+    ++state->pos;
+
+    // A converted frame is a copy, so the slot goes straight back to the producer
+    JaniceError ret = JANICE_SUCCESS;
+    if (const JaniceImageFormat* format = state->format.get()) {
+        JaniceImage lent = *image;
+        ret = mem_utils::output_janice_image(lent, *image, false, format);
+        store(&slot->state, (uint32_t) JANICE_SHM_SLOT_FREE);
+    }
+
+    return ret;
+}
+
+// Frames are gone once released, so there is no random access
+JaniceError seek(JaniceMediaIterator*, uint32_t)
+{
+    return JANICE_NOT_IMPLEMENTED;
+}
+
+JaniceError get(JaniceMediaIterator*, JaniceImage*, uint32_t)
+{
+    return JANICE_NOT_IMPLEMENTED;
+}
+
+JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    *frame = (uint32_t) state->pos;
+    return JANICE_SUCCESS;
+}
+
+// Map a logical frame number (as from tell) to the frame number the producer
+// published it with
+JaniceError physical_frame(JaniceMediaIterator* it, uint32_t logical, uint32_t *physical)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (physical == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    const size_t index = logical % state->sequences.size();
+    if (logical >= state->pos || state->sequences[index] != logical) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    *physical = (uint32_t) state->frames[index];
+    return JANICE_SUCCESS;
+}
+
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->format.set(format);
+}
+
+// hand the frame's slot back to the producer. Converted frames are our own copies.
+JaniceError free_image(JaniceImage* image)
+{
+    if (image && image->owner) {
+        return mem_utils::free_janice_image(image);
+    }
+
+    if (image && image->data) {
+        JaniceShmSlot* slot = (JaniceShmSlot*) (image->data - sizeof(JaniceShmSlot));
+        store(&slot->state, (uint32_t) JANICE_SHM_SLOT_FREE);
+        image->data = nullptr;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError free_iterator(JaniceMediaIterator* it)
+{
+    if (it && it->_internal) {
+        JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+        munmap(state->segment, state->segment_size);
+
+        delete state;
+        it->_internal = nullptr;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError reset(JaniceMediaIterator*)
+{
+    return JANICE_NOT_IMPLEMENTED;
+}
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+// Read frames published to shared memory
+
+JaniceError janice_io_memory_create_shm_media_iterator(const char* name, JaniceMediaIterator* it)
+{
+    if (name == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return JANICE_OPEN_ERROR;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(JaniceShmHeader)) {
+        close(fd);
+        return JANICE_INVALID_MEDIA;
+    }
+
+    const size_t segment_size = info.st_size;
+    void* segment = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        return JANICE_OPEN_ERROR;
+    }
+
+    // Check the slots fit in the segment, dividing so a bad header can't
+    // overflow the product
+    JaniceShmHeader* header = header_of((uint8_t*) segment);
+    const uint32_t num_slots = header->num_slots;
+    const uint64_t slot_size = header->slot_size;
+    const uint64_t bytes_per_slot = num_slots == 0 ? 0 : (segment_size - sizeof(JaniceShmHeader)) / num_slots;
+    if (load(&header->magic) != JANICE_SHM_MAGIC || header->version != JANICE_SHM_VERSION || num_slots == 0 ||
+            bytes_per_slot < sizeof(JaniceShmSlot) || slot_size > bytes_per_slot - sizeof(JaniceShmSlot)) {
+        munmap(segment, segment_size);
+        return JANICE_INVALID_MEDIA;
+    }
+
+    it->is_video = &is_video;
+    it->get_frame_rate =  &get_frame_rate;
+    it->get_physical_frame_rate =  &get_physical_frame_rate;
+
+    it->next = &next;
+    it->next_batch = nullptr;
+    it->seek = &seek;
+    it->get  = &get;
+    it->get_roi = nullptr;
+    it->tell = &tell;
+    it->physical_frame = &physical_frame;
+    it->set_format = mem_utils::formats_supported ? &set_format : nullptr;
+    it->get_pyramid = nullptr; // frames can't be read again once they are returned
+
+    it->free_image = &free_image;
+    it->free       = &free_iterator;
+
+    it->reset      = &reset;
+
+    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    state->segment = (uint8_t*) segment;
+    state->segment_size = segment_size;
+    state->pos = 0;
+    state->num_slots = num_slots;
+    state->slot_size = slot_size;
+    state->sequences.assign(num_slots, UINT64_MAX);
+    state->frames.assign(num_slots, 0);
+
+    it->_internal = (void*) (state);
+
+    return JANICE_SUCCESS;
+}
+
+// ----------------------------------------------------------------------------
+// Publish frames to shared memory
+
+JaniceError janice_io_memory_create_shm_producer(const char* name,
+                                                 uint32_t num_slots,
+                                                 size_t max_frame_size,
+                                                 JaniceShmProducer** producer)
+{
+    if (name == nullptr || num_slots == 0 || producer == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    const size_t slot_size = (max_frame_size + 63) / 64 * 64;
+    const size_t segment_size = sizeof(JaniceShmHeader) + num_slots * (sizeof(JaniceShmSlot) + slot_size);
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return JANICE_OPEN_ERROR;
+    }
+
+    if (ftruncate(fd, segment_size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return JANICE_OPEN_ERROR;
+    }
+
+    void* segment = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        shm_unlink(name);
+        return JANICE_OPEN_ERROR;
+    }
+
+    // A new segment is zero filled, so every slot starts out FREE
+    JaniceShmHeader* header = header_of((uint8_t*) segment);
+    header->num_slots = num_slots;
+    header->slot_size = slot_size;
+    header->version = JANICE_SHM_VERSION;
+    store(&header->magic, (uint32_t) JANICE_SHM_MAGIC);
+
+    *producer = new JaniceShmProducer();
+    (*producer)->name = name;
+    (*producer)->segment = (uint8_t*) segment;
+    (*producer)->segment_size = segment_size;
+    (*producer)->sequence = 0;
+    (*producer)->acquired = false;
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError janice_io_memory_shm_producer_acquire(JaniceShmProducer* producer,
+                                                  uint32_t channels,
+                                                  uint32_t rows,
+                                                  uint32_t cols,
+                                                  uint8_t** data)
+{
+    if (producer == nullptr || data == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceShmHeader* header = header_of(producer->segment);
+    if ((uint64_t) channels * rows * cols > header->slot_size) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    // Wait for the consumer to release the frame that used this slot last
+    JaniceShmSlot* slot = slot_of(producer->segment, producer->sequence);
+    uint32_t attempts = 0;
+    while (load(&slot->state) != JANICE_SHM_SLOT_FREE) {
+        backoff(attempts);
+    }
+
+    slot->channels = channels;
+    slot->rows = rows;
+    slot->cols = cols;
+    slot->sequence = producer->sequence;
+    producer->acquired = true;
+
+    *data = (uint8_t*) slot + sizeof(JaniceShmSlot);
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError janice_io_memory_shm_producer_publish(JaniceShmProducer* producer, uint64_t frame)
+{
+    if (producer == nullptr || !producer->acquired) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceShmHeader* header = header_of(producer->segment);
+    JaniceShmSlot* slot = slot_of(producer->segment, producer->sequence);
+
+    slot->frame = frame;
+    store(&slot->state, (uint32_t) JANICE_SHM_SLOT_READY);
+    store(&header->write_sequence, ++producer->sequence);
+    producer->acquired = false;
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError janice_io_memory_shm_producer_close(JaniceShmProducer* producer)
+{
+    if (producer == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    store(&header_of(producer->segment)->closed, (uint32_t) 1);
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError janice_io_memory_shm_producer_flush(JaniceShmProducer* producer)
+{
+    if (producer == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceShmHeader* header = header_of(producer->segment);
+    for (uint32_t i = 0; i < header->num_slots; ++i) {
+        JaniceShmSlot* slot = slot_of(producer->segment, i);
+
+        uint32_t attempts = 0;
+        while (load(&slot->state) != JANICE_SHM_SLOT_FREE) {
+            backoff(attempts);
+        }
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError janice_io_memory_free_shm_producer(JaniceShmProducer* producer)
+{
+    if (producer) {
+        janice_io_memory_shm_producer_close(producer);
+        munmap(producer->segment, producer->segment_size);
+        shm_unlink(producer->name.c_str());
+        delete producer;
+    }
+
+    return JANICE_SUCCESS;
+}
@@ -0,0 +1,156 @@
+#ifndef JANICE_IO_MEMORY_SHM_H
+#define JANICE_IO_MEMORY_SHM_H
+
+#include <janice_io.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Frames handed between processes through a POSIX shared memory segment. The
+ * segment holds a JaniceShmHeader followed by num_slots slots. Each slot is a
+ * JaniceShmSlot followed by slot_size bytes of pixels, in the same layout as
+ * JaniceImage. Frame n is written to slot n % num_slots, so frames are read in
+ * the order they were written.
+ *
+ * A slot moves from FREE to READY when the producer publishes a frame into
+ * it, from READY to LENT when a consumer returns it from next(), and back to
+ * FREE when the consumer frees the image. The pixels are never copied: the
+ * producer writes them into the slot and the consumer reads them in place.
+ *
+ * Fields marked atomic must be read and written with atomic operations, with
+ * release ordering for writes and acquire ordering for reads. Producers written
+ * against this header don't need the library, janice_io_memory_create_shm_producer
+ * is a convenience.
+ */
+
+#define JANICE_SHM_MAGIC   0x4D48534A // "JSHM"
+#define JANICE_SHM_VERSION 1
+
+#define JANICE_SHM_SLOT_FREE  0
+#define JANICE_SHM_SLOT_READY 1
+#define JANICE_SHM_SLOT_LENT  2
+
+struct JaniceShmHeader
+{
+    uint32_t magic;          // JANICE_SHM_MAGIC
+    uint32_t version;        // JANICE_SHM_VERSION
+    uint32_t num_slots;
+    uint32_t closed;         // atomic, non-zero once the producer is done
+    uint64_t slot_size;      // bytes of pixels per slot, a multiple of 64
+    uint64_t write_sequence; // atomic, the number of frames published
+
+    uint8_t reserved[32];    // pads the header to 64 bytes
+};
+
+struct JaniceShmSlot
+{
+    uint32_t state;    // atomic, one of JANICE_SHM_SLOT_*
+    uint32_t channels;
+    uint32_t rows;
+    uint32_t cols;
+    uint64_t sequence; // the number of the frame in the slot
+    uint64_t frame;    // a frame number chosen by the producer, e.g. from a camera
+
+    uint8_t reserved[32]; // pads the slot header to 64 bytes
+};
+
+/*!
+ * \brief Create a JaniceMediaIterator over frames published to a shared memory
+ *        segment by another process. Frames are returned without copying, as
+ *        views into the segment with owner == false. Each returned frame holds
+ *        its slot until it is passed to free_image, so a consumer holding
+ *        num_slots frames stalls the producer.
+ *
+ * next waits for the producer and returns JANICE_MEDIA_AT_END once the
+ * producer has closed the segment and every frame has been read. Frames are
+ * numbered in the order they were published. physical_frame maps the numbers
+ * of the last num_slots frames returned by next to the frame numbers the
+ * producer gave them. The iterator can't seek, get or reset.
+ * \param name The name of the segment, as passed to shm_open. The producer must
+ *        have created it.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully, JANICE_OPEN_ERROR if the
+ *          segment can't be opened and JANICE_INVALID_MEDIA if it doesn't hold a frame ring.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_create_shm_media_iterator(const char* name,
+                                                                     JaniceMediaIterator* it);
+
+typedef struct JaniceShmProducer JaniceShmProducer;
+
+/*!
+ * \brief Create a shared memory segment with a frame ring and open it for
+ *        writing. An existing segment with the same name is replaced.
+ * \param name The name of the segment, as passed to shm_open.
+ * \param num_slots The number of frames in the ring.
+ * \param max_frame_size The size in bytes of the largest frame that will be
+ *        published.
+ * \param producer Set to the new producer. Free it with
+ *        janice_io_memory_free_shm_producer.
+ * \returns JANICE_SUCCESS, or JANICE_OPEN_ERROR if the segment can't be created.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_create_shm_producer(const char* name,
+                                                               uint32_t num_slots,
+                                                               size_t max_frame_size,
+                                                               JaniceShmProducer** producer);
+
+/*!
+ * \brief Get the buffer for the next frame, waiting until the consumer has
+ *        released the slot. The frame is written directly into the segment
+ *        and becomes visible to the consumer with
+ *        janice_io_memory_shm_producer_publish.
+ * \param producer The producer.
+ * \param channels The number of channels of the frame.
+ * \param rows The number of rows of the frame.
+ * \param cols The number of columns of the frame.
+ * \param data Set to the buffer for the frame's pixels.
+ * \returns JANICE_SUCCESS, or JANICE_BAD_ARGUMENT if the frame doesn't fit in a slot.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_shm_producer_acquire(JaniceShmProducer* producer,
+                                                                uint32_t channels,
+                                                                uint32_t rows,
+                                                                uint32_t cols,
+                                                                uint8_t** data);
+
+/*!
+ * \brief Publish the frame written to the buffer from the last call to
+ *        janice_io_memory_shm_producer_acquire.
+ * \param producer The producer.
+ * \param frame A frame number for the consumer, e.g. from a camera.
+ * \returns JANICE_SUCCESS, or JANICE_BAD_ARGUMENT if no frame was acquired.
+ */
+JANICE_EXPORT JaniceError janice_io_memory_shm_producer_publish(JaniceShmProducer* producer,
+                                                                uint64_t frame);
+
+/*!
+ * \brief Mark the end of the frames. The consumer can still read the frames
+ *        already published.
+ * \param producer The producer.
+ * \returns JANICE_SUCCESS
+ */
+JANICE_EXPORT JaniceError janice_io_memory_shm_producer_close(JaniceShmProducer* producer);
+
+/*!
+ * \brief Wait until the consumer has released every frame published so far.
+ *        Call this before janice_io_memory_free_shm_producer to make sure a
+ *        consumer has opened the segment and read all of the frames.
+ * \param producer The producer.
+ * \returns JANICE_SUCCESS
+ */
+JANICE_EXPORT JaniceError janice_io_memory_shm_producer_flush(JaniceShmProducer* producer);
+
+/*!
+ * \brief Close the producer, unmap the segment and remove its name. Consumers
+ *        that already opened the segment keep it until they are freed.
+ * \param producer The producer to free.
+ * \returns JANICE_SUCCESS
+ */
+JANICE_EXPORT JaniceError janice_io_memory_free_shm_producer(JaniceShmProducer* producer);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // JANICE_IO_MEMORY_SHM_H
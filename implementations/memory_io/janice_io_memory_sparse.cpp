@@ -1,6 +1,7 @@
 #include <janice_io_memory.h>
 #include <janice_io_memory_utils.hpp>
 
+#include <algorithm>
 #include <vector>
 
 namespace
@@ -9,7 +10,11 @@ namespace
 struct JaniceMediaIteratorStateType
 {
     std::vector<JaniceImage> images;
+    std::vector<uint32_t> frames; // the source frame of each image, empty if unknown
+    bool borrowed; // images are the caller's, see janice_io_memory_create_sparse_borrowed_media_iterator
     size_t pos;
+    io_utils::OutputFormat format; // set with set_format
+    mem_utils::FramePyramid pyramid; // of the last image asked for, see get_pyramid
 };
 
 JaniceError is_video(JaniceMediaIterator* it, bool* video)
@@ -36,7 +41,7 @@ JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
         return JANICE_MEDIA_AT_END;
     }
 
-    JaniceError ret = mem_utils::copy_janice_image(state->images[state->pos], *image);
+    JaniceError ret = mem_utils::output_janice_image(state->images[state->pos], *image, state->borrowed, state->format.get());
     if (ret == JANICE_SUCCESS) {
         ++state->pos;
     }
@@ -44,6 +49,43 @@ JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
     return ret;
 }
 
+JaniceError next_batch(JaniceMediaIterator* it, JaniceImage* images, uint32_t max_images, uint32_t* num_images)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (images == NULL || num_images == NULL) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    *num_images = 0;
+
+    if (state->pos == state->images.size()) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    const size_t count = std::min((size_t) max_images, state->images.size() - state->pos);
+    if (count == 0) {
+        return JANICE_SUCCESS;
+    }
+
+    // Borrowed images are handed out as they are, wherever the caller put them
+    JaniceError ret = JANICE_SUCCESS;
+    if (state->borrowed && !state->format.get()) {
+        for (size_t i = 0; i < count; ++i) {
+            mem_utils::view_janice_image(state->images[state->pos + i], images[i]);
+        }
+    } else {
+        ret = mem_utils::output_janice_batch(&state->images[state->pos], count, images, state->format.get());
+    }
+
+    if (ret == JANICE_SUCCESS) {
+        state->pos += count;
+        *num_images = count;
+    }
+
+    return ret;
+}
+
 JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
 {
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
@@ -65,7 +107,18 @@ JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
         return JANICE_BAD_ARGUMENT;
     }
 
-    return mem_utils::copy_janice_image(state->images[frame], *image);
+    return mem_utils::output_janice_image(state->images[frame], *image, state->borrowed, state->format.get());
+}
+
+JaniceError get_roi(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, const JaniceRect* rect)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (frame >= state->images.size() || rect == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    return mem_utils::output_janice_image_roi(state->images[frame], *rect, *image, state->format.get());
 }
 
 JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
@@ -82,25 +135,49 @@ JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
 }
 
 // Map a logical frame number (as from tell) to a physical frame number, allowing
-// for downsampling, clipping, etc. on videos. Here, we just return the physical frame.
-JaniceError physical_frame(JaniceMediaIterator*, uint32_t logical, uint32_t *physical)
+// for downsampling, clipping, etc. on videos. Here, that's the frame number the
+// image was given, or the logical frame if it wasn't given one.
+JaniceError physical_frame(JaniceMediaIterator* it, uint32_t logical, uint32_t *physical)
 {
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
     if (physical == nullptr) {
         return JANICE_BAD_ARGUMENT;
     }
 
-    *physical = logical;
+    if (state->frames.empty()) {
+        *physical = logical;
+        return JANICE_SUCCESS;
+    }
+
+    if (logical >= state->frames.size()) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    *physical = state->frames[logical];
     return JANICE_SUCCESS;
 }
 
-JaniceError free_image(JaniceImage* image)
+JaniceError get_pyramid(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, uint32_t level)
 {
-    if (image && image->owner) {
-        free(image->data);
-        image->data = nullptr;
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (frame >= state->images.size() || image == nullptr) {
+        return JANICE_BAD_ARGUMENT;
     }
 
-    return JANICE_SUCCESS;
+    return mem_utils::output_pyramid_level(state->pyramid, frame, state->images[frame], level, *image);
+}
+
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->format.set(format);
+}
+
+JaniceError free_image(JaniceImage* image)
+{
+    return mem_utils::free_janice_image(image);
 }
 
 JaniceError free_iterator(JaniceMediaIterator* it)
@@ -125,35 +202,49 @@ JaniceError reset(JaniceMediaIterator* it)
     return JANICE_SUCCESS;
 }
 
-} // anonymous namespace
-
-// ----------------------------------------------------------------------------
-// OpenCV I/O only, create a sparse opencv_io media iterator
-
-JaniceError janice_io_memory_create_sparse_media_iterator(const JaniceImage* images, size_t num_images, JaniceMediaIterator* it)
+static JaniceError create_iterator(const JaniceImage* images,
+                                   const uint32_t* frames,
+                                   size_t num_images,
+                                   bool borrow,
+                                   JaniceMediaIterator* it)
 {
     it->is_video = &is_video;
     it->get_frame_rate =  &get_frame_rate;
     it->get_physical_frame_rate =  &get_physical_frame_rate;
 
     it->next = &next;
+    it->next_batch = &next_batch;
     it->seek = &seek;
     it->get  = &get;
+    it->get_roi = &get_roi;
     it->tell = &tell;
     it->physical_frame = &physical_frame;
+    it->set_format = mem_utils::formats_supported ? &set_format : nullptr;
+    it->get_pyramid = mem_utils::pyramids_supported ? &get_pyramid : nullptr;
 
     it->free_image = &free_image;
     it->free       = &free_iterator;
 
     it->reset      = &reset;
 
-    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    // Images with frame numbers are iterated in frame order
+    std::vector<size_t> order(num_images);
     for (size_t i = 0; i < num_images; ++i) {
+        order[i] = i;
+    }
+    if (frames != nullptr) {
+        std::stable_sort(order.begin(), order.end(), [frames](size_t a, size_t b) {
+            return frames[a] < frames[b];
+        });
+    }
+
+    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    for (size_t i : order) {
         JaniceImage image;
-        JaniceError ret = mem_utils::copy_janice_image(images[i], image);
+        JaniceError ret = mem_utils::read_janice_image(images[i], image, borrow);
         if (ret != JANICE_SUCCESS) { // Try and clean up
-            for (size_t i = 0; i < state->images.size(); ++i) {
-                free_image(&state->images[i]);
+            for (size_t j = 0; j < state->images.size(); ++j) {
+                free_image(&state->images[j]);
             }
             delete state;
 
@@ -161,10 +252,65 @@ JaniceError janice_io_memory_create_sparse_media_iterator(const JaniceImage* ima
         }
 
         state->images.push_back(image);
+        if (frames != nullptr) {
+            state->frames.push_back(frames[i]);
+        }
     }
+    state->borrowed = borrow;
     state->pos = 0;
 
     it->_internal = (void*) (state);
 
     return JANICE_SUCCESS;
 }
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+// OpenCV I/O only, create a sparse opencv_io media iterator
+
+JaniceError janice_io_memory_create_sparse_media_iterator(const JaniceImage* images, size_t num_images, JaniceMediaIterator* it)
+{
+    return create_iterator(images, nullptr, num_images, false, it);
+}
+
+JaniceError janice_io_memory_create_sparse_media_iterator_with_frames(const JaniceImage* images,
+                                                                      const uint32_t* frames,
+                                                                      size_t num_images,
+                                                                      JaniceMediaIterator* it)
+{
+    if (frames == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    return create_iterator(images, frames, num_images, false, it);
+}
+
+JaniceError janice_io_memory_create_sparse_borrowed_media_iterator(const JaniceImage* images,
+                                                                   size_t num_images,
+                                                                   JaniceMediaIterator* it)
+{
+    return create_iterator(images, nullptr, num_images, true, it);
+}
+
+JaniceError janice_io_memory_sparse_find_frame(JaniceMediaIterator* it, uint32_t frame, uint32_t* logical)
+{
+    if (it == nullptr || logical == nullptr || it->free != &free_iterator) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    // Without frame numbers each image is its own frame
+    size_t index = frame;
+    if (!state->frames.empty()) {
+        index = std::lower_bound(state->frames.begin(), state->frames.end(), frame) - state->frames.begin();
+    }
+
+    if (index >= state->images.size()) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    *logical = index;
+    return JANICE_SUCCESS;
+}
@@ -2,8 +2,17 @@
 #define JANICE_IO_MEMORY_UTILS_HPP
 
 #include <janice_io.h>
+#include <janice_io_buffer_pool.hpp>
+#include <janice_io_format.hpp>
 
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+#include <janice_io_format_opencv.hpp>
+#include <janice_io_pyramid_opencv.hpp>
+#endif
+
+#include <algorithm>
 #include <cstring>
+#include <vector>
 
 namespace mem_utils
 {
@@ -15,13 +24,216 @@ inline JaniceError copy_janice_image(const JaniceImage& src, JaniceImage& dst)
     dst.rows     = src.rows;
     dst.cols     = src.cols;
 
-    dst.data = (uint8_t*) malloc(src.channels * src.rows * src.cols);
+    dst.data = io_utils::BufferPool::instance().acquire(src.channels * src.rows * src.cols);
+    if (dst.data == nullptr) {
+        return JANICE_OUT_OF_MEMORY;
+    }
+
     memcpy(dst.data, src.data, src.channels * src.rows * src.cols);
     dst.owner = true;
 
     return JANICE_SUCCESS;
 }
 
+// Hand out src without copying it. The view doesn't own its pixels, so
+// free_janice_image leaves them alone.
+inline void view_janice_image(const JaniceImage& src, JaniceImage& dst)
+{
+    dst = src;
+    dst.owner = false;
+}
+
+// Either copy src into a new buffer, or return a view of it if the iterator
+// borrows its images
+inline JaniceError read_janice_image(const JaniceImage& src, JaniceImage& dst, bool borrow)
+{
+    if (borrow) {
+        view_janice_image(src, dst);
+        return JANICE_SUCCESS;
+    }
+
+    return copy_janice_image(src, dst);
+}
+
+// Copy num_images images into one contiguous buffer from the pool. Each copy
+// owns its slice and is released with free_janice_image.
+inline JaniceError copy_janice_images_batch(const JaniceImage* src, size_t num_images, JaniceImage* dst)
+{
+    std::vector<size_t> sizes(num_images);
+    for (size_t i = 0; i < num_images; ++i) {
+        sizes[i] = src[i].channels * src[i].rows * src[i].cols;
+    }
+
+    std::vector<uint8_t*> buffers(num_images);
+    if (!io_utils::BufferPool::instance().acquire_batch(sizes.data(), num_images, buffers.data())) {
+        return JANICE_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = 0; i < num_images; ++i) {
+        memcpy(buffers[i], src[i].data, sizes[i]);
+
+        dst[i].channels = src[i].channels;
+        dst[i].rows     = src[i].rows;
+        dst[i].cols     = src[i].cols;
+        dst[i].data     = buffers[i];
+        dst[i].owner    = true;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+// Copy the part of src inside rect, clipped to the image, into dst
+inline JaniceError copy_janice_image_roi(const JaniceImage& src, const JaniceRect& rect, JaniceImage& dst)
+{
+    const int x0 = std::max(rect.x, 0);
+    const int y0 = std::max(rect.y, 0);
+    const int x1 = std::min((int64_t) rect.x + rect.width,  (int64_t) src.cols);
+    const int y1 = std::min((int64_t) rect.y + rect.height, (int64_t) src.rows);
+
+    if (x1 <= x0 || y1 <= y0) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    dst.channels = src.channels;
+    dst.rows     = y1 - y0;
+    dst.cols     = x1 - x0;
+
+    const size_t row_size = dst.cols * dst.channels;
+
+    dst.data = io_utils::BufferPool::instance().acquire(dst.rows * row_size);
+    if (dst.data == nullptr) {
+        return JANICE_OUT_OF_MEMORY;
+    }
+
+    for (uint32_t row = 0; row < dst.rows; ++row) {
+        memcpy(dst.data + row * row_size,
+               src.data + ((size_t) (y0 + row) * src.cols + x0) * src.channels,
+               row_size);
+    }
+    dst.owner = true;
+
+    return JANICE_SUCCESS;
+}
+
+// Converting images to a format requested with set_format needs OpenCV.
+// Without it, iterators leave set_format NULL.
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+static const bool formats_supported = true;
+#else
+static const bool formats_supported = false;
+#endif
+
+// The image an iterator returns for src, converted to format if there is one,
+// otherwise read as read_janice_image
+inline JaniceError output_janice_image(const JaniceImage& src, JaniceImage& dst, bool borrow, const JaniceImageFormat* format)
+{
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+    if (format) {
+        return io_utils::format_janice_image(io_utils::janice_image_to_cv_mat(src), *format, dst);
+    }
+#else
+    (void) format;
+#endif
+
+    return read_janice_image(src, dst, borrow);
+}
+
+// Like copy_janice_images_batch, converting each image to format if there is one
+inline JaniceError output_janice_batch(const JaniceImage* src, size_t num_images, JaniceImage* dst, const JaniceImageFormat* format)
+{
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+    if (format) {
+        std::vector<cv::Mat> images;
+        for (size_t i = 0; i < num_images; ++i) {
+            images.push_back(io_utils::janice_image_to_cv_mat(src[i]));
+        }
+        return io_utils::format_janice_batch(images, *format, dst);
+    }
+#else
+    (void) format;
+#endif
+
+    return copy_janice_images_batch(src, num_images, dst);
+}
+
+// Like copy_janice_image_roi, converting the region to format if there is one
+inline JaniceError output_janice_image_roi(const JaniceImage& src, const JaniceRect& rect, JaniceImage& dst, const JaniceImageFormat* format)
+{
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+    if (format) {
+        const int x0 = std::max(rect.x, 0);
+        const int y0 = std::max(rect.y, 0);
+        const int x1 = std::min((int64_t) rect.x + rect.width,  (int64_t) src.cols);
+        const int y1 = std::min((int64_t) rect.y + rect.height, (int64_t) src.rows);
+
+        if (x1 <= x0 || y1 <= y0) {
+            return JANICE_OUT_OF_BOUNDS_ACCESS;
+        }
+
+        const cv::Mat roi = io_utils::janice_image_to_cv_mat(src)(cv::Rect(x0, y0, x1 - x0, y1 - y0));
+        return io_utils::format_janice_image(roi, *format, dst);
+    }
+#else
+    (void) format;
+#endif
+
+    return copy_janice_image_roi(src, rect, dst);
+}
+
+// Image pyramids are built with OpenCV as well. Without it, iterators leave
+// get_pyramid NULL.
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+typedef io_utils::FramePyramid FramePyramid;
+
+// Copy a level of the pyramid of a decoded image into a new image
+inline JaniceError output_pyramid_level(FramePyramid& pyramid, uint32_t level, JaniceImage& dst)
+{
+    cv::Mat m;
+    if (!pyramid.level(level, m)) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    JaniceImage src;
+    src.channels = m.channels();
+    src.rows     = m.rows;
+    src.cols     = m.cols;
+    src.data     = m.data; // pyrDown output is continuous
+    src.owner    = false;
+
+    return copy_janice_image(src, dst);
+}
+
+// Copy a level of the pyramid of src, frame of its iterator. The pyramid
+// keeps a header over src, which iterators hold for their lifetime.
+inline JaniceError output_pyramid_level(FramePyramid& pyramid, uint32_t frame, const JaniceImage& src, uint32_t level, JaniceImage& dst)
+{
+    if (!pyramid.has(frame)) {
+        pyramid.set(frame, io_utils::janice_image_to_cv_mat(src));
+    }
+
+    return output_pyramid_level(pyramid, level, dst);
+}
+#else
+struct FramePyramid {};
+
+inline JaniceError output_pyramid_level(FramePyramid&, uint32_t, const JaniceImage&, uint32_t, JaniceImage&)
+{
+    return JANICE_NOT_IMPLEMENTED;
+}
+#endif
+
+static const bool pyramids_supported = formats_supported;
+
+inline JaniceError free_janice_image(JaniceImage* image)
+{
+    if (image && image->owner) {
+        io_utils::BufferPool::instance().release(image->data);
+        image->data = nullptr;
+    }
+
+    return JANICE_SUCCESS;
+}
+
 } // namespace mem_utils
 
 #endif // JANICE_IO_MEMORY_UTILS_HPP
@@ -0,0 +1,1159 @@
+#include <janice_io_memory.h>
+#ifdef JANICE_IO_TEST_WITH_SHM
+#include <janice_io_memory_shm.h>
+#endif
+
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Helpful macros for repeated checks
+
+#define JANICE_CALL(func, cleanup)             \
+{                                              \
+    JaniceError error = func;                  \
+    if (error != JANICE_SUCCESS) {             \
+        printf("\nError Detected!"             \
+               "\n\tLocation: %s:%d"           \
+               "\n\tError: %s\n",              \
+               __FILE__, __LINE__,             \
+               janice_error_to_string(error)); \
+        cleanup();                             \
+        return 1;                              \
+    }                                          \
+}
+
+#define CHECK(condition, msg, cleanup)         \
+{                                              \
+    bool ret = (condition);                    \
+    if (!ret) {                                \
+        printf("\nCheck Failed!"               \
+               "\n\tLocation: %s:%d"           \
+               "\n\tMessage: %s\n",            \
+               __FILE__, __LINE__, msg);       \
+        cleanup();                             \
+        return 1;                              \
+    }                                          \
+}
+
+using namespace std;
+
+// A single pixel frame whose four channels hold number
+static JaniceImage numbered_frame(uint32_t& number)
+{
+    JaniceImage frame;
+    frame.channels = 4;
+    frame.rows = 1;
+    frame.cols = 1;
+    frame.data = (uint8_t*) &number;
+    frame.owner = false;
+
+    return frame;
+}
+
+static uint32_t frame_number(const JaniceImage& frame)
+{
+    uint32_t number;
+    memcpy(&number, frame.data, sizeof(number));
+    return number;
+}
+
+// Push num_frames frames numbered from 0, then close the iterator. pushed
+// counts the frames queued.
+static void push_frames(JaniceMediaIterator* it, uint32_t num_frames, atomic<uint32_t>* pushed, atomic<bool>* failed)
+{
+    for (uint32_t i = 0; i < num_frames; ++i) {
+        uint32_t number = i;
+        JaniceImage frame = numbered_frame(number);
+
+        if (janice_io_memory_push_frame(it, &frame) != JANICE_SUCCESS) {
+            *failed = true;
+            break;
+        }
+        ++*pushed;
+    }
+
+    if (janice_io_memory_close_live_media_iterator(it) != JANICE_SUCCESS) {
+        *failed = true;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Check a live iterator that blocks the producer while the ring is full
+
+int check_live_blocking()
+{
+    const uint32_t capacity = 4;
+    const uint32_t num_frames = 1000;
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_memory_create_live_media_iterator(capacity, false, &it),
+                // Cleanup
+                [](){})
+
+    atomic<uint32_t> pushed(0);
+    atomic<bool> failed(false);
+    thread producer(push_frames, &it, num_frames, &pushed, &failed);
+
+    auto cleanup = [&]() {
+        producer.join();
+        it.free(&it);
+    };
+
+    // Every frame arrives, in order, and the producer never gets more than
+    // capacity frames ahead
+    JaniceImage image;
+    uint32_t frame;
+    for (uint32_t i = 0; i < num_frames; ++i) {
+        JANICE_CALL(it.next(&it, &image),
+                    // Cleanup
+                    cleanup)
+
+        const bool in_order = image.channels == 4 && frame_number(image) == i;
+        JANICE_CALL(it.free_image(&image),
+                    // Cleanup
+                    cleanup)
+
+        CHECK(in_order,
+              "A live iterator that blocks the producer should return every frame in the order it was pushed",
+              // Cleanup
+              cleanup)
+
+        CHECK(pushed <= i + 1 + capacity,
+              "A live iterator that blocks the producer should never hold more than capacity frames",
+              // Cleanup
+              cleanup)
+
+        JANICE_CALL(it.tell(&it, &frame),
+                    // Cleanup
+                    cleanup)
+
+        CHECK(frame == i + 1,
+              "tell on a live iterator should return the number of the next frame to read",
+              // Cleanup
+              cleanup)
+    }
+
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a closed live iterator should return JANICE_MEDIA_AT_END once every frame is read",
+          // Cleanup
+          cleanup)
+
+    producer.join();
+
+    CHECK(!failed,
+          "Pushing frames to and closing an open live iterator should succeed",
+          // Cleanup
+          [&]() {
+              it.free(&it);
+          })
+
+    it.free(&it);
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check a live iterator that drops the oldest frame while the ring is full
+
+int check_live_drop_oldest()
+{
+    const uint32_t capacity = 3;
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_memory_create_live_media_iterator(capacity, true, &it),
+                // Cleanup
+                [](){})
+
+    auto cleanup = [&]() {
+        it.free(&it);
+    };
+
+    // With no consumer, pushing never blocks and only the newest frames are kept
+    atomic<uint32_t> pushed(0);
+    atomic<bool> failed(false);
+    push_frames(&it, 10, &pushed, &failed);
+
+    CHECK(!failed && pushed == 10,
+          "Pushing to a full live iterator that drops the oldest frame should never block or fail",
+          // Cleanup
+          cleanup)
+
+    uint32_t frame;
+    JANICE_CALL(it.tell(&it, &frame),
+                // Cleanup
+                cleanup)
+
+    CHECK(frame == 10 - capacity,
+          "tell on a live iterator should count the frames that were dropped",
+          // Cleanup
+          cleanup)
+
+    JaniceImage image;
+    for (uint32_t i = 10 - capacity; i < 10; ++i) {
+        JANICE_CALL(it.next(&it, &image),
+                    // Cleanup
+                    cleanup)
+
+        const bool newest = frame_number(image) == i;
+        JANICE_CALL(it.free_image(&image),
+                    // Cleanup
+                    cleanup)
+
+        CHECK(newest,
+              "A live iterator that drops the oldest frame should keep the newest capacity frames",
+              // Cleanup
+              cleanup)
+    }
+
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a closed live iterator should return JANICE_MEDIA_AT_END once every frame is read",
+          // Cleanup
+          cleanup)
+
+    uint32_t number = 10;
+    JaniceImage late = numbered_frame(number);
+    CHECK(janice_io_memory_push_frame(&it, &late) == JANICE_MEDIA_AT_END,
+          "Pushing a frame to a closed live iterator should return JANICE_MEDIA_AT_END",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+
+    // With a consumer racing the producer for the oldest frame, frames are
+    // returned in order with gaps, ending with the last frame pushed
+    const uint32_t num_frames = 1000;
+    JANICE_CALL(janice_io_memory_create_live_media_iterator(capacity, true, &it),
+                // Cleanup
+                [](){})
+
+    pushed = 0;
+    thread producer(push_frames, &it, num_frames, &pushed, &failed);
+
+    auto join_and_free = [&]() {
+        producer.join();
+        it.free(&it);
+    };
+
+    int64_t last = -1;
+    uint32_t count = 0;
+    JaniceError status;
+    while ((status = it.next(&it, &image)) == JANICE_SUCCESS) {
+        const uint32_t number = frame_number(image);
+        JANICE_CALL(it.free_image(&image),
+                    // Cleanup
+                    join_and_free)
+
+        CHECK(number > last,
+              "A live iterator that drops the oldest frame should return frames in order, each once",
+              // Cleanup
+              join_and_free)
+
+        last = number;
+        ++count;
+    }
+
+    CHECK(status == JANICE_MEDIA_AT_END,
+          "next on a closed live iterator should return JANICE_MEDIA_AT_END once every frame is read",
+          // Cleanup
+          join_and_free)
+
+    CHECK(count > 0 && last == num_frames - 1,
+          "A live iterator that drops the oldest frame should always return the last frame pushed",
+          // Cleanup
+          join_and_free)
+
+    producer.join();
+
+    CHECK(!failed,
+          "Pushing frames to and closing an open live iterator should succeed",
+          // Cleanup
+          [&]() {
+              it.free(&it);
+          })
+
+    it.free(&it);
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check that a consumer waiting for a frame wakes up when the iterator closes
+
+int check_live_close()
+{
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_memory_create_live_media_iterator(1, false, &it),
+                // Cleanup
+                [](){})
+
+    atomic<JaniceError> status(JANICE_SUCCESS);
+    thread consumer([&]() {
+        JaniceImage image;
+        status = it.next(&it, &image);
+        if (status == JANICE_SUCCESS) {
+            it.free_image(&image);
+        }
+    });
+
+    JANICE_CALL(janice_io_memory_close_live_media_iterator(&it),
+                // Cleanup
+                [&]() {
+                    consumer.join();
+                    it.free(&it);
+                })
+
+    consumer.join();
+
+    CHECK(status == JANICE_MEDIA_AT_END,
+          "next waiting on an empty live iterator should return JANICE_MEDIA_AT_END when it is closed",
+          // Cleanup
+          [&]() {
+              it.free(&it);
+          })
+
+    it.free(&it);
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check iterators that borrow the caller's images instead of copying them
+
+int check_borrowed_media()
+{
+    // Three 2x3 frames with 3 channels, one after another in one buffer
+    const uint32_t frame_size = 3 * 2 * 3;
+    vector<uint8_t> pixels(3 * frame_size);
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        pixels[i] = (uint8_t) i;
+    }
+    const vector<uint8_t> original = pixels;
+
+    JaniceImage frames[3];
+    for (uint32_t i = 0; i < 3; ++i) {
+        frames[i].channels = 3;
+        frames[i].rows = 2;
+        frames[i].cols = 3;
+        frames[i].data = pixels.data() + i * frame_size;
+        frames[i].owner = false;
+    }
+
+    // next, get and next_batch return views of the caller's pixels
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_memory_create_borrowed_media_iterator(&frames[0], &it),
+                // Cleanup
+                [](){})
+
+    auto cleanup = [&]() {
+        it.free(&it);
+    };
+
+    JaniceImage image;
+    JANICE_CALL(it.next(&it, &image),
+                // Cleanup
+                cleanup)
+
+    bool borrowed = !image.owner && image.data == frames[0].data;
+    JANICE_CALL(it.free_image(&image),
+                // Cleanup
+                cleanup)
+
+    JANICE_CALL(it.get(&it, &image, 0),
+                // Cleanup
+                cleanup)
+
+    borrowed = borrowed && !image.owner && image.data == frames[0].data;
+    JANICE_CALL(it.free_image(&image),
+                // Cleanup
+                cleanup)
+
+    JANICE_CALL(it.reset(&it),
+                // Cleanup
+                cleanup)
+
+    uint32_t num_images;
+    JANICE_CALL(it.next_batch(&it, &image, 1, &num_images),
+                // Cleanup
+                cleanup)
+
+    borrowed = borrowed && num_images == 1 && !image.owner && image.data == frames[0].data;
+    JANICE_CALL(it.free_image(&image),
+                // Cleanup
+                cleanup)
+
+    CHECK(borrowed,
+          "A borrowed iterator should return views of the caller's image",
+          // Cleanup
+          cleanup)
+
+    // A region is copied, since a view of it would need a stride
+    JaniceRect rect;
+    rect.x = 1;
+    rect.y = 1;
+    rect.width = 2;
+    rect.height = 1;
+    JANICE_CALL(it.get_roi(&it, &image, 0, &rect),
+                // Cleanup
+                cleanup)
+
+    const bool copied = image.owner && image.rows == 1 && image.cols == 2 &&
+                        memcmp(image.data, frames[0].data + (1 * 3 + 1) * 3, 2 * 3) == 0;
+    JANICE_CALL(it.free_image(&image),
+                // Cleanup
+                cleanup)
+
+    CHECK(copied,
+          "get_roi on a borrowed iterator should return a copy of the region",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+
+    CHECK(pixels == original,
+          "Freeing a borrowed iterator and its images should leave the caller's image alone",
+          // Cleanup
+          [](){})
+
+    // The sparse form borrows every image
+    JANICE_CALL(janice_io_memory_create_sparse_borrowed_media_iterator(frames, 3, &it),
+                // Cleanup
+                [](){})
+
+    JANICE_CALL(it.next(&it, &image),
+                // Cleanup
+                cleanup)
+
+    borrowed = !image.owner && image.data == frames[0].data;
+    JANICE_CALL(it.free_image(&image),
+                // Cleanup
+                cleanup)
+
+    JaniceImage images[2];
+    JANICE_CALL(it.next_batch(&it, images, 2, &num_images),
+                // Cleanup
+                cleanup)
+
+    for (uint32_t i = 0; i < num_images; ++i) {
+        borrowed = borrowed && !images[i].owner && images[i].data == frames[i + 1].data;
+        JANICE_CALL(it.free_image(&images[i]),
+                    // Cleanup
+                    cleanup)
+    }
+
+    JANICE_CALL(it.get(&it, &image, 1),
+                // Cleanup
+                cleanup)
+
+    borrowed = borrowed && num_images == 2 && !image.owner && image.data == frames[1].data;
+    JANICE_CALL(it.free_image(&image),
+                // Cleanup
+                cleanup)
+
+    CHECK(borrowed,
+          "A sparse borrowed iterator should return views of the caller's images",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(it.get_roi(&it, &image, 2, &rect),
+                // Cleanup
+                cleanup)
+
+    const bool copied_sparse = image.owner && image.rows == 1 && image.cols == 2 &&
+                               memcmp(image.data, frames[2].data + (1 * 3 + 1) * 3, 2 * 3) == 0;
+    JANICE_CALL(it.free_image(&image),
+                // Cleanup
+                cleanup)
+
+    CHECK(copied_sparse,
+          "get_roi on a sparse borrowed iterator should return a copy of the region",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+
+    CHECK(pixels == original,
+          "Freeing a sparse borrowed iterator and its images should leave the caller's images alone",
+          // Cleanup
+          [](){})
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check a sparse iterator over frames given out of order
+
+int check_sparse_find_frame()
+{
+    // Single pixel images numbered by their value. Images 1 and 3 were both
+    // taken from frame 10, so they keep their order.
+    uint8_t values[] = { 0, 1, 2, 3, 4 };
+    const uint32_t frames[] = { 50, 10, 30, 10, 70 };
+
+    JaniceImage images[5];
+    for (uint32_t i = 0; i < 5; ++i) {
+        images[i].channels = 1;
+        images[i].rows = 1;
+        images[i].cols = 1;
+        images[i].data = &values[i];
+        images[i].owner = false;
+    }
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_memory_create_sparse_media_iterator_with_frames(images, frames, 5, &it),
+                // Cleanup
+                [](){})
+
+    auto cleanup = [&]() {
+        it.free(&it);
+    };
+
+    // Images are iterated in frame order, equal frames in the order given
+    const uint8_t sorted[] = { 1, 3, 2, 0, 4 };
+    const uint32_t sorted_frames[] = { 10, 10, 30, 50, 70 };
+
+    JaniceImage image;
+    for (uint32_t i = 0; i < 5; ++i) {
+        JANICE_CALL(it.next(&it, &image),
+                    // Cleanup
+                    cleanup)
+
+        const bool in_order = image.data[0] == sorted[i];
+        JANICE_CALL(it.free_image(&image),
+                    // Cleanup
+                    cleanup)
+
+        uint32_t physical;
+        JANICE_CALL(it.physical_frame(&it, i, &physical),
+                    // Cleanup
+                    cleanup)
+
+        CHECK(in_order && physical == sorted_frames[i],
+              "A sparse iterator with frames should return its images sorted by frame, keeping the order of equal frames",
+              // Cleanup
+              cleanup)
+    }
+
+    // An exact hit, the first of two images from one frame, a frame between
+    // images and a frame past the last image
+    uint32_t logical;
+    JANICE_CALL(janice_io_memory_sparse_find_frame(&it, 30, &logical),
+                // Cleanup
+                cleanup)
+
+    CHECK(logical == 2,
+          "janice_io_memory_sparse_find_frame should find the image taken from a frame",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(janice_io_memory_sparse_find_frame(&it, 10, &logical),
+                // Cleanup
+                cleanup)
+
+    CHECK(logical == 0,
+          "janice_io_memory_sparse_find_frame should find the first of the images taken from a frame",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(janice_io_memory_sparse_find_frame(&it, 31, &logical),
+                // Cleanup
+                cleanup)
+
+    CHECK(logical == 3,
+          "janice_io_memory_sparse_find_frame should find the next image after a frame without one",
+          // Cleanup
+          cleanup)
+
+    CHECK(janice_io_memory_sparse_find_frame(&it, 71, &logical) == JANICE_OUT_OF_BOUNDS_ACCESS,
+          "janice_io_memory_sparse_find_frame past the last image should return JANICE_OUT_OF_BOUNDS_ACCESS",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+
+    // Only sparse iterators have frames to search
+    JANICE_CALL(janice_io_memory_create_media_iterator(&images[0], &it),
+                // Cleanup
+                [](){})
+
+    CHECK(janice_io_memory_sparse_find_frame(&it, 0, &logical) == JANICE_BAD_ARGUMENT,
+          "janice_io_memory_sparse_find_frame on an iterator that isn't sparse should return JANICE_BAD_ARGUMENT",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+
+    return 0;
+}
+
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+
+// The test image of the opencv_io tests, relative to this directory
+static const char* test_image = "../../opencv_io/test/media/test_image.png";
+
+// Check an image holds the same pixels as a continuous cv::Mat
+static bool same_image(const JaniceImage& image, const cv::Mat& m)
+{
+    return m.isContinuous() &&
+           image.channels == (uint32_t) m.channels() &&
+           image.rows == (uint32_t) m.rows &&
+           image.cols == (uint32_t) m.cols &&
+           memcmp(image.data, m.data, m.total() * m.elemSize()) == 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check an iterator over a single encoded image, copied or shared
+
+int check_encoded_media()
+{
+    const cv::Mat still = cv::imread(test_image, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
+    CHECK(!still.empty(),
+          "OpenCV should be able to read the test image",
+          // Cleanup
+          [](){})
+
+    vector<uint8_t> png;
+    CHECK(cv::imencode(".png", still, png),
+          "OpenCV should be able to encode the test image",
+          // Cleanup
+          [](){})
+
+    // A copied buffer can be changed as soon as the iterator is created
+    vector<uint8_t> buffer = png;
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_memory_create_encoded_media_iterator(buffer.data(), buffer.size(), false, &it),
+                // Cleanup
+                [](){})
+
+    auto cleanup = [&]() {
+        it.free(&it);
+    };
+
+    fill(buffer.begin(), buffer.end(), 0);
+
+    JaniceImage image;
+    JANICE_CALL(it.next(&it, &image),
+                // Cleanup
+                cleanup)
+
+    const bool decoded = image.owner && same_image(image, still);
+    it.free_image(&image);
+
+    CHECK(decoded,
+          "An encoded iterator should decode the same pixels as cv::imread from its own copy of the buffer",
+          // Cleanup
+          cleanup)
+
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on an encoded iterator over one image should return JANICE_MEDIA_AT_END after the image",
+          // Cleanup
+          cleanup)
+
+    // A single image has no position, but can be read again from the start
+    uint32_t frame;
+    CHECK(it.tell(&it, &frame) == JANICE_INVALID_MEDIA,
+          "tell on an encoded iterator over one image should return JANICE_INVALID_MEDIA",
+          // Cleanup
+          cleanup)
+
+    CHECK(it.seek(&it, 1) == JANICE_INVALID_MEDIA,
+          "seek past the image of an encoded iterator over one image should return JANICE_INVALID_MEDIA",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(it.seek(&it, 0),
+                // Cleanup
+                cleanup)
+
+    JANICE_CALL(it.next(&it, &image),
+                // Cleanup
+                cleanup)
+
+    const bool reread = same_image(image, still);
+    it.free_image(&image);
+
+    CHECK(reread,
+          "next after seeking an encoded iterator back to its image should decode it again",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+
+    // A shared buffer is read in place, so changing it changes what is decoded
+    buffer = png;
+    JANICE_CALL(janice_io_memory_create_encoded_media_iterator(buffer.data(), buffer.size(), true, &it),
+                // Cleanup
+                [](){})
+
+    JANICE_CALL(it.get(&it, &image, 0),
+                // Cleanup
+                cleanup)
+
+    const bool shared = same_image(image, still);
+    it.free_image(&image);
+
+    CHECK(shared,
+          "An encoded iterator should decode the same pixels as cv::imread from a shared buffer",
+          // Cleanup
+          cleanup)
+
+    fill(buffer.begin(), buffer.end(), 0);
+    CHECK(it.get(&it, &image, 0) == JANICE_INVALID_MEDIA,
+          "An encoded iterator should read a shared buffer in place",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check a sparse iterator over encoded images, one of which can't be decoded
+
+int check_sparse_encoded_media()
+{
+    const cv::Mat still = cv::imread(test_image, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
+    CHECK(!still.empty(),
+          "OpenCV should be able to read the test image",
+          // Cleanup
+          [](){})
+
+    // The still, a crop of it, bytes that aren't an image and the still again
+    const cv::Mat crop = still(cv::Rect(50, 100, 150, 80)).clone();
+    const cv::Mat expected[] = { still, crop, cv::Mat(), still };
+
+    vector<uint8_t> full, part;
+    CHECK(cv::imencode(".png", still, full) && cv::imencode(".png", crop, part),
+          "OpenCV should be able to encode the test image",
+          // Cleanup
+          [](){})
+
+    vector<uint8_t> garbage(full.size(), 0x5a);
+    const uint8_t* buffers[] = { full.data(), part.data(), garbage.data(), full.data() };
+    const size_t lengths[] = { full.size(), part.size(), garbage.size(), full.size() };
+
+    for (int share = 0; share < 2; ++share) {
+        JaniceMediaIterator it;
+        JANICE_CALL(janice_io_memory_create_sparse_encoded_media_iterator(buffers, lengths, 4, share == 1, &it),
+                    // Cleanup
+                    [](){})
+
+        auto cleanup = [&]() {
+            it.free(&it);
+        };
+
+        // A batch stops short at the image that can't be decoded
+        JaniceImage images[4];
+        uint32_t num_images;
+        JANICE_CALL(it.next_batch(&it, images, 4, &num_images),
+                    // Cleanup
+                    cleanup)
+
+        bool same = num_images == 2;
+        for (uint32_t i = 0; i < num_images; ++i) {
+            same = same && same_image(images[i], expected[i]);
+            it.free_image(&images[i]);
+        }
+
+        CHECK(same,
+              "next_batch on an encoded iterator should return the images decoded before one that can't be",
+              // Cleanup
+              cleanup)
+
+        uint32_t frame;
+        JANICE_CALL(it.tell(&it, &frame),
+                    // Cleanup
+                    cleanup)
+
+        CHECK(frame == 2,
+              "tell on an encoded iterator should return the image a short batch stopped at",
+              // Cleanup
+              cleanup)
+
+        CHECK(it.next_batch(&it, images, 4, &num_images) == JANICE_INVALID_MEDIA && num_images == 0,
+              "next_batch on an encoded iterator should return JANICE_INVALID_MEDIA at an image that can't be decoded",
+              // Cleanup
+              cleanup)
+
+        JaniceImage image;
+        CHECK(it.get(&it, &image, 2) == JANICE_INVALID_MEDIA,
+              "get on an encoded iterator should return JANICE_INVALID_MEDIA for an image that can't be decoded",
+              // Cleanup
+              cleanup)
+
+        // The images after it can still be read
+        JANICE_CALL(it.seek(&it, 3),
+                    // Cleanup
+                    cleanup)
+
+        JANICE_CALL(it.next(&it, &image),
+                    // Cleanup
+                    cleanup)
+
+        same = same_image(image, expected[3]);
+        it.free_image(&image);
+
+        CHECK(same,
+              "An encoded iterator should decode the images after one that can't be decoded",
+              // Cleanup
+              cleanup)
+
+        CHECK(it.tell(&it, &frame) == JANICE_MEDIA_AT_END,
+              "tell on a sparse encoded iterator should return JANICE_MEDIA_AT_END after the last image",
+              // Cleanup
+              cleanup)
+
+        CHECK(it.seek(&it, 4) == JANICE_BAD_ARGUMENT,
+              "seek past the last image of a sparse encoded iterator should return JANICE_BAD_ARGUMENT",
+              // Cleanup
+              cleanup)
+
+        it.free(&it);
+    }
+
+    return 0;
+}
+
+#endif // JANICE_IO_MEMORY_WITH_OPENCV
+
+#ifdef JANICE_IO_TEST_WITH_SHM
+
+static const char* shm_name = "/janice_io_memory_unit_test";
+
+// A small frame whose pixels depend on its frame number
+static const uint32_t shm_channels = 3, shm_rows = 4, shm_cols = 5;
+
+static void fill_shm_frame(uint8_t* data, uint32_t number)
+{
+    for (uint32_t i = 0; i < shm_channels * shm_rows * shm_cols; ++i) {
+        data[i] = (uint8_t) (number * 7 + i);
+    }
+}
+
+static bool is_shm_frame(const JaniceImage& image, uint32_t number)
+{
+    if (image.channels != shm_channels || image.rows != shm_rows || image.cols != shm_cols || image.owner) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < shm_channels * shm_rows * shm_cols; ++i) {
+        if (image.data[i] != (uint8_t) (number * 7 + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The header of the slot a frame's pixels were written to
+static JaniceShmSlot* slot_of(uint8_t* data)
+{
+    return (JaniceShmSlot*) (data - sizeof(JaniceShmSlot));
+}
+
+static uint32_t slot_state(uint8_t* data)
+{
+    return __atomic_load_n(&slot_of(data)->state, __ATOMIC_ACQUIRE);
+}
+
+// Publish frames numbered first to first + num_frames - 1, as a camera would
+// number them, then close the ring
+static void publish_frames(JaniceShmProducer* producer, uint32_t first, uint32_t num_frames, atomic<bool>* failed)
+{
+    for (uint32_t i = first; i < first + num_frames; ++i) {
+        uint8_t* data;
+        if (janice_io_memory_shm_producer_acquire(producer, shm_channels, shm_rows, shm_cols, &data) != JANICE_SUCCESS) {
+            *failed = true;
+            break;
+        }
+
+        fill_shm_frame(data, i);
+        if (janice_io_memory_shm_producer_publish(producer, 1000 + i) != JANICE_SUCCESS) {
+            *failed = true;
+            break;
+        }
+    }
+
+    janice_io_memory_shm_producer_close(producer);
+}
+
+// ----------------------------------------------------------------------------
+// Check frames handed through a shared memory ring by a producer thread
+
+int check_shm_ring()
+{
+    const uint32_t num_slots = 2;
+    const uint32_t num_frames = 200;
+
+    JaniceShmProducer* producer;
+    JANICE_CALL(janice_io_memory_create_shm_producer(shm_name, num_slots, shm_channels * shm_rows * shm_cols, &producer),
+                // Cleanup
+                [](){})
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_memory_create_shm_media_iterator(shm_name, &it),
+                // Cleanup
+                [&]() {
+                    janice_io_memory_free_shm_producer(producer);
+                })
+
+    auto cleanup = [&]() {
+        it.free(&it);
+        janice_io_memory_free_shm_producer(producer);
+    };
+
+    // Follow the first frame through its slot: FREE while it is written,
+    // READY once published, LENT while the consumer holds it and FREE again
+    // once it is released
+    uint8_t* first;
+    JANICE_CALL(janice_io_memory_shm_producer_acquire(producer, shm_channels, shm_rows, shm_cols, &first),
+                // Cleanup
+                cleanup)
+
+    fill_shm_frame(first, 0);
+    CHECK(slot_state(first) == JANICE_SHM_SLOT_FREE,
+          "A slot being written by the producer should stay FREE until it is published",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(janice_io_memory_shm_producer_publish(producer, 1000),
+                // Cleanup
+                cleanup)
+
+    CHECK(slot_state(first) == JANICE_SHM_SLOT_READY,
+          "A published slot should be READY",
+          // Cleanup
+          cleanup)
+
+    JaniceImage image;
+    JANICE_CALL(it.next(&it, &image),
+                // Cleanup
+                cleanup)
+
+    // The consumer maps the segment at its own address
+    uint8_t* lent = image.data;
+    CHECK(is_shm_frame(image, 0),
+          "A shared memory iterator should lend the pixels the producer wrote in place",
+          // Cleanup
+          cleanup)
+
+    CHECK(slot_state(first) == JANICE_SHM_SLOT_LENT && slot_state(lent) == JANICE_SHM_SLOT_LENT,
+          "A slot returned by next should be LENT until the frame is freed",
+          // Cleanup
+          cleanup)
+
+    uint32_t physical;
+    JANICE_CALL(it.physical_frame(&it, 0, &physical),
+                // Cleanup
+                cleanup)
+
+    CHECK(physical == 1000,
+          "physical_frame on a shared memory iterator should return the frame number given by the producer",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(it.free_image(&image),
+                // Cleanup
+                cleanup)
+
+    CHECK(slot_state(first) == JANICE_SHM_SLOT_FREE,
+          "Freeing a frame from a shared memory iterator should hand its slot back to the producer",
+          // Cleanup
+          cleanup)
+
+    // The rest come from a producer thread that has to wait for the consumer
+    // to recycle each slot, since the ring is much smaller than the frames
+    atomic<bool> failed(false);
+    thread publisher(publish_frames, producer, 1, num_frames - 1, &failed);
+
+    auto join_and_free = [&]() {
+        // Drain the ring so the producer isn't left waiting for a slot
+        JaniceImage rest;
+        while (it.next(&it, &rest) == JANICE_SUCCESS) {
+            it.free_image(&rest);
+        }
+        publisher.join();
+        cleanup();
+    };
+
+    uint8_t* second = nullptr;
+    for (uint32_t i = 1; i < num_frames; ++i) {
+        JANICE_CALL(it.next(&it, &image),
+                    // Cleanup
+                    join_and_free)
+
+        if (i == 1) {
+            second = image.data;
+        }
+
+        uint8_t* data = image.data;
+        const bool same = is_shm_frame(image, i);
+        const bool was_lent = slot_state(data) == JANICE_SHM_SLOT_LENT;
+        const bool recycled = data == (i % num_slots == 0 ? lent : second);
+        const bool numbered = it.physical_frame(&it, i, &physical) == JANICE_SUCCESS && physical == 1000 + i;
+
+        JANICE_CALL(it.free_image(&image),
+                    // Cleanup
+                    join_and_free)
+
+        CHECK(same && numbered,
+              "A shared memory iterator should return every published frame in order",
+              // Cleanup
+              join_and_free)
+
+        CHECK(was_lent && recycled && second != lent,
+              "A shared memory iterator should lend each frame from the next slot of the ring",
+              // Cleanup
+              join_and_free)
+    }
+
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a closed shared memory ring should return JANICE_MEDIA_AT_END once every frame is read",
+          // Cleanup
+          join_and_free)
+
+    publisher.join();
+
+    CHECK(!failed,
+          "Publishing frames to a shared memory ring should succeed",
+          // Cleanup
+          cleanup)
+
+    uint32_t frame;
+    JANICE_CALL(it.tell(&it, &frame),
+                // Cleanup
+                cleanup)
+
+    CHECK(frame == num_frames,
+          "tell on a shared memory iterator should return the number of frames read",
+          // Cleanup
+          cleanup)
+
+    cleanup();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check that a shared memory iterator rejects sizes that disagree with the
+// header of the ring
+
+int check_shm_bad_sizes()
+{
+    const size_t frame_size = shm_channels * shm_rows * shm_cols;
+
+    JaniceShmProducer* producer;
+    JANICE_CALL(janice_io_memory_create_shm_producer(shm_name, 1, frame_size, &producer),
+                // Cleanup
+                [](){})
+
+    auto free_producer = [&]() {
+        janice_io_memory_free_shm_producer(producer);
+    };
+
+    uint8_t* data;
+    JANICE_CALL(janice_io_memory_shm_producer_acquire(producer, shm_channels, shm_rows, shm_cols, &data),
+                // Cleanup
+                free_producer)
+
+    // A header that claims slots larger than the segment holds is refused
+    // when the ring is opened
+    JaniceShmHeader* header = (JaniceShmHeader*) ((uint8_t*) slot_of(data) - sizeof(JaniceShmHeader));
+    const uint64_t slot_size = header->slot_size;
+    header->slot_size = slot_size * 2;
+
+    JaniceMediaIterator it;
+    CHECK(janice_io_memory_create_shm_media_iterator(shm_name, &it) == JANICE_INVALID_MEDIA,
+          "Opening a shared memory ring whose slots don't fit in the segment should return JANICE_INVALID_MEDIA",
+          // Cleanup
+          free_producer)
+
+    header->slot_size = slot_size;
+
+    JANICE_CALL(janice_io_memory_create_shm_media_iterator(shm_name, &it),
+                // Cleanup
+                free_producer)
+
+    auto cleanup = [&]() {
+        it.free(&it);
+        janice_io_memory_free_shm_producer(producer);
+    };
+
+    // A slot whose frame is larger than the slot size in the header is refused
+    // instead of read past the end of the slot
+    fill_shm_frame(data, 0);
+    JANICE_CALL(janice_io_memory_shm_producer_publish(producer, 0),
+                // Cleanup
+                cleanup)
+
+    slot_of(data)->rows = (uint32_t) slot_size;
+
+    JaniceImage image;
+    CHECK(it.next(&it, &image) == JANICE_INVALID_MEDIA,
+          "next on a shared memory ring should return JANICE_INVALID_MEDIA for a frame larger than a slot",
+          // Cleanup
+          cleanup)
+
+    cleanup();
+
+    return 0;
+}
+
+#endif // JANICE_IO_TEST_WITH_SHM
+
+// ----------------------------------------------------------------------------
+// Main test function
+
+int main(int, char*[])
+{
+    // Check that a full live iterator blocks the producer and loses no frames
+    if (check_live_blocking() == 1)
+        return 1;
+
+    // Check that a full live iterator can drop its oldest frames instead
+    if (check_live_drop_oldest() == 1)
+        return 1;
+
+    // Check that closing a live iterator wakes up a waiting consumer
+    if (check_live_close() == 1)
+        return 1;
+
+    // Check that borrowed iterators hand out the caller's images without copying
+    if (check_borrowed_media() == 1)
+        return 1;
+
+    // Check that frames given out of order are sorted and can be found
+    if (check_sparse_find_frame() == 1)
+        return 1;
+
+#ifdef JANICE_IO_MEMORY_WITH_OPENCV
+    // Check that an encoded image is decoded like cv::imread, copied or shared
+    if (check_encoded_media() == 1)
+        return 1;
+
+    // Check that a batch of encoded images stops at one that can't be decoded
+    if (check_sparse_encoded_media() == 1)
+        return 1;
+#endif
+
+#ifdef JANICE_IO_TEST_WITH_SHM
+    // Check that frames are lent between processes through a shared memory ring
+    if (check_shm_ring() == 1)
+        return 1;
+
+    // Check that a shared memory ring with inconsistent sizes is rejected
+    if (check_shm_bad_sizes() == 1)
+        return 1;
+#endif
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Publish synthetic frames to a shared memory frame ring. With --consume a
+// forked child reads them back through janice_io_memory_create_shm_media_iterator
+// and the throughput of the hand-off is reported. Without it, frames wait for a
+// consumer in another process.
+
+#include <janice_io_memory_shm.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "usage: %s <name> [--frames N] [--rows R] [--cols C] [--channels K] [--slots S] [--consume]\n",
+            program);
+}
+
+// Read every frame and check its first pixel, which holds the frame number
+static int consume(const char* name, uint32_t frames)
+{
+    JaniceMediaIterator it;
+    if (janice_io_memory_create_shm_media_iterator(name, &it) != JANICE_SUCCESS) {
+        fprintf(stderr, "Unable to open %s\n", name);
+        return 1;
+    }
+
+    uint32_t count = 0;
+    JaniceImage image;
+    JaniceError ret;
+    while ((ret = it.next(&it, &image)) == JANICE_SUCCESS) {
+        if (image.data[0] != (uint8_t) count) {
+            fprintf(stderr, "Frame %u has the wrong contents\n", count);
+            return 1;
+        }
+
+        it.free_image(&image);
+        ++count;
+    }
+    it.free(&it);
+
+    if (ret != JANICE_MEDIA_AT_END || count != frames) {
+        fprintf(stderr, "Read %u of %u frames: %s\n", count, frames, janice_error_to_string(ret));
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char* name = argv[1];
+    uint32_t frames = 1000, rows = 1080, cols = 1920, channels = 3, slots = 8;
+    bool consumer = false;
+
+    for (int i = 2; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--consume") {
+            consumer = true;
+        } else if (i + 1 < argc && arg == "--frames") {
+            frames = atoi(argv[++i]);
+        } else if (i + 1 < argc && arg == "--rows") {
+            rows = atoi(argv[++i]);
+        } else if (i + 1 < argc && arg == "--cols") {
+            cols = atoi(argv[++i]);
+        } else if (i + 1 < argc && arg == "--channels") {
+            channels = atoi(argv[++i]);
+        } else if (i + 1 < argc && arg == "--slots") {
+            slots = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    const size_t frame_size = (size_t) rows * cols * channels;
+
+    JaniceShmProducer* producer;
+    JaniceError ret = janice_io_memory_create_shm_producer(name, slots, frame_size, &producer);
+    if (ret != JANICE_SUCCESS) {
+        fprintf(stderr, "Unable to create %s: %s\n", name, janice_error_to_string(ret));
+        return 1;
+    }
+
+    pid_t child = -1;
+    if (consumer) {
+        child = fork();
+        if (child == 0) {
+            _exit(consume(name, frames));
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t frame = 0; frame < frames; ++frame) {
+        uint8_t* data;
+        ret = janice_io_memory_shm_producer_acquire(producer, channels, rows, cols, &data);
+        if (ret != JANICE_SUCCESS) {
+            fprintf(stderr, "Unable to acquire frame %u: %s\n", frame, janice_error_to_string(ret));
+            return 1;
+        }
+
+        memset(data, (uint8_t) frame, frame_size);
+        janice_io_memory_shm_producer_publish(producer, frame);
+    }
+
+    janice_io_memory_shm_producer_close(producer);
+    janice_io_memory_shm_producer_flush(producer);
+
+    int status = 0;
+    if (consumer) {
+        waitpid(child, &status, 0);
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    janice_io_memory_free_shm_producer(producer);
+
+    if (consumer && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        fprintf(stderr, "The consumer failed\n");
+        return 1;
+    }
+
+    printf("%u frames of %ux%ux%u in %.3f s: %.1f frames/s, %.2f GB/s\n",
+           frames, cols, rows, channels, seconds,
+           frames / seconds, frames * (double) frame_size / seconds / 1e9);
+
+    return 0;
+}
@@ -3,50 +3,348 @@
 
 #include <opencv2/highgui/highgui.hpp>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 namespace
 {
 
 struct JaniceMediaIteratorStateType
 {
     std::string filename;
+    JaniceIOOpenCVOptions options;
+    io_utils::OutputFormat format; // set with set_format
+    io_utils::FramePyramid pyramid; // of the last frame, see get_pyramid
 
     // was this object already initialized
     bool initialized;
+    // is this a still image. Stills are decoded into still_image on first use and
+    // kept there if options.cache_stills is set.
+    bool still;
+    cv::Mat still_image;
     // are we currently at the end of this object
     // behavior is: return success on last frame, return media_at_end on
     // subsequent reads, don't cycle.
     bool at_end;
 
+    // The capture is closed when too many are open, see DecoderCache.
+    // decoder_mutex is held while the capture is used so it can't be closed
+    // underneath us.
     cv::VideoCapture video;
+    std::mutex decoder_mutex;
+    std::list<JaniceMediaIteratorStateType*>::iterator decoder_entry;
+    bool decoder_cached;            // decoder_entry is valid
+    bool decoder_pinned;            // the prefetch worker is using video
+    // probed once when the video is opened. frame_count is unknown_frame for
+    // streams, which end when a frame fails to decode.
+    uint32_t frame_count;
+    double frame_rate;
+    // frame number the capture returns on its next read. The capture is only
+    // moved when a frame is actually needed, so this can differ from
+    // next_frame after seek or get.
+    uint32_t decoder_frame;
+
+    // Sorted keyframe numbers, loaded on the first random access
+    std::string keyframe_index;
+    std::vector<uint32_t> keyframes;
+    bool keyframes_loaded;
+
+    // Decode-ahead state, only used for videos when options.prefetch_frames > 0.
+    // While the worker thread is running it is the only user of video.
+    std::thread prefetch_thread;
+    std::mutex prefetch_mutex;
+    std::condition_variable prefetch_cv;
+    std::deque<cv::Mat> prefetched; // decoded frames, starting at next_frame
+    uint32_t next_frame;            // frame number next() will return
+    bool prefetch_stop;             // ask the worker to exit
+    bool prefetch_done;             // the worker couldn't decode another frame
+
+    ~JaniceMediaIteratorStateType();
+};
+
+// decoder_frame value when the capture position isn't known, e.g. after a
+// failed read, and frame_count value when the length isn't known
+static const uint32_t unknown_frame = std::numeric_limits<uint32_t>::max();
+
+static bool streaming(const JaniceMediaIteratorStateType* state)
+{
+    return state->frame_count == unknown_frame;
+}
+
+// A process-wide cap on open video captures. Each open capture holds a file
+// descriptor and decoder buffers, so iterators over large media lists can't
+// all keep one. Captures are kept in least recently used order and the
+// oldest idle one is closed when a new one is opened past the cap. Its
+// iterator reopens the video and seeks back on the next read. Captures being
+// decoded ahead and streams, which can't be reopened where they left off, are
+// never closed.
+class DecoderCache
+{
+public:
+    static DecoderCache& instance()
+    {
+        static DecoderCache cache;
+        return cache;
+    }
+
+    void set_max_open(uint32_t max)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_open = max;
+        evict(nullptr);
+    }
+
+    // Open the capture of state if it was closed and mark it as the most
+    // recently used. state->decoder_mutex must be held.
+    bool acquire(JaniceMediaIteratorStateType* state)
+    {
+        if (!state->video.isOpened()) {
+            state->video.open(state->filename);
+            if (!state->video.isOpened()) {
+                return false;
+            }
+            state->decoder_frame = 0;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (state->decoder_cached) {
+            open.splice(open.begin(), open, state->decoder_entry);
+        } else {
+            state->decoder_entry = open.insert(open.begin(), state);
+            state->decoder_cached = true;
+        }
+        evict(state);
+
+        return true;
+    }
+
+    void remove(JaniceMediaIteratorStateType* state)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (state->decoder_cached) {
+            open.erase(state->decoder_entry);
+            state->decoder_cached = false;
+        }
+    }
+
+private:
+    DecoderCache() : max_open(64) {}
+
+    // Close the least recently used captures until we're under the cap. Busy
+    // captures are skipped, if all of them are busy we stay over the cap.
+    void evict(const JaniceMediaIteratorStateType* keep)
+    {
+        auto candidate = open.end();
+        while (max_open != 0 && open.size() > max_open && candidate != open.begin()) {
+            JaniceMediaIteratorStateType* state = *--candidate;
+            if (state == keep || !state->decoder_mutex.try_lock()) {
+                continue;
+            }
+
+            if (!state->decoder_pinned && !streaming(state)) {
+                state->video.release();
+                state->decoder_cached = false;
+                candidate = open.erase(candidate);
+            }
+            state->decoder_mutex.unlock();
+        }
+    }
+
+    std::mutex mutex;
+    std::list<JaniceMediaIteratorStateType*> open; // most recently used first
+    uint32_t max_open;
 };
 
+static void load_keyframe_index(JaniceMediaIteratorStateType* state)
+{
+    state->keyframes_loaded = true;
+    ocv_utils::find_keyframes(state->filename, state->keyframe_index,
+                              state->options.build_keyframe_index, state->options.save_keyframe_index,
+                              state->keyframes);
+}
+
+// Without an index we assume a keyframe at least every keyframe_interval
+// frames, or every second of video if no interval was given.
+static uint32_t keyframe_before(const JaniceMediaIteratorStateType* state, uint32_t frame)
+{
+    uint32_t interval = state->options.keyframe_interval;
+    if (interval == 0) {
+        interval = std::max(1, (int) state->frame_rate);
+    }
+
+    return ocv_utils::keyframe_before(state->keyframes, interval, frame);
+}
+
+// Move the capture so its next read returns frame. If there is no keyframe
+// between the current position and the target, decoding forward is cheaper
+// than a seek, which would have to decode from that keyframe anyway.
+static void position_decoder(JaniceMediaIteratorStateType* state, uint32_t frame)
+{
+    if (state->decoder_frame == frame) {
+        return;
+    }
+
+    if (state->decoder_frame != unknown_frame &&
+            frame > state->decoder_frame &&
+            keyframe_before(state, frame) <= state->decoder_frame) {
+        while (state->decoder_frame < frame && state->video.grab()) {
+            ++state->decoder_frame;
+        }
+
+        if (state->decoder_frame == frame) {
+            return;
+        }
+    }
+
+    state->video.set(CV_CAP_PROP_POS_FRAMES, frame);
+    state->decoder_frame = frame;
+}
+
+static void prefetch_worker(JaniceMediaIteratorStateType* state)
+{
+    while (true) {
+        std::unique_lock<std::mutex> lock(state->prefetch_mutex);
+        state->prefetch_cv.wait(lock, [state]() {
+            return state->prefetch_stop || state->prefetched.size() < state->options.prefetch_frames;
+        });
+
+        if (state->prefetch_stop) {
+            return;
+        }
+
+        // Decode without holding the lock so next() can pop finished frames
+        lock.unlock();
+        cv::Mat frame;
+        bool ok = state->video.read(frame);
+        lock.lock();
+
+        if (!ok) {
+            state->decoder_frame = unknown_frame;
+            state->prefetch_done = true;
+            state->prefetch_cv.notify_all();
+            return;
+        }
+
+        state->prefetched.push_back(frame);
+        ++state->decoder_frame;
+        state->prefetch_cv.notify_all();
+    }
+}
+
+// start decoding ahead from next_frame. state->decoder_mutex must be held.
+static void start_prefetch(JaniceMediaIteratorStateType* state)
+{
+    position_decoder(state, state->next_frame);
+    state->decoder_pinned = true;
+
+    state->prefetch_stop = false;
+    state->prefetch_done = false;
+    state->prefetch_thread = std::thread(prefetch_worker, state);
+}
+
+// stop the worker and drop any decoded frames
+static void stop_prefetch(JaniceMediaIteratorStateType* state)
+{
+    if (state->prefetch_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(state->prefetch_mutex);
+            state->prefetch_stop = true;
+        }
+        state->prefetch_cv.notify_all();
+        state->prefetch_thread.join();
+
+        std::lock_guard<std::mutex> lock(state->decoder_mutex);
+        state->decoder_pinned = false;
+    }
+
+    state->prefetched.clear();
+    state->prefetch_done = false;
+}
+
+static bool prefetching(const JaniceMediaIteratorStateType* state)
+{
+    return state->options.prefetch_frames > 0 && !state->still;
+}
+
+JaniceMediaIteratorStateType::~JaniceMediaIteratorStateType()
+{
+    DecoderCache::instance().remove(this);
+    stop_prefetch(this);
+}
+
 
-// initialize the iterator, for still images, img will be filled in, for
-// videos it will not, for videos the video capture (video) will be open
-static JaniceError initialize_media_iterator(JaniceMediaIterator& it, cv::Mat& img)
+// initialize the iterator. The file type is sniffed from its first bytes so
+// stills aren't decoded until a frame is requested. For videos the video
+// capture (video) will be open.
+static JaniceError initialize_media_iterator(JaniceMediaIterator& it)
 {
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it._internal;
 
     state->initialized = true;
 
-    /*
-     * Attempt imread. We use ANYCOLOR to load either RGB or Grayscale images.
-     * IGNORE_ORIENTATION will not rotate the image based on EXIF data.
-     */
-    img = cv::imread(state->filename, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION); //
+    uint8_t header[16];
+    size_t header_length = 0;
+    if (FILE* file = fopen(state->filename.c_str(), "rb")) {
+        header_length = fread(header, 1, sizeof(header), file);
+        fclose(file);
+    } else {
+        return JANICE_OPEN_ERROR;
+    }
 
-    // if this succeeds, we are confident the file is just an image and can
-    // return immediately.
-    if (img.data) {
-        // still images are considered @ the end after the first read.
-        state->at_end = true;
+    if (ocv_utils::has_still_image_signature(header, header_length)) {
+        state->still = true;
         return JANICE_SUCCESS;
     }
 
-    // Couldn't load as an image maybe it's a video
-    state->video.open(state->filename);
-    if (!state->video.isOpened()) // couldn't open as a video either? error out
-        return JANICE_OPEN_ERROR;
+    // Doesn't look like an image, maybe it's a video
+    std::lock_guard<std::mutex> decoder_lock(state->decoder_mutex);
+    if (!DecoderCache::instance().acquire(state)) {
+        // Last chance, an image format we don't recognize. Keep the decoded
+        // image around for the first read.
+        state->still_image = ocv_utils::read_still_image(state->filename,
+                                                         ocv_utils::imread_flags(state->options.decode_scale),
+                                                         state->options.read_mode);
+        if (!state->still_image.data) // couldn't open as a video either? error out
+            return JANICE_OPEN_ERROR;
+
+        state->still = true;
+        return JANICE_SUCCESS;
+    }
+
+    // Querying capture properties can be slow and, for some containers,
+    // inexact, so the iterator tracks its own position from here on
+    const double frame_count = state->video.get(CV_CAP_PROP_FRAME_COUNT);
+    state->frame_count = state->options.streaming || frame_count <= 0 ? unknown_frame
+                                                                     : (uint32_t) frame_count;
+    state->frame_rate = state->video.get(CV_CAP_PROP_FPS);
+    state->decoder_frame = 0;
+
+    return JANICE_SUCCESS;
+}
+
+// decode a still, or return the copy we already decoded
+static JaniceError read_still(JaniceMediaIteratorStateType* state, cv::Mat& img)
+{
+    if (state->still_image.data) {
+        img = state->still_image;
+    } else {
+        img = ocv_utils::read_still_image(state->filename, ocv_utils::imread_flags(state->options.decode_scale),
+                                          state->options.read_mode);
+        if (!img.data)
+            return JANICE_INVALID_MEDIA;
+    }
+
+    if (state->options.cache_stills) {
+        state->still_image = img;
+    } else {
+        state->still_image.release();
+    }
 
     return JANICE_SUCCESS;
 }
@@ -54,7 +352,14 @@ static JaniceError initialize_media_iterator(JaniceMediaIterator& it, cv::Mat& i
 JaniceError is_video(JaniceMediaIterator* it, bool* video)
 {
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
-    *video = state->video.isOpened();
+
+    if (!state->initialized) {
+        JaniceError rc = initialize_media_iterator(*it);
+        if (rc != JANICE_SUCCESS)
+            return rc;
+    }
+
+    *video = !state->still;
 
     return JANICE_SUCCESS;
 }
@@ -63,10 +368,16 @@ JaniceError get_frame_rate(JaniceMediaIterator* it, float* frame_rate)
 {
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
 
-    if (!state->video.isOpened())
+    if (!state->initialized) {
+        JaniceError rc = initialize_media_iterator(*it);
+        if (rc != JANICE_SUCCESS)
+            return rc;
+    }
+
+    if (state->still)
         return JANICE_INVALID_MEDIA;
 
-    *frame_rate = state->video.get(CV_CAP_PROP_FPS);
+    *frame_rate = state->frame_rate;
 
     return JANICE_SUCCESS;
 }
@@ -76,7 +387,8 @@ JaniceError get_physical_frame_rate(JaniceMediaIterator* it, float* frame_rate)
     return get_frame_rate(it, frame_rate);
 }
 
-JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
+// decode the frame at the current position and advance past it
+static JaniceError read_next(JaniceMediaIterator* it, cv::Mat& cv_frame)
 {
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
     // if we are currently at the end, just return.
@@ -85,67 +397,150 @@ JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
 
     if (!state->initialized) {
         // are we an image or a video?
-        cv::Mat buffer;
-        JaniceError rc = initialize_media_iterator(*it, buffer);
-
-        // we do an initial read on images, but not videos.
-        // if this is a still (video not opened by init), just convert the
-        // image we read to the output type, and return.
-        if (!state->video.isOpened()) {
-            JaniceError conv_rc = ocv_utils::cv_mat_to_janice_image(buffer, *image);
-            return conv_rc;
-        }
-
+        JaniceError rc = initialize_media_iterator(*it);
         if (rc != JANICE_SUCCESS)
             return rc; // got an error code on init, just return.
     }
 
-    // Check if the media is an image, if so just read it
-    // this can happen if: we do the initial read, then seek 0 on the still
-    // which unsets at_end. 
-    if (!state->video.isOpened()) {
-        cv::Mat cv_image = cv::imread(state->filename, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
-        ocv_utils::cv_mat_to_janice_image(cv_image, *image);
+    // Check if the media is an image, if so just read it. Still images are
+    // considered @ the end after the first read.
+    if (state->still) {
+        JaniceError ret = read_still(state, cv_frame);
+        if (ret != JANICE_SUCCESS)
+            return ret;
+
         state->at_end = true;
-	
         return JANICE_SUCCESS;
     }
 
     // video - a little bit more complicated
-    cv::Mat cv_frame;
+    if (prefetching(state)) {
+        if (!state->prefetch_thread.joinable()) {
+            std::lock_guard<std::mutex> decoder_lock(state->decoder_mutex);
+            if (!DecoderCache::instance().acquire(state))
+                return JANICE_OPEN_ERROR;
+            start_prefetch(state);
+        }
+
+        std::unique_lock<std::mutex> lock(state->prefetch_mutex);
+        state->prefetch_cv.wait(lock, [state]() {
+            return !state->prefetched.empty() || state->prefetch_done;
+        });
+
+        // the worker failed to read the frame. For a stream that's the end.
+        if (state->prefetched.empty()) {
+            if (streaming(state)) {
+                state->at_end = true;
+                return JANICE_MEDIA_AT_END;
+            }
+            return JANICE_INVALID_MEDIA;
+        }
+
+        cv_frame = state->prefetched.front();
+        state->prefetched.pop_front();
+        ++state->next_frame;
+        state->prefetch_cv.notify_all();
+        lock.unlock();
+
+        if (state->next_frame == state->frame_count) {
+            state->at_end = true;
+        }
+
+        return JANICE_SUCCESS;
+    }
+
     // try to read a frame, could error out
-    if (!state->video.read(cv_frame)) 
-        return JANICE_INVALID_MEDIA;
+    std::lock_guard<std::mutex> decoder_lock(state->decoder_mutex);
+    if (!DecoderCache::instance().acquire(state))
+        return JANICE_OPEN_ERROR;
 
-    // convert the frame we got to the output type.
-    JaniceError ret = ocv_utils::cv_mat_to_janice_image(cv_frame, *image);
-    // could fail the conversion...
-    if (ret != JANICE_SUCCESS)
-        return ret;
+    position_decoder(state, state->next_frame);
+    if (!state->video.read(cv_frame)) {
+        state->decoder_frame = unknown_frame;
+        if (streaming(state)) {
+            state->at_end = true;
+            return JANICE_MEDIA_AT_END;
+        }
+        return JANICE_INVALID_MEDIA;
+    }
+    ++state->decoder_frame;
+    ++state->next_frame;
 
     // If we're at the last frame of the video, mark at_end so that 
     // subsequent reads end early with JANICE_MEDIA_AT_END
-    if (state->video.get(CV_CAP_PROP_POS_FRAMES) == state->video.get(CV_CAP_PROP_FRAME_COUNT)) {
+    if (state->next_frame == state->frame_count) {
         state->at_end = true;
     }
 
     return JANICE_SUCCESS;
 }
 
+JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    cv::Mat cv_frame;
+    JaniceError ret = read_next(it, cv_frame);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    // read_next always decodes into a new cv::Mat, so the pyramid can keep it
+    state->pyramid.offer(state->still ? 0 : state->next_frame - 1, cv_frame);
+
+    // convert the frame we got to the output type.
+    return ocv_utils::output_janice_image(cv_frame, *image, state->options.borrow_frames, state->format.get());
+}
+
+// read up to max_images frames into a single buffer
+JaniceError next_batch(JaniceMediaIterator* it, JaniceImage* images, uint32_t max_images, uint32_t* num_images)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (images == nullptr || num_images == nullptr)
+        return JANICE_BAD_ARGUMENT;
+
+    *num_images = 0;
+
+    std::vector<cv::Mat> cv_frames;
+    cv_frames.reserve(max_images);
+    while (cv_frames.size() < max_images) {
+        cv::Mat cv_frame;
+        JaniceError ret = read_next(it, cv_frame);
+        if (ret != JANICE_SUCCESS) {
+            // Return the frames we have, the error repeats on the next call
+            if (!cv_frames.empty())
+                break;
+            return ret;
+        }
+        cv_frames.push_back(cv_frame);
+    }
+
+    if (cv_frames.empty())
+        return JANICE_SUCCESS;
+
+    state->pyramid.offer(state->still ? 0 : state->next_frame - 1, cv_frames.back());
+
+    JaniceError ret = ocv_utils::output_janice_batch(cv_frames, images, state->format.get());
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    *num_images = cv_frames.size();
+    return JANICE_SUCCESS;
+}
+
 // seek to the specified frame number
 JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
 {
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
 
     if (!state->initialized) {
-        cv::Mat useless;
-        JaniceError rc = initialize_media_iterator(*it, useless);
-    	if (rc != JANICE_SUCCESS)
+        JaniceError rc = initialize_media_iterator(*it);
+        if (rc != JANICE_SUCCESS)
             return rc;
     }
     
     // Image - return INVALID_MEDIA
-    if (!state->video.isOpened()) {
+    if (state->still) {
       // taa: Allow seek to 0 even on images. It used to work, and there's no reason why it shouldn't now.
       if (frame != 0) {
         return JANICE_INVALID_MEDIA;
@@ -154,52 +549,155 @@ JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
       return JANICE_SUCCESS;
     }
     
-    if (frame >= state->video.get(CV_CAP_PROP_FRAME_COUNT)) // invalid index
+    if (prefetching(state)) {
+        if (frame >= state->frame_count) // invalid index
+            return JANICE_OUT_OF_BOUNDS_ACCESS;
+
+        std::unique_lock<std::mutex> lock(state->prefetch_mutex);
+
+        // Seeking forward into frames that are already decoded just drops the
+        // ones we skip over, the worker keeps running
+        if (state->prefetch_thread.joinable() &&
+                frame >= state->next_frame &&
+                frame < state->next_frame + state->prefetched.size()) {
+            state->prefetched.erase(state->prefetched.begin(),
+                                    state->prefetched.begin() + (frame - state->next_frame));
+            state->next_frame = frame;
+            state->at_end = false;
+            state->prefetch_cv.notify_all();
+
+            return JANICE_SUCCESS;
+        }
+
+        lock.unlock();
+        stop_prefetch(state);
+    }
+
+    if (frame >= state->frame_count) // invalid index
         return JANICE_OUT_OF_BOUNDS_ACCESS;
 
-    // Set the video to the desired frame
-    state->video.set(CV_CAP_PROP_POS_FRAMES, frame);
+    if (!state->keyframes_loaded) {
+        load_keyframe_index(state);
+    }
+
+    // The capture is moved to the desired frame when it is next read
+    state->next_frame = frame;
     state->at_end = false;
 
     return JANICE_SUCCESS;
 }
 
-// get the specified frame. This is a stateless operation so it resets the
-// frame position after the get.
-JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
+// decode the specified frame. This is a stateless operation, the position
+// returned by tell is unchanged.
+static JaniceError read_frame(JaniceMediaIterator* it, uint32_t frame, cv::Mat& cv_frame)
 {
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
 
     if (!state->initialized) {
-        cv::Mat useless;
-        JaniceError rc = initialize_media_iterator(*it, useless);
+        JaniceError rc = initialize_media_iterator(*it);
         if (rc != JANICE_SUCCESS)
             return rc;
     }
 
-    uint32_t curr_frame = 0;
     // Image - return INVALID_MEDIA
-    if (!state->video.isOpened()) {
-      if (frame != 0) {
-        return JANICE_INVALID_MEDIA;
-      }
+    if (state->still) {
+        if (frame != 0) {
+            return JANICE_INVALID_MEDIA;
+        }
+
+        return read_still(state, cv_frame);
     }
-    else {
-      curr_frame = (uint32_t) state->video.get(CV_CAP_PROP_POS_FRAMES);
+
+    if (frame >= state->frame_count) // invalid index
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+
+    if (prefetching(state)) {
+        // Serve the frame from the decode-ahead queue if we have it
+        std::unique_lock<std::mutex> lock(state->prefetch_mutex);
+        if (frame >= state->next_frame && frame < state->next_frame + state->prefetched.size()) {
+            cv_frame = state->prefetched[frame - state->next_frame];
+            return JANICE_SUCCESS;
+        }
+
+        // Otherwise flush the queue and read the frame directly. The queue is
+        // restarted from next_frame on the next call to next().
+        lock.unlock();
+        stop_prefetch(state);
     }
 
-    // First we seek
-    JaniceError ret = seek(it, frame);
-    if (ret != JANICE_SUCCESS) {
-        return ret; // This leaves the iterator in an undefined state
+    if (!state->keyframes_loaded) {
+        load_keyframe_index(state);
     }
-    // Then we get the frame
-    ret = next(it, image);
-    if (ret != JANICE_SUCCESS) {
-        return ret; // This leaves the iterator in an undefined state
+
+    // Decode the frame without touching next_frame. The capture is moved back
+    // lazily, and only if the following read needs it.
+    std::lock_guard<std::mutex> decoder_lock(state->decoder_mutex);
+    if (!DecoderCache::instance().acquire(state))
+        return JANICE_OPEN_ERROR;
+
+    position_decoder(state, frame);
+    if (!state->video.read(cv_frame)) {
+        state->decoder_frame = unknown_frame;
+        return JANICE_INVALID_MEDIA;
     }
-    // Then we reset the position
-    return seek(it, curr_frame);
+    ++state->decoder_frame;
+
+    return JANICE_SUCCESS;
+}
+
+// get the specified frame
+JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    cv::Mat cv_frame;
+    JaniceError ret = read_frame(it, frame, cv_frame);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    return ocv_utils::output_janice_image(cv_frame, *image, state->options.borrow_frames, state->format.get());
+}
+
+// get a region of the specified frame. Only the region is copied.
+JaniceError get_roi(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, const JaniceRect* rect)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (rect == nullptr)
+        return JANICE_BAD_ARGUMENT;
+
+    cv::Mat cv_frame;
+    JaniceError ret = read_frame(it, frame, cv_frame);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    cv::Mat cv_roi;
+    ret = ocv_utils::crop(cv_frame, *rect, cv_roi);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    return ocv_utils::output_janice_image(cv_roi, *image, state->options.borrow_frames, state->format.get());
+}
+
+// get a level of the pyramid of the specified frame. The frame last returned
+// by next is kept once a pyramid has been asked for, so it isn't decoded again.
+JaniceError get_pyramid(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, uint32_t level)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (image == nullptr)
+        return JANICE_BAD_ARGUMENT;
+
+    if (!state->pyramid.has(frame)) {
+        cv::Mat cv_frame;
+        JaniceError ret = read_frame(it, frame, cv_frame);
+        if (ret != JANICE_SUCCESS)
+            return ret;
+
+        state->pyramid.set(frame, cv_frame);
+    }
+
+    return ocv_utils::output_pyramid_level(state->pyramid, level, *image, state->options.borrow_frames);
 }
 
 // say what frame we are currently on.
@@ -208,16 +706,16 @@ JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
 
     if (!state->initialized) {
-        cv::Mat useless;
-        JaniceError rc = initialize_media_iterator(*it, useless);
-    	if (rc != JANICE_SUCCESS)
-	      return rc;
+        JaniceError rc = initialize_media_iterator(*it);
+        if (rc != JANICE_SUCCESS)
+            return rc;
     }
     
-    if (!state->video.isOpened()) // image, getting fnum is not supported
+    if (state->still) // image, getting fnum is not supported
         return JANICE_INVALID_MEDIA;
 
-    *frame = (uint32_t) state->video.get(CV_CAP_PROP_POS_FRAMES);
+    std::lock_guard<std::mutex> lock(state->prefetch_mutex);
+    *frame = state->next_frame;
     return JANICE_SUCCESS;
 }
 
@@ -233,14 +731,16 @@ JaniceError physical_frame(JaniceMediaIterator*, uint32_t logical, uint32_t *phy
     return JANICE_SUCCESS;
 }
 
-JaniceError free_image(JaniceImage* image)
+// convert the frames we return to format from now on
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
 {
-    if (image && image->owner) {
-        free(image->data);
-        image->data = nullptr;
-    }
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->format.set(format);
+}
 
-    return JANICE_SUCCESS;
+JaniceError free_image(JaniceImage* image)
+{
+    return ocv_utils::free_janice_image(image);
 }
 
 JaniceError free_iterator(JaniceMediaIterator* it)
@@ -261,7 +761,7 @@ JaniceError reset(JaniceMediaIterator* it)
         return JANICE_SUCCESS;
     }
 
-    if (!state->video.isOpened()) {
+    if (state->still) {
         state->at_end = false; // Reload the image next time
         return JANICE_SUCCESS;
     }
@@ -274,17 +774,66 @@ JaniceError reset(JaniceMediaIterator* it)
 // ----------------------------------------------------------------------------
 // OpenCV I/O only, create an opencv_io media iterator 
 
+JaniceError janice_io_opencv_init_default_options(JaniceIOOpenCVOptions* options)
+{
+    if (options == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    options->borrow_frames = false;
+    options->prefetch_frames = 0;
+    options->prefetch_memory_limit = 0;
+    options->keyframe_index = nullptr;
+    options->keyframe_interval = 0;
+    options->decode_scale = 1;
+    options->cache_stills = false;
+    options->streaming = false;
+    options->decode_segments = 0;
+    options->segments_out_of_order = false;
+    options->read_mode = JaniceIOOpenCVReadImread;
+    options->build_keyframe_index = false;
+    options->save_keyframe_index = false;
+
+    return JANICE_SUCCESS;
+}
+
 JaniceError janice_io_opencv_create_media_iterator(const char* filename, JaniceMediaIterator* it)
 {
+    JaniceIOOpenCVOptions options;
+    janice_io_opencv_init_default_options(&options);
+
+    return janice_io_opencv_create_media_iterator_with_options(filename, &options, it);
+}
+
+JaniceError janice_io_opencv_create_media_iterator_with_options(const char* filename,
+                                                                const JaniceIOOpenCVOptions* options,
+                                                                JaniceMediaIterator* it)
+{
+    if (options == nullptr || !ocv_utils::valid_decode_scale(options->decode_scale)) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    if (options->decode_segments > 1 && !options->streaming) {
+        JaniceError ret = ocv_utils::create_segmented_media_iterator(filename, *options, it);
+        if (ret != JANICE_INVALID_MEDIA) {
+            return ret;
+        }
+        // Stills and streams are read with a single decoder
+    }
+
     it->is_video = &is_video;
     it->get_frame_rate =  &get_frame_rate;
     it->get_physical_frame_rate =  &get_physical_frame_rate;
 
     it->next = &next;
+    it->next_batch = &next_batch;
     it->seek = &seek;
     it->get  = &get;
+    it->get_roi = &get_roi;
     it->tell = &tell;
     it->physical_frame = &physical_frame;
+    it->set_format = &set_format;
+    it->get_pyramid = &get_pyramid;
 
     it->free_image = &free_image;
     it->free       = &free_iterator;
@@ -293,10 +842,68 @@ JaniceError janice_io_opencv_create_media_iterator(const char* filename, JaniceM
 
     JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
     state->initialized = false;
+    state->still = false;
     state->filename = filename;
+    state->options = *options;
     state->at_end = false;
+    state->next_frame = 0;
+    state->frame_count = 0;
+    state->frame_rate = 0;
+    state->decoder_frame = 0;
+    state->decoder_cached = false;
+    state->decoder_pinned = false;
+    state->keyframe_index = options->keyframe_index ? options->keyframe_index : "";
+    state->keyframes_loaded = false;
+    state->prefetch_stop = false;
+    state->prefetch_done = false;
 
     it->_internal = (void*) (state);
 
     return JANICE_SUCCESS;
 }
+
+JaniceError janice_io_opencv_get_decode_scale(JaniceMediaIterator* it, uint32_t* scale)
+{
+    if (it == nullptr || scale == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    if (ocv_utils::is_segmented_media_iterator(it)) {
+        *scale = 1; // always a video
+        return JANICE_SUCCESS;
+    }
+
+    if (it->free != &free_iterator) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (!state->initialized) {
+        JaniceError rc = initialize_media_iterator(*it);
+        if (rc != JANICE_SUCCESS)
+            return rc;
+    }
+
+    // Only stills are decoded at a reduced resolution
+    *scale = state->still ? state->options.decode_scale : 1;
+    return JANICE_SUCCESS;
+}
+
+// ----------------------------------------------------------------------------
+// Frame buffer pool statistics
+
+JaniceError janice_io_opencv_get_buffer_pool_stats(uint64_t* hits, uint64_t* misses, size_t* cached_bytes)
+{
+    io_utils::BufferPool::instance().stats(hits, misses, cached_bytes);
+    return JANICE_SUCCESS;
+}
+
+// ----------------------------------------------------------------------------
+// Open video limit
+
+JaniceError janice_io_opencv_set_max_open_decoders(uint32_t max_decoders)
+{
+    DecoderCache::instance().set_max_open(max_decoders);
+    return JANICE_SUCCESS;
+}
@@ -7,6 +7,128 @@
 extern "C" {
 #endif
 
+/*!
+ * \brief How opencv_io reads still images from disk before decoding them.
+ */
+enum JaniceIOOpenCVReadMode
+{
+    JaniceIOOpenCVReadImread  = 0, // Let cv::imread open and read the file
+    JaniceIOOpenCVReadMapped  = 1, // Memory-map the file and decode from the mapping
+    JaniceIOOpenCVReadWhole   = 2, // Read the file with one large pread and decode from the buffer
+    JaniceIOOpenCVReadBatched = 3 // Like JaniceIOOpenCVReadWhole, sparse iterators read queued files in batches
+};
+
+/*!
+ * \brief Options controlling how an opencv_io media iterator decodes and returns
+ *        frames. Initialize with janice_io_opencv_init_default_options before
+ *        changing individual fields.
+ */
+struct JaniceIOOpenCVOptions
+{
+    // Return frames that borrow the decoded pixel buffer instead of copying it.
+    // Borrowed images have owner == false and remain valid until they are passed
+    // to free_image, which must still be called for every frame. Frames returned
+    // by next_batch are always copied so the batch stays contiguous, and frames
+    // converted to a format requested with set_format are always new buffers.
+    bool borrow_frames;
+
+    // Decode up to this many frames ahead of the current position so next()
+    // only has to wait when decoding falls behind. Videos are decoded on a
+    // background thread per iterator, sparse iterators decode files in parallel
+    // on a thread pool shared by all iterators. seek, get and reset flush
+    // decoded frames as needed. 0 decodes synchronously in next().
+    uint32_t prefetch_frames;
+
+    // Maximum number of bytes of decoded images a sparse or segmented iterator
+    // keeps ahead of its position. A segmented iterator may go over it by a
+    // frame per decoder. 0 means no limit besides prefetch_frames.
+    size_t prefetch_memory_limit;
+
+    // Path to a keyframe index for the video, a text file with the frame number
+    // of each keyframe on its own line. It is read on the first random access
+    // (seek or get) and lets the iterator decode forward instead of seeking when
+    // no keyframe lies between the current position and the requested frame.
+    // If NULL, "<filename>.keyframes" is used when it exists. Without an index
+    // file, one is only built with build_keyframe_index.
+    const char* keyframe_index;
+
+    // Keyframe spacing to assume for videos without an index. 0 assumes one
+    // keyframe per second of video.
+    uint32_t keyframe_interval;
+
+    // Decode still images at 1/decode_scale of their resolution. Must be 1, 2, 4
+    // or 8. JPEGs are decoded directly at the reduced size, which is much cheaper
+    // than a full decode, other formats are resized after decoding. Reduced
+    // stills are always decoded as color images. Multiply coordinates found in
+    // the returned frames by janice_io_opencv_get_decode_scale to map them
+    // back to the full-resolution image. Videos are unaffected.
+    uint32_t decode_scale;
+
+    // Keep a still image decoded for the lifetime of the iterator instead of
+    // decoding it again after each reset or seek. Combined with borrow_frames,
+    // repeated reads of a still are free.
+    bool cache_stills;
+
+    // Treat a video as a stream of unknown length, like a named pipe or a file
+    // that is still being written. The frame count reported by the container is
+    // ignored, seek and get aren't bounds checked and next returns
+    // JANICE_MEDIA_AT_END once a frame fails to decode. Videos that don't
+    // report a frame count are always read this way.
+    bool streaming;
+
+    // Split a video into keyframe-aligned segments and decode this many at
+    // once, each with its own decoder, to use more than one core on long
+    // videos. Segments about one keyframe interval long are handed to the
+    // decoders in order and up to decode_segments of them are decoded ahead of
+    // the current position, each holding up to prefetch_frames frames (a
+    // keyframe interval if 0), so this trades memory for throughput. A
+    // keyframe index (see keyframe_index) keeps segment boundaries on true
+    // keyframes, otherwise each decoder may decode from the keyframe before its
+    // segment. These decoders don't count towards
+    // janice_io_opencv_set_max_open_decoders. 0 or 1 decodes the video with a
+    // single decoder. Stills and streams are unaffected.
+    uint32_t decode_segments;
+
+    // With decode_segments, split the video into decode_segments long segments
+    // decoded from start to end and return frames as soon as any decoder has
+    // one, instead of in video order. Each decoder keeps up to prefetch_frames
+    // frames (4 if 0) ahead. physical_frame maps the frames returned by next,
+    // numbered in the order they were returned, to their frames in the video.
+    // seek only supports frame 0.
+    bool segments_out_of_order;
+
+    // How still images are read before they are decoded. cv::imread reads
+    // files in small buffered chunks, which costs a round trip per chunk on
+    // network file systems. The other modes read the whole file at once with
+    // sequential read-ahead and decode it with cv::imdecode. Sparse iterators
+    // also ask the kernel to start reading the files queued by
+    // prefetch_frames. With JaniceIOOpenCVReadBatched, the files a sparse
+    // iterator queues with prefetch_frames are read in one batch, through
+    // io_uring on Linux where the kernel allows it and with pread on the
+    // shared thread pool otherwise, and each is decoded as soon as its bytes
+    // are in memory. Only supported on POSIX systems, elsewhere and for files
+    // over 2GB cv::imread is used. Videos are unaffected.
+    JaniceIOOpenCVReadMode read_mode;
+
+    // Build the keyframe index of a video that has no index file by reading
+    // all of its packets, without decoding them, on the first random access,
+    // or when a segmented iterator is created. This needs the FFmpeg backend
+    // of OpenCV 4.7 or later. Elsewhere, or if the scan fails, keyframes are
+    // assumed every keyframe_interval frames. With save_keyframe_index the
+    // index is written to the keyframe_index path, so later runs read it
+    // instead. Failing to write it is not an error.
+    bool build_keyframe_index;
+    bool save_keyframe_index;
+};
+
+/*!
+ * \brief Initialize a JaniceIOOpenCVOptions struct with the default options.
+ *        These match the behavior of janice_io_opencv_create_media_iterator.
+ * \param options A pointer to the options to initialize.
+ * \returns JANICE_SUCCESS on success, JANICE_BAD_ARGUMENT if options is NULL.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_init_default_options(JaniceIOOpenCVOptions* options);
+
 /*!
  * \brief Create a JaniceMediaIterator from a file on disk
  * \param filename A null-terminated path to an image or video or disk. The file must be readable.
@@ -18,15 +140,41 @@ extern "C" {
 JANICE_EXPORT JaniceError janice_io_opencv_create_media_iterator(const char* filename,
                                                                  JaniceMediaIterator* it);
 
+/*!
+ * \brief Create a JaniceMediaIterator from a file on disk with non-default options
+ * \param filename A null-terminated path to an image or video or disk. The file must be readable.
+ * \param options Options controlling decoding. The options are copied into the iterator.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *      error code.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_create_media_iterator_with_options(const char* filename,
+                                                                              const JaniceIOOpenCVOptions* options,
+                                                                              JaniceMediaIterator* it);
+
+/*!
+ * \brief Get the factor by which the frames of an opencv_io iterator were
+ *        downscaled during decoding. Coordinates in the returned frames multiplied
+ *        by this factor give coordinates in the original media.
+ * \param it An iterator created by janice_io_opencv_create_media_iterator_with_options.
+ * \param scale Set to the decode scale, 1 for videos and full-resolution stills.
+ * \returns JANICE_SUCCESS on success, JANICE_BAD_ARGUMENT if *it* was not created
+ *          by opencv_io, or an error opening the media.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_get_decode_scale(JaniceMediaIterator* it,
+                                                            uint32_t* scale);
+
 /*!
  * \brief Create a sparse iterator over a selection of video frames.
  *
  * This creates a single media iterator over a collection of image files on disk. Typically,
  * the images would have been extracted from a single video, for example as key frames.
+ * Files are iterated in the order given and physical_frame returns the logical
+ * frame unchanged. To keep track of the frames the images came from use
+ * janice_io_opencv_create_sparse_media_iterator_with_frames.
  * \param filenames An array of null-terminated filenames. Each file must be readable.
- * \param frames An array of frame numbers associated with the given images. The images
- *        will be stored in the iterator in increasing frame order.
- * \param num_files The number of elements in *filenames* and *frames*.
+ * \param num_files The number of elements in *filenames*.
  * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
  *        this function.
  * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
@@ -36,6 +184,224 @@ JANICE_EXPORT JaniceError janice_io_opencv_create_sparse_media_iterator(const ch
                                                                         size_t num_files,
                                                                         JaniceMediaIterator* it);
 
+/*!
+ * \brief Create a sparse iterator over a selection of video frames with non-default options.
+ *        See janice_io_opencv_create_sparse_media_iterator.
+ * \param filenames An array of null-terminated filenames. Each file must be readable.
+ * \param num_files The number of elements in *filenames*.
+ * \param options Options controlling decoding. The options are copied into the iterator.
+ *        The video-only keyframe, segment and still caching options are ignored.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *          an error code.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_create_sparse_media_iterator_with_options(const char** filenames,
+                                                                                     size_t num_files,
+                                                                                     const JaniceIOOpenCVOptions* options,
+                                                                                     JaniceMediaIterator* it);
+
+/*!
+ * \brief Create a sparse iterator over images extracted from known frames of a
+ *        video, for example its keyframes.
+ *
+ * The images are stored in the iterator in increasing frame order. Logical
+ * frames, as used by seek, get and tell, are positions in that order, and
+ * physical_frame maps them back to the given frame numbers so results can be
+ * related to the original video.
+ * \param filenames An array of null-terminated filenames. Each file must be readable.
+ * \param frames An array of frame numbers associated with the given images.
+ * \param num_files The number of elements in *filenames* and *frames*.
+ * \param options Options controlling decoding, or NULL to use the defaults. See
+ *        janice_io_opencv_create_sparse_media_iterator_with_options.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *          an error code.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_create_sparse_media_iterator_with_frames(const char** filenames,
+                                                                                    const uint32_t* frames,
+                                                                                    size_t num_files,
+                                                                                    const JaniceIOOpenCVOptions* options,
+                                                                                    JaniceMediaIterator* it);
+
+/*!
+ * \brief Find the image of a sparse iterator taken from a frame of the video,
+ *        the inverse of physical_frame.
+ *
+ * Returns the first image whose frame is at or after *frame*, found by binary
+ * search over the frame numbers. Compare its physical_frame with *frame* to
+ * tell whether the frame itself is in the iterator. Without frame numbers,
+ * logical and physical frames are the same.
+ * \param it An iterator created by one of the
+ *        janice_io_opencv_create_sparse_media_iterator functions.
+ * \param frame A frame of the video.
+ * \param logical Set to the logical frame, as used by seek, get and tell, of the
+ *        first image at or after *frame*.
+ * \returns JANICE_SUCCESS on success, JANICE_BAD_ARGUMENT if *it* is not a opencv
+ *          sparse iterator or JANICE_OUT_OF_BOUNDS_ACCESS if every image comes
+ *          before *frame*.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_sparse_find_frame(JaniceMediaIterator* it,
+                                                             uint32_t frame,
+                                                             uint32_t* logical);
+
+/*!
+ * \brief Create an iterator that presents a temporal subsample of another iterator.
+ *
+ * Logical frame i of the new iterator is frame i * stride of *base*, or with a
+ * target frame rate, the frame closest to time i / target_frame_rate. Frames in
+ * between are skipped with the wrapped iterator's seek, which for opencv_io videos
+ * grabs forward without converting the skipped frames. physical_frame maps
+ * logical frames back to frames of the source media and get_physical_frame_rate
+ * reports the frame rate of the source.
+ * \param base The iterator to subsample, positioned at its first frame. The new
+ *        iterator takes ownership of it, *base* must not be used or freed afterwards.
+ * \param stride Present every stride-th frame. If 0, target_frame_rate is used.
+ * \param target_frame_rate The frame rate to present when stride is 0. Requires
+ *        *base* to report its frame rate. Frames are never duplicated.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *          an error code.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_create_subsampled_media_iterator(JaniceMediaIterator* base,
+                                                                           uint32_t stride,
+                                                                           float target_frame_rate,
+                                                                           JaniceMediaIterator* it);
+
+/*!
+ * \brief Create an iterator that skips frames of another iterator in which
+ *        nothing moves, for video from a static camera.
+ *
+ * Each frame is downsampled to a small luma image and compared with the last
+ * frame presented. A frame is presented if at least *threshold* of its pixels
+ * changed noticeably, otherwise it is freed and the next frame is read. The
+ * first frame is always presented. physical_frame maps logical frames to the
+ * frames of the source media they came from. Which frames are presented is
+ * only known once they have been read, so seek and get past the last frame
+ * read must read up to it, and get_frame_rate returns JANICE_INVALID_MEDIA.
+ * \param base The iterator to gate, positioned at its first frame. The new
+ *        iterator takes ownership of it, *base* must not be used or freed afterwards.
+ * \param threshold The fraction of the frame, between 0 and 1, that must change
+ *        for a frame to be presented. 0 presents every frame.
+ * \param max_skip Present a frame after this many consecutive frames were skipped
+ *        even if nothing moved. 0 means no limit.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *          an error code.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_create_motion_gated_media_iterator(JaniceMediaIterator* base,
+                                                                            float threshold,
+                                                                            uint32_t max_skip,
+                                                                            JaniceMediaIterator* it);
+
+/*!
+ * \brief Create an iterator that presents a large still, like a panorama, as
+ *        overlapping tiles.
+ *
+ * Tiles are returned in row-major order, each as its own frame, so no single
+ * image is larger than a tile. Neighboring tiles share *overlap* pixels, and
+ * the last tile in each row and column is moved back to end at the edge of the
+ * image so every tile has the full size, unless the image is smaller than a
+ * tile in that direction. Use janice_io_opencv_get_tile_offset to translate
+ * coordinates in a tile to coordinates in the still. The size of JPEG, PNG, BMP
+ * and TIFF stills is read from their header, so seek, tell and
+ * janice_io_opencv_get_tile_offset don't decode them. OpenCV can't decode part
+ * of an image, so next decodes the still on first use, copies tiles out of it
+ * as they are read and releases it once it has returned the last tile or the
+ * iterator is reset. get, get_roi and get_pyramid decode the still for each
+ * call unless next is in the middle of a pass. get_roi takes a region
+ * relative to the tile and physical_frame maps every tile to frame 0.
+ * \param filename A null-terminated path to a still image on disk. The file must be readable.
+ * \param tile_width The width of a tile in pixels.
+ * \param tile_height The height of a tile in pixels.
+ * \param overlap The number of pixels neighboring tiles share. Must be less
+ *        than tile_width and tile_height.
+ * \param it A pointer to an unallocated JaniceMediaIterator. The iterator is allocated by
+ *        this function.
+ * \returns JANICE_SUCCESS if the iterator is created successfully. Otherwise returns
+ *          an error code.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_create_tiled_media_iterator(const char* filename,
+                                                                       uint32_t tile_width,
+                                                                       uint32_t tile_height,
+                                                                       uint32_t overlap,
+                                                                       JaniceMediaIterator* it);
+
+/*!
+ * \brief Get the position of a tile in the still it was cut from. Adding it to
+ *        coordinates in the tile gives coordinates in the still.
+ * \param it An iterator created by janice_io_opencv_create_tiled_media_iterator.
+ * \param tile The logical frame of the tile, as from tell.
+ * \param x Set to the column of the tile's top left corner in the still.
+ * \param y Set to the row of the tile's top left corner in the still.
+ * \returns JANICE_SUCCESS on success, JANICE_BAD_ARGUMENT if *it* is not a tiled
+ *          iterator, JANICE_OUT_OF_BOUNDS_ACCESS if there is no such tile, or an
+ *          error decoding the still.
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_get_tile_offset(JaniceMediaIterator* it,
+                                                           uint32_t tile,
+                                                           uint32_t* x,
+                                                           uint32_t* y);
+
+/*!
+ * \brief Query the frame buffer pool shared by the opencv_io and memory_io
+ *        backends. Image buffers released with free_image are kept in the pool
+ *        and reused by later frames of a similar size, so images returned with
+ *        owner == true must be released with free_image and never passed to
+ *        free. free_image still frees owned images the caller allocated with
+ *        malloc.
+ * \param hits Set to the number of allocations served from the pool. May be NULL.
+ * \param misses Set to the number of allocations that required a new buffer. May be NULL.
+ * \param cached_bytes Set to the number of bytes currently held in the pool. May be NULL.
+ * \returns JANICE_SUCCESS
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_get_buffer_pool_stats(uint64_t* hits,
+                                                                 uint64_t* misses,
+                                                                 size_t* cached_bytes);
+
+/*!
+ * \brief Set the maximum number of videos opencv_io keeps open at once across
+ *        all iterators. When the limit is reached, the least recently used idle
+ *        video is closed and reopened at its position when its iterator is next
+ *        read. Videos that are decoding ahead or streaming are never closed, so
+ *        the limit can be exceeded while they are in use. The default is 64.
+ * \param max_decoders The maximum number of open videos. 0 means no limit.
+ * \returns JANICE_SUCCESS
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_set_max_open_decoders(uint32_t max_decoders);
+
+/*!
+ * \brief Set the memory opencv_io may use to keep decoded stills across all
+ *        iterators. While the cache is enabled, a still that is read again,
+ *        by the same iterator or by any other, is returned from the cache
+ *        instead of being decoded again, as long as it was decoded with the
+ *        same decode_scale. Iterators reading the same file at the same time
+ *        wait for a single decode. When the cache is full the least recently
+ *        used stills are dropped. Images returned by iterators keep their
+ *        pixels alive until freed, so memory use can briefly exceed the cap.
+ *        Stills larger than the cap are never kept. Tiled iterators and
+ *        videos are unaffected. The default is 0.
+ * \param max_bytes The maximum size of the decoded stills to keep, in bytes.
+ *                  0 disables the cache and drops everything in it.
+ * \returns JANICE_SUCCESS
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_set_still_cache_size(size_t max_bytes);
+
+/*!
+ * \brief Get statistics for the shared cache of decoded stills, see
+ *        janice_io_opencv_set_still_cache_size.
+ * \param hits Set to the number of reads served from the cache. May be NULL.
+ * \param misses Set to the number of reads that decoded the still. May be NULL.
+ * \param cached_bytes Set to the size of the stills currently cached. May be NULL.
+ * \returns JANICE_SUCCESS
+ */
+JANICE_EXPORT JaniceError janice_io_opencv_get_still_cache_stats(uint64_t* hits,
+                                                                 uint64_t* misses,
+                                                                 size_t* cached_bytes);
+
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,380 @@
+#include <janice_io_opencv.h>
+#include <janice_io_opencv_utils.hpp>
+
+#include <opencv2/imgcodecs.hpp>
+
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <condition_variable>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace
+{
+
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+
+// Closes a file descriptor when it goes out of scope
+struct FileDescriptor
+{
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    ~FileDescriptor() { if (fd >= 0) close(fd); }
+
+    int fd;
+};
+
+// Unmaps a file mapping when it goes out of scope
+struct Mapping
+{
+    Mapping(void* data, size_t length) : data(data), length(length) {}
+    ~Mapping() { if (data != MAP_FAILED) munmap(data, length); }
+
+    void* data;
+    size_t length;
+};
+
+// Returns a buffer to the pool when it goes out of scope
+struct PoolBuffer
+{
+    explicit PoolBuffer(size_t length) : data(io_utils::BufferPool::instance().acquire(length)) {}
+    ~PoolBuffer() { if (data) io_utils::BufferPool::instance().release(data); }
+
+    uint8_t* data;
+};
+
+#endif // JANICE_IO_OPENCV_WITH_POSIX
+
+static cv::Mat decode(const void* data, size_t length, int flags)
+{
+    return cv::imdecode(cv::Mat(1, (int) length, CV_8U, (void*) data), flags);
+}
+
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+
+// Decode straight from a private read-only mapping of the file. The decoder
+// reads the mapping front to back, so ask the kernel to read ahead
+// aggressively and to start right away. Returns false if the file can't be
+// mapped.
+static bool read_mapped(int fd, size_t length, int flags, cv::Mat& image)
+{
+    Mapping mapping(mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0), length);
+    if (mapping.data == MAP_FAILED) {
+        return false;
+    }
+
+    madvise(mapping.data, length, MADV_SEQUENTIAL);
+    madvise(mapping.data, length, MADV_WILLNEED);
+
+    image = decode(mapping.data, length, flags);
+    return true;
+}
+
+// Read the whole file with as few preads as the file system allows, then
+// decode the buffer. Returns false if the file can't be read.
+static bool read_whole(int fd, size_t length, int flags, cv::Mat& image)
+{
+    PoolBuffer buffer(length);
+    if (buffer.data == nullptr) {
+        return false;
+    }
+
+    posix_fadvise(fd, 0, length, POSIX_FADV_SEQUENTIAL);
+
+    size_t done = 0;
+    while (done < length) {
+        const ssize_t count = pread(fd, buffer.data + done, length - done, done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return false;
+        }
+        done += count;
+    }
+
+    image = decode(buffer.data, length, flags);
+    return true;
+}
+
+#endif // JANICE_IO_OPENCV_WITH_POSIX
+
+// A process-wide cache of decoded stills, keyed by path and decode flags, so
+// media lists that name the same file many times decode it once. Images are
+// shared by reference, nothing writes to a decoded still after it is
+// returned. Stills are kept in least recently used order and the oldest are
+// dropped once the cache is over its cap.
+class StillCache
+{
+public:
+    static StillCache& instance()
+    {
+        static StillCache cache;
+        return cache;
+    }
+
+    void set_max_bytes(size_t max)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_bytes = max;
+        evict();
+    }
+
+    bool enabled()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return max_bytes != 0;
+    }
+
+    void stats(uint64_t* num_hits, uint64_t* num_misses, size_t* num_cached_bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (num_hits)         *num_hits = hits;
+        if (num_misses)       *num_misses = misses;
+        if (num_cached_bytes) *num_cached_bytes = cached_bytes;
+    }
+
+    // Get a cached still. Waits if another thread is decoding it.
+    bool find(const std::string& filename, int flags, cv::Mat& image)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        const Key key(filename, flags);
+
+        auto entry = entries.find(key);
+        while (entry != entries.end() && entry->second.decoding) {
+            decoded.wait(lock);
+            entry = entries.find(key);
+        }
+
+        if (entry == entries.end()) {
+            return false;
+        }
+
+        lru.splice(lru.begin(), lru, entry->second.position);
+        image = entry->second.image;
+        ++hits;
+        return true;
+    }
+
+    // Get a still from the cache, or call decode and cache the result. Only
+    // one thread decodes a still at a time, the rest wait for it.
+    template <typename Decode>
+    cv::Mat get(const std::string& filename, int flags, Decode decode)
+    {
+        const Key key(filename, flags);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                auto entry = entries.find(key);
+                if (entry == entries.end()) {
+                    break;
+                }
+
+                if (!entry->second.decoding) {
+                    lru.splice(lru.begin(), lru, entry->second.position);
+                    ++hits;
+                    return entry->second.image;
+                }
+                decoded.wait(lock);
+            }
+
+            if (max_bytes == 0) {
+                ++misses;
+                lock.unlock();
+                return decode();
+            }
+
+            // Claim the decode, others wait for it
+            Entry& entry = entries[key];
+            entry.decoding = true;
+            entry.position = lru.end();
+        }
+
+        cv::Mat image;
+        try {
+            image = decode();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.erase(key);
+            decoded.notify_all();
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        ++misses;
+        entries.erase(key);
+        insert(key, image); // failures aren't cached, waiters try again
+        decoded.notify_all();
+
+        return image;
+    }
+
+private:
+    typedef std::pair<std::string, int> Key;
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<std::string>()(key.first) ^ std::hash<int>()(key.second);
+        }
+    };
+
+    struct Entry
+    {
+        bool decoding;
+        cv::Mat image;
+        std::list<Key>::iterator position; // in lru, once decoded
+    };
+
+    StillCache() : max_bytes(0), cached_bytes(0), hits(0), misses(0) {}
+
+    static size_t size(const cv::Mat& image)
+    {
+        return image.total() * image.elemSize();
+    }
+
+    // Keep a decoded still as the most recently used. Empty images and
+    // images that don't fit are skipped. mutex must be held.
+    void insert(const Key& key, const cv::Mat& image)
+    {
+        if (!image.data || size(image) > max_bytes) {
+            return;
+        }
+
+        Entry& entry = entries[key];
+        entry.decoding = false;
+        entry.image = image;
+        entry.position = lru.insert(lru.begin(), key);
+        cached_bytes += size(image);
+        evict();
+    }
+
+    // Drop the least recently used stills until we're under the cap. mutex
+    // must be held.
+    void evict()
+    {
+        while (!lru.empty() && cached_bytes > max_bytes) {
+            auto entry = entries.find(lru.back());
+            cached_bytes -= size(entry->second.image);
+            entries.erase(entry);
+            lru.pop_back();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable decoded;
+    std::unordered_map<Key, Entry, KeyHash> entries;
+    std::list<Key> lru; // decoded stills, most recently used first
+    size_t max_bytes;
+    size_t cached_bytes;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// Read through fd if it is open, otherwise open filename
+static cv::Mat read_uncached(const std::string& filename, int flags, JaniceIOOpenCVReadMode mode, int fd)
+{
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+    // Batched reads only differ for files queued by a sparse iterator
+    if (mode == JaniceIOOpenCVReadBatched) {
+        mode = JaniceIOOpenCVReadWhole;
+    }
+
+    if (mode == JaniceIOOpenCVReadMapped || mode == JaniceIOOpenCVReadWhole) {
+        FileDescriptor opened(fd < 0 ? open(filename.c_str(), O_RDONLY | O_CLOEXEC) : -1);
+        if (fd < 0) {
+            fd = opened.fd;
+        }
+        if (fd < 0) {
+            return cv::Mat(); // like imread, a file we can't open gives an empty image
+        }
+
+        // imdecode takes the length as an int, larger files go through imread
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0 &&
+                info.st_size <= std::numeric_limits<int>::max()) {
+            cv::Mat image;
+            const bool read = mode == JaniceIOOpenCVReadMapped ? read_mapped(fd, info.st_size, flags, image)
+                                                               : read_whole(fd, info.st_size, flags, image);
+            if (read) {
+                return image;
+            }
+        }
+    }
+#else
+    (void) mode;
+    (void) fd;
+#endif
+
+    return cv::imread(filename, flags);
+}
+
+} // anonymous namespace
+
+cv::Mat ocv_utils::read_still_image(const std::string& filename, int flags, JaniceIOOpenCVReadMode mode, int fd)
+{
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+    FileDescriptor file(fd); // closed even if the still comes from the cache
+#endif
+
+    return StillCache::instance().get(filename, flags, [&]() { return read_uncached(filename, flags, mode, fd); });
+}
+
+bool ocv_utils::find_cached_still(const std::string& filename, int flags, cv::Mat& image)
+{
+    StillCache& cache = StillCache::instance();
+    return cache.enabled() && cache.find(filename, flags, image);
+}
+
+cv::Mat ocv_utils::decode_still_image(const std::string& filename, int flags, const std::vector<uint8_t>& data)
+{
+    if (data.empty() || data.size() > (size_t) std::numeric_limits<int>::max()) {
+        return cv::Mat();
+    }
+
+    return StillCache::instance().get(filename, flags, [&]() { return decode(data.data(), data.size(), flags); });
+}
+
+int ocv_utils::open_still_image(const std::string& filename, JaniceIOOpenCVReadMode mode)
+{
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+    // Batched reads are already on their way
+    if (mode != JaniceIOOpenCVReadMapped && mode != JaniceIOOpenCVReadWhole) {
+        return -1;
+    }
+
+    // Start reading the file into the page cache while it waits its turn
+    const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+    return fd;
+#else
+    (void) filename;
+    (void) mode;
+    return -1;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Still cache
+
+JaniceError janice_io_opencv_set_still_cache_size(size_t max_bytes)
+{
+    StillCache::instance().set_max_bytes(max_bytes);
+    return JANICE_SUCCESS;
+}
+
+JaniceError janice_io_opencv_get_still_cache_stats(uint64_t* hits, uint64_t* misses, size_t* cached_bytes)
+{
+    StillCache::instance().stats(hits, misses, cached_bytes);
+    return JANICE_SUCCESS;
+}
@@ -0,0 +1,327 @@
+#include <janice_io.h>
+#include <janice_io_opencv.h>
+#include <janice_io_format_opencv.hpp>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+
+// ----------------------------------------------------------------------------
+// JaniceMediaIterator
+
+// Frames are compared at this width, which is plenty to see a person move
+// while keeping the comparison far cheaper than decoding
+static const int thumbnail_width = 64;
+
+// A thumbnail pixel has changed if its luma moved by more than this, which
+// ignores sensor noise and compression artifacts
+static const int pixel_threshold = 12;
+
+// Presents only the frames of another iterator that differ enough from the
+// last frame presented. Logical frame i is base frame base_frames[i].
+struct JaniceMediaIteratorStateType
+{
+    JaniceMediaIterator base;
+    float threshold;    // fraction of thumbnail pixels that must change
+    uint32_t max_skip;  // present a frame after this many skipped, 0 for no limit
+
+    uint32_t pos;
+    uint32_t base_pos;  // frame the wrapped iterator's next() returns
+    uint32_t skipped;   // frames skipped since the last one presented
+    std::vector<uint32_t> base_frames;
+    cv::Mat reference;  // luma thumbnail of the last frame presented
+
+    // Layout of the frames the wrapped iterator returns, as last set with
+    // set_format. Frames are compared in whatever format they arrive in.
+    bool float_pixels;
+    bool planar;
+};
+
+// Downsample a frame to a small luma image. resize and cvtColor both use
+// OpenCV's vectorized kernels. Planar frames are compared on their first
+// plane.
+static void thumbnail(const JaniceImage& image, bool planar, cv::Mat& thumb)
+{
+    const cv::Mat frame = planar ? cv::Mat(image.rows, image.cols, CV_8UC1, image.data)
+                                 : io_utils::janice_image_to_cv_mat(image);
+    const int height = std::max(1, (int) (image.rows * thumbnail_width / std::max(1u, image.cols)));
+
+    cv::Mat small;
+    cv::resize(frame, small, cv::Size(thumbnail_width, height), 0, 0, cv::INTER_AREA);
+
+    if (frame.channels() == 3) {
+        cv::cvtColor(small, thumb, cv::COLOR_BGR2GRAY);
+    } else if (frame.channels() == 4) {
+        cv::cvtColor(small, thumb, cv::COLOR_BGRA2GRAY);
+    } else {
+        cv::extractChannel(small, thumb, 0);
+    }
+}
+
+static bool has_motion(const JaniceMediaIteratorStateType* state, const cv::Mat& thumb)
+{
+    if (state->reference.size() != thumb.size()) {
+        return true;
+    }
+
+    cv::Mat diff;
+    cv::absdiff(thumb, state->reference, diff);
+
+    return cv::countNonZero(diff > pixel_threshold) >= state->threshold * diff.total();
+}
+
+JaniceError is_video(JaniceMediaIterator* it, bool* video)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->base.is_video(&state->base, video);
+}
+
+// Frames are presented at irregular intervals, so there is no frame rate
+JaniceError get_frame_rate(JaniceMediaIterator*, float*)
+{
+    return JANICE_INVALID_MEDIA;
+}
+
+JaniceError get_physical_frame_rate(JaniceMediaIterator* it, float* frame_rate)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->base.get_physical_frame_rate(&state->base, frame_rate);
+}
+
+// read frames from the wrapped iterator until one is presented
+static JaniceError read_next(JaniceMediaIteratorStateType* state, JaniceImage* image)
+{
+    while (true) {
+        JaniceError ret = state->base.next(&state->base, image);
+        if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+        const uint32_t base_frame = state->base_pos++;
+
+        // Frames without a usable layout, including floating point frames
+        // whose scale we don't know, are always presented
+        cv::Mat thumb;
+        if (!state->float_pixels && image->channels >= 1 && image->channels <= 4 && image->rows > 0 && image->cols > 0) {
+            thumbnail(*image, state->planar, thumb);
+        }
+
+        if (thumb.empty() || has_motion(state, thumb) ||
+                (state->max_skip != 0 && state->skipped >= state->max_skip)) {
+            state->reference = thumb;
+            state->skipped = 0;
+
+            state->base_frames.resize(state->pos);
+            state->base_frames.push_back(base_frame);
+            ++state->pos;
+
+            return JANICE_SUCCESS;
+        }
+
+        state->base.free_image(image);
+        ++state->skipped;
+    }
+}
+
+JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return read_next(state, image);
+}
+
+JaniceError reset(JaniceMediaIterator* it)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    state->pos = 0;
+    state->base_pos = 0;
+    state->skipped = 0;
+    state->base_frames.clear();
+    state->reference.release();
+
+    return state->base.reset(&state->base);
+}
+
+// Frames we have already presented are found directly. Which later frames
+// are presented is only known by reading up to them.
+JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (frame < state->base_frames.size()) {
+        JaniceError ret = state->base.seek(&state->base, state->base_frames[frame]);
+        if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+
+        // Gating starts over from the frame we land on, which is presented
+        state->pos = frame;
+        state->base_pos = state->base_frames[frame];
+        state->skipped = 0;
+        state->reference.release();
+
+        return JANICE_SUCCESS;
+    }
+
+    while (state->pos < frame) {
+        JaniceImage image;
+        JaniceError ret = read_next(state, &image);
+        if (ret == JANICE_MEDIA_AT_END) {
+            return JANICE_OUT_OF_BOUNDS_ACCESS;
+        } else if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+        state->base.free_image(&image);
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (frame >= state->base_frames.size()) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    return state->base.get(&state->base, image, state->base_frames[frame]);
+}
+
+JaniceError get_roi(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, const JaniceRect* rect)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (frame >= state->base_frames.size()) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    return state->base.get_roi(&state->base, image, state->base_frames[frame], rect);
+}
+
+// Pyramids are in the native format, so they come straight from the wrapped iterator
+JaniceError get_pyramid(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, uint32_t level)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (frame >= state->base_frames.size()) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    return state->base.get_pyramid(&state->base, image, state->base_frames[frame], level);
+}
+
+// Frames are formatted by the wrapped iterator, so its free_image releases them
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    JaniceError ret = state->base.set_format(&state->base, format);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    state->float_pixels = format != nullptr && format->pixel_type == JanicePixelFloat32;
+    state->planar = format != nullptr && format->planar;
+
+    // Thumbnails in the old layout can't be compared with the new one
+    state->reference.release();
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    // Defer to the wrapped iterator for stills and other media without a position
+    uint32_t base_frame;
+    JaniceError ret = state->base.tell(&state->base, &base_frame);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    *frame = state->pos;
+    return JANICE_SUCCESS;
+}
+
+// Map a logical frame number (as from tell) to the frame of the wrapped
+// iterator it came from, and then through whatever mapping that applies.
+JaniceError physical_frame(JaniceMediaIterator* it, uint32_t logical, uint32_t *physical)
+{
+    if (physical == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    if (logical >= state->base_frames.size()) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    return state->base.physical_frame(&state->base, state->base_frames[logical], physical);
+}
+
+JaniceError free_iterator(JaniceMediaIterator* it)
+{
+    if (it && it->_internal) {
+        JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+        state->base.free(&state->base);
+
+        delete state;
+        it->_internal = nullptr;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+// OpenCV I/O only, create a motion gated media iterator
+
+JaniceError janice_io_opencv_create_motion_gated_media_iterator(JaniceMediaIterator* base,
+                                                                float threshold,
+                                                                uint32_t max_skip,
+                                                                JaniceMediaIterator* it)
+{
+    if (base == nullptr || it == nullptr || threshold < 0 || threshold > 1) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    state->base = *base;
+    state->threshold = threshold;
+    state->max_skip = max_skip;
+    state->pos = 0;
+    state->base_pos = 0;
+    state->skipped = 0;
+    state->float_pixels = false;
+    state->planar = false;
+
+    it->is_video = &is_video;
+    it->get_frame_rate =  &get_frame_rate;
+    it->get_physical_frame_rate =  &get_physical_frame_rate;
+
+    it->next = &next;
+    it->next_batch = nullptr; // skipped frames would split a batch, use next
+    it->seek = &seek;
+    it->get  = &get;
+    it->get_roi = base->get_roi ? &get_roi : nullptr;
+    it->tell = &tell;
+    it->physical_frame = &physical_frame;
+    it->set_format = base->set_format ? &set_format : nullptr;
+    it->get_pyramid = base->get_pyramid ? &get_pyramid : nullptr;
+
+    // Images come from the wrapped iterator
+    it->free_image = base->free_image;
+    it->free       = &free_iterator;
+
+    it->reset      = &reset;
+
+    it->_internal = (void*) (state);
+
+    return JANICE_SUCCESS;
+}
@@ -0,0 +1,685 @@
+#include <janice_io_opencv.h>
+#include <janice_io_opencv_utils.hpp>
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// frames [start, end) of the video, decoded by one worker at a time
+struct Segment
+{
+    uint32_t start;
+    uint32_t end;
+    uint32_t next;              // frame number of frames.front()
+    std::deque<cv::Mat> frames; // decoded and not yet returned
+    bool done;                  // the worker has finished with the segment
+    bool failed;                // a frame failed to decode
+};
+
+// A video split into segments that are decoded concurrently by a pool of
+// workers, each with its own capture. Workers claim segments in order, at
+// most window segments past head, the first segment not yet fully returned.
+// In order, next() drains head before moving on. Out of order, it takes a
+// frame from any segment in the window and records where it came from.
+struct JaniceMediaIteratorStateType
+{
+    std::string filename;
+    JaniceIOOpenCVOptions options;
+    io_utils::OutputFormat format; // set with set_format
+    io_utils::FramePyramid pyramid; // of the last frame, see get_pyramid
+
+    uint32_t frame_count;
+    double frame_rate;
+    std::vector<uint32_t> keyframes;
+    uint32_t keyframe_interval;
+
+    std::vector<Segment> segments;
+    size_t window;      // segments decoded at once
+    size_t queue_limit; // decoded frames a segment holds ahead of next()
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;                  // guards everything below
+    std::condition_variable frame_cv;  // a frame was decoded or a segment finished
+    std::condition_variable worker_cv; // a frame was taken or head moved
+    size_t head;
+    size_t next_segment; // the next segment a worker claims
+    size_t queued_bytes; // decoded frames held by all segments, for prefetch_memory_limit
+    bool stop;
+
+    uint32_t pos;                          // frames returned since the last seek
+    std::vector<uint32_t> physical_frames; // out of order only, frame of each returned frame
+
+    // get and get_roi decode on their own capture so they don't disturb the workers
+    std::mutex random_mutex;
+    cv::VideoCapture random_video;
+    uint32_t random_frame;
+
+    ~JaniceMediaIteratorStateType();
+};
+
+static const uint32_t unknown_frame = std::numeric_limits<uint32_t>::max();
+
+static size_t frame_bytes(const cv::Mat& frame)
+{
+    return frame.total() * frame.elemSize();
+}
+
+// Whether segment may decode another frame. A segment with nothing queued may
+// always decode one, so the segment next() waits on can't be starved by the
+// others holding the memory limit. state->mutex must be held.
+static bool can_queue(const JaniceMediaIteratorStateType* state, const Segment& segment)
+{
+    if (segment.frames.empty()) {
+        return true;
+    }
+
+    if (segment.frames.size() >= state->queue_limit) {
+        return false;
+    }
+
+    const size_t limit = state->options.prefetch_memory_limit;
+    return limit == 0 || state->queued_bytes + frame_bytes(segment.frames.back()) <= limit;
+}
+
+static uint32_t keyframe_before(const JaniceMediaIteratorStateType* state, uint32_t frame)
+{
+    return ocv_utils::keyframe_before(state->keyframes, state->keyframe_interval, frame);
+}
+
+// Split the video into segments of about length frames that start on keyframes
+static void split(JaniceMediaIteratorStateType* state, uint32_t length)
+{
+    std::vector<uint32_t> starts(1, 0);
+    for (uint64_t frame = length; frame < state->frame_count; frame += length) {
+        const uint32_t keyframe = keyframe_before(state, (uint32_t) frame);
+        if (keyframe > starts.back()) {
+            starts.push_back(keyframe);
+        }
+    }
+    starts.push_back(state->frame_count);
+
+    state->segments.resize(starts.size() - 1);
+    for (size_t i = 0; i < state->segments.size(); ++i) {
+        state->segments[i].start = starts[i];
+        state->segments[i].end = starts[i + 1];
+    }
+}
+
+// the segment holding frame
+static size_t segment_of(const JaniceMediaIteratorStateType* state, uint32_t frame)
+{
+    auto segment = std::upper_bound(state->segments.begin(), state->segments.end(), frame,
+                                    [](uint32_t f, const Segment& s) { return f < s.start; });
+    return segment - state->segments.begin() - 1;
+}
+
+static void decode_worker(JaniceMediaIteratorStateType* state)
+{
+    cv::VideoCapture video;
+    uint32_t video_frame = unknown_frame;
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (true) {
+        state->worker_cv.wait(lock, [state]() {
+            return state->stop ||
+                   state->next_segment == state->segments.size() ||
+                   state->next_segment < state->head + state->window;
+        });
+
+        if (state->stop || state->next_segment == state->segments.size()) {
+            return;
+        }
+
+        Segment& segment = state->segments[state->next_segment++];
+        uint32_t frame = segment.next;
+
+        // Open and position the capture without holding the lock. Segments
+        // claimed back to back often continue where the last one ended.
+        lock.unlock();
+        if (!video.isOpened()) {
+            video.open(state->filename);
+        }
+        if (video.isOpened() && video_frame != frame) {
+            video.set(CV_CAP_PROP_POS_FRAMES, frame);
+            video_frame = frame;
+        }
+        lock.lock();
+
+        segment.failed = !video.isOpened();
+        while (!segment.failed && frame < segment.end) {
+            state->worker_cv.wait(lock, [&]() {
+                return state->stop || can_queue(state, segment);
+            });
+
+            if (state->stop) {
+                return;
+            }
+
+            lock.unlock();
+            cv::Mat decoded;
+            const bool ok = video.read(decoded);
+            lock.lock();
+
+            if (!ok) {
+                video_frame = unknown_frame;
+                segment.failed = true;
+                break;
+            }
+
+            segment.frames.push_back(decoded);
+            state->queued_bytes += frame_bytes(decoded);
+            ++frame;
+            ++video_frame;
+            state->frame_cv.notify_all();
+        }
+
+        segment.done = true;
+        state->frame_cv.notify_all();
+    }
+}
+
+static void stop_workers(JaniceMediaIteratorStateType* state)
+{
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->stop = true;
+    }
+    state->worker_cv.notify_all();
+
+    for (std::thread& worker : state->workers) {
+        worker.join();
+    }
+    state->workers.clear();
+    state->stop = false;
+}
+
+// Drop all decoded frames and start again from frame. The workers are started
+// by the next call to next().
+static void restart(JaniceMediaIteratorStateType* state, uint32_t frame)
+{
+    stop_workers(state);
+
+    for (Segment& segment : state->segments) {
+        segment.next = segment.start;
+        segment.frames.clear();
+        segment.done = false;
+        segment.failed = false;
+    }
+
+    state->head = state->segments.empty() ? 0 : segment_of(state, frame);
+    state->next_segment = state->head;
+    state->queued_bytes = 0;
+    if (state->head < state->segments.size()) {
+        state->segments[state->head].next = frame;
+    }
+
+    state->pos = frame;
+    state->physical_frames.clear();
+}
+
+JaniceMediaIteratorStateType::~JaniceMediaIteratorStateType()
+{
+    stop_workers(this);
+}
+
+// Take a frame that was already decoded, if there is one. Out of order we
+// take the first one ready in the window. state->mutex must be held.
+static bool take_frame(JaniceMediaIteratorStateType* state, cv::Mat& frame, uint32_t& physical)
+{
+    const size_t last = state->options.segments_out_of_order ? std::min(state->segments.size(), state->head + state->window)
+                                                              : state->head + 1;
+    for (size_t i = state->head; i < last; ++i) {
+        Segment& segment = state->segments[i];
+        if (!segment.frames.empty()) {
+            frame = segment.frames.front();
+            segment.frames.pop_front();
+            state->queued_bytes -= frame_bytes(frame);
+            physical = segment.next++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// decode the next frame, in video order or not, and advance past it. The
+// frame is offered to the pyramid under the frame number tell gave for it.
+static JaniceError read_next(JaniceMediaIterator* it, cv::Mat& frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    if (state->workers.empty() && state->next_segment < state->segments.size()) {
+        const size_t workers = std::min(state->window, state->segments.size() - state->next_segment);
+        for (size_t i = 0; i < workers; ++i) {
+            state->workers.emplace_back(decode_worker, state);
+        }
+    }
+
+    while (true) {
+        if (state->head == state->segments.size()) {
+            return JANICE_MEDIA_AT_END;
+        }
+
+        uint32_t physical;
+        if (take_frame(state, frame, physical)) {
+            if (state->options.segments_out_of_order) {
+                state->physical_frames.push_back(physical);
+            }
+            state->pyramid.offer(state->pos, frame);
+            ++state->pos;
+            state->worker_cv.notify_all();
+
+            return JANICE_SUCCESS;
+        }
+
+        // Move past the segments that are finished, which frees a slot in the window
+        const Segment& segment = state->segments[state->head];
+        if (segment.done && segment.frames.empty()) {
+            if (segment.failed) {
+                return JANICE_INVALID_MEDIA;
+            }
+
+            ++state->head;
+            state->worker_cv.notify_all();
+            continue;
+        }
+
+        state->frame_cv.wait(lock);
+    }
+}
+
+// decode frame of the video, from the decoded segments if we have it
+static JaniceError read_frame(JaniceMediaIteratorStateType* state, uint32_t frame, cv::Mat& cv_frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        const Segment& segment = state->segments[segment_of(state, frame)];
+        if (frame >= segment.next && frame < segment.next + segment.frames.size()) {
+            cv_frame = segment.frames[frame - segment.next];
+            return JANICE_SUCCESS;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(state->random_mutex);
+    if (!state->random_video.isOpened()) {
+        if (!state->random_video.open(state->filename)) {
+            return JANICE_OPEN_ERROR;
+        }
+        state->random_frame = 0;
+    }
+
+    // Decode forward if no keyframe lies between us and the frame
+    if (state->random_frame != unknown_frame &&
+            frame > state->random_frame &&
+            keyframe_before(state, frame) <= state->random_frame) {
+        while (state->random_frame < frame && state->random_video.grab()) {
+            ++state->random_frame;
+        }
+    }
+
+    if (state->random_frame != frame) {
+        state->random_video.set(CV_CAP_PROP_POS_FRAMES, frame);
+    }
+
+    if (!state->random_video.read(cv_frame)) {
+        state->random_frame = unknown_frame;
+        return JANICE_INVALID_MEDIA;
+    }
+    state->random_frame = frame + 1;
+
+    return JANICE_SUCCESS;
+}
+
+// Map a frame number from get or get_roi to a frame of the video
+static JaniceError video_frame(JaniceMediaIteratorStateType* state, uint32_t frame, uint32_t* physical)
+{
+    if (!state->options.segments_out_of_order) {
+        if (frame >= state->frame_count) {
+            return JANICE_OUT_OF_BOUNDS_ACCESS;
+        }
+
+        *physical = frame;
+        return JANICE_SUCCESS;
+    }
+
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (frame >= state->physical_frames.size()) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    *physical = state->physical_frames[frame];
+    return JANICE_SUCCESS;
+}
+
+JaniceError is_video(JaniceMediaIterator*, bool* video)
+{
+    *video = true;
+    return JANICE_SUCCESS;
+}
+
+JaniceError get_frame_rate(JaniceMediaIterator* it, float* frame_rate)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    *frame_rate = state->frame_rate;
+    return JANICE_SUCCESS;
+}
+
+JaniceError get_physical_frame_rate(JaniceMediaIterator* it, float* frame_rate)
+{
+    return get_frame_rate(it, frame_rate);
+}
+
+JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    cv::Mat cv_frame;
+    JaniceError ret = read_next(it, cv_frame);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    return ocv_utils::output_janice_image(cv_frame, *image, state->options.borrow_frames, state->format.get());
+}
+
+// read up to max_images frames into a single buffer
+JaniceError next_batch(JaniceMediaIterator* it, JaniceImage* images, uint32_t max_images, uint32_t* num_images)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (images == nullptr || num_images == nullptr)
+        return JANICE_BAD_ARGUMENT;
+
+    *num_images = 0;
+
+    std::vector<cv::Mat> cv_frames;
+    cv_frames.reserve(max_images);
+    while (cv_frames.size() < max_images) {
+        cv::Mat cv_frame;
+        JaniceError ret = read_next(it, cv_frame);
+        if (ret != JANICE_SUCCESS) {
+            // Return the frames we have, the error repeats on the next call
+            if (!cv_frames.empty())
+                break;
+            return ret;
+        }
+        cv_frames.push_back(cv_frame);
+    }
+
+    if (cv_frames.empty())
+        return JANICE_SUCCESS;
+
+    JaniceError ret = ocv_utils::output_janice_batch(cv_frames, images, state->format.get());
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    *num_images = cv_frames.size();
+    return JANICE_SUCCESS;
+}
+
+JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    // Frames returned out of order can't be returned in the same order again
+    if (state->options.segments_out_of_order && frame != 0)
+        return JANICE_NOT_IMPLEMENTED;
+
+    if (frame >= state->frame_count) // invalid index
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+
+    {
+        // Seeking forward into frames that are already decoded just drops the
+        // ones we skip over, the workers keep running
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!state->options.segments_out_of_order && state->head < state->segments.size()) {
+            Segment& segment = state->segments[state->head];
+            if (frame >= segment.next && frame < segment.next + segment.frames.size()) {
+                for (uint32_t i = segment.next; i < frame; ++i) {
+                    state->queued_bytes -= frame_bytes(segment.frames.front());
+                    segment.frames.pop_front();
+                }
+                segment.next = frame;
+                state->pos = frame;
+                state->worker_cv.notify_all();
+
+                return JANICE_SUCCESS;
+            }
+        }
+    }
+
+    restart(state, frame);
+
+    return JANICE_SUCCESS;
+}
+
+// get the specified frame
+JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    uint32_t physical;
+    JaniceError ret = video_frame(state, frame, &physical);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    cv::Mat cv_frame;
+    ret = read_frame(state, physical, cv_frame);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    return ocv_utils::output_janice_image(cv_frame, *image, state->options.borrow_frames, state->format.get());
+}
+
+// get a region of the specified frame. Only the region is copied.
+JaniceError get_roi(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, const JaniceRect* rect)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (rect == nullptr)
+        return JANICE_BAD_ARGUMENT;
+
+    uint32_t physical;
+    JaniceError ret = video_frame(state, frame, &physical);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    cv::Mat cv_frame;
+    ret = read_frame(state, physical, cv_frame);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    cv::Mat cv_roi;
+    ret = ocv_utils::crop(cv_frame, *rect, cv_roi);
+    if (ret != JANICE_SUCCESS)
+        return ret;
+
+    return ocv_utils::output_janice_image(cv_roi, *image, state->options.borrow_frames, state->format.get());
+}
+
+// get a level of the pyramid of the specified frame
+JaniceError get_pyramid(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, uint32_t level)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (image == nullptr)
+        return JANICE_BAD_ARGUMENT;
+
+    if (!state->pyramid.has(frame)) {
+        uint32_t physical;
+        JaniceError ret = video_frame(state, frame, &physical);
+        if (ret != JANICE_SUCCESS)
+            return ret;
+
+        cv::Mat cv_frame;
+        ret = read_frame(state, physical, cv_frame);
+        if (ret != JANICE_SUCCESS)
+            return ret;
+
+        state->pyramid.set(frame, cv_frame);
+    }
+
+    return ocv_utils::output_pyramid_level(state->pyramid, level, *image, state->options.borrow_frames);
+}
+
+// say what frame we are currently on. Out of order, this counts the frames returned.
+JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    std::lock_guard<std::mutex> lock(state->mutex);
+    *frame = state->pos;
+    return JANICE_SUCCESS;
+}
+
+// Map a logical frame number (as from tell) to a physical frame number. In
+// order they are the same, out of order we look up where the frame came from.
+JaniceError physical_frame(JaniceMediaIterator* it, uint32_t logical, uint32_t *physical)
+{
+    if (physical == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    if (!state->options.segments_out_of_order) {
+        *physical = logical;
+        return JANICE_SUCCESS;
+    }
+
+    return video_frame(state, logical, physical);
+}
+
+// convert the frames we return to format from now on
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->format.set(format);
+}
+
+JaniceError free_image(JaniceImage* image)
+{
+    return ocv_utils::free_janice_image(image);
+}
+
+JaniceError free_iterator(JaniceMediaIterator* it)
+{
+    if (it && it->_internal) {
+        delete (JaniceMediaIteratorStateType*) it->_internal;
+        it->_internal = nullptr;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError reset(JaniceMediaIterator* it)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    restart(state, 0);
+
+    return JANICE_SUCCESS;
+}
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+// OpenCV I/O only, create a segmented media iterator
+
+JaniceError ocv_utils::create_segmented_media_iterator(const char* filename,
+                                                       const JaniceIOOpenCVOptions& options,
+                                                       JaniceMediaIterator* it)
+{
+    uint8_t header[16];
+    size_t header_length = 0;
+    if (FILE* file = fopen(filename, "rb")) {
+        header_length = fread(header, 1, sizeof(header), file);
+        fclose(file);
+    } else {
+        return JANICE_OPEN_ERROR;
+    }
+
+    if (ocv_utils::has_still_image_signature(header, header_length)) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    // Probe the video once, the workers open their own captures
+    cv::VideoCapture video(filename);
+    if (!video.isOpened()) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    const double frame_count = video.get(CV_CAP_PROP_FRAME_COUNT);
+    if (frame_count <= 0) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    state->filename = filename;
+    state->options = options;
+    state->frame_count = (uint32_t) frame_count;
+    state->frame_rate = video.get(CV_CAP_PROP_FPS);
+
+    // The index is needed up front to place the segments
+    ocv_utils::find_keyframes(state->filename, options.keyframe_index ? options.keyframe_index : "",
+                              options.build_keyframe_index, options.save_keyframe_index,
+                              state->keyframes);
+    state->keyframe_interval = options.keyframe_interval;
+    if (state->keyframe_interval == 0) {
+        state->keyframe_interval = state->keyframes.empty() ? std::max(1, (int) state->frame_rate)
+                                                            : std::max<uint32_t>(1, state->frame_count / state->keyframes.size());
+    }
+
+    // Each segment holds at most queue_limit frames, so a segment that is much
+    // longer than a keyframe interval, with a sparse keyframe index, doesn't
+    // get decoded into memory whole ahead of next()
+    state->window = options.decode_segments;
+    if (options.segments_out_of_order) {
+        split(state, (state->frame_count + state->window - 1) / state->window);
+        state->queue_limit = options.prefetch_frames > 0 ? options.prefetch_frames : 4;
+    } else {
+        split(state, state->keyframe_interval);
+        state->queue_limit = options.prefetch_frames > 0 ? options.prefetch_frames : state->keyframe_interval;
+    }
+
+    state->stop = false;
+    state->random_frame = unknown_frame;
+    restart(state, 0);
+
+    it->is_video = &is_video;
+    it->get_frame_rate =  &get_frame_rate;
+    it->get_physical_frame_rate =  &get_physical_frame_rate;
+
+    it->next = &next;
+    it->next_batch = &next_batch;
+    it->seek = &seek;
+    it->get  = &get;
+    it->get_roi = &get_roi;
+    it->tell = &tell;
+    it->physical_frame = &physical_frame;
+    it->set_format = &set_format;
+    it->get_pyramid = &get_pyramid;
+
+    it->free_image = &free_image;
+    it->free       = &free_iterator;
+
+    it->reset      = &reset;
+
+    it->_internal = (void*) (state);
+
+    return JANICE_SUCCESS;
+}
+
+bool ocv_utils::is_segmented_media_iterator(const JaniceMediaIterator* it)
+{
+    return it->free == &free_iterator;
+}
@@ -1,9 +1,19 @@
 #include <janice_io.h>
 #include <janice_io_opencv.h>
 #include <janice_io_opencv_utils.hpp>
+#include <janice_io_thread_pool.hpp>
+
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+#include <janice_io_file_loader.hpp>
+#endif
 
 #include <opencv2/highgui.hpp>
 
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -13,12 +23,176 @@ namespace
 // ----------------------------------------------------------------------------
 // JaniceMediaIterator
 
+// A file being decoded ahead of the cursor on the shared thread pool. Tasks
+// only hold on to this, so an iterator can be freed while they are running.
+struct PendingDecode
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    cv::Mat image;
+};
+
 struct JaniceMediaIteratorStateType
 {
     std::vector<std::string> filenames;
+    std::vector<uint32_t> frames; // the source frame of each file, empty if unknown
     size_t pos;
+    JaniceIOOpenCVOptions options;
+    io_utils::OutputFormat format; // set with set_format
+    io_utils::FramePyramid pyramid; // of the last image, see get_pyramid
+
+    // Files queued or decoded ahead of pos, by index
+    std::map<size_t, std::shared_ptr<PendingDecode>> pending;
+    size_t decoded_size; // size of the last decoded image, to estimate the rest
 };
 
+static JaniceError decode(const JaniceMediaIteratorStateType* state, size_t index, cv::Mat& image)
+{
+    try {
+        image = ocv_utils::read_still_image(state->filenames[index],
+                                            ocv_utils::imread_flags(state->options.decode_scale),
+                                            state->options.read_mode);
+    } catch (...) {
+        return JANICE_UNKNOWN_ERROR;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+// Queue decodes for the next options.prefetch_frames files after pos, while the
+// decoded images are estimated to fit in options.prefetch_memory_limit
+static void schedule_prefetch(JaniceMediaIteratorStateType* state)
+{
+    // Forget files we have moved past
+    state->pending.erase(state->pending.begin(), state->pending.lower_bound(state->pos));
+
+    size_t end = std::min(state->filenames.size(), state->pos + state->options.prefetch_frames);
+    state->pending.erase(state->pending.lower_bound(end), state->pending.end());
+
+    size_t budget = 0;
+    for (auto& entry : state->pending) {
+        std::lock_guard<std::mutex> lock(entry.second->mutex);
+        budget += entry.second->done ? entry.second->image.total() * entry.second->image.elemSize()
+                                     : state->decoded_size;
+    }
+
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+    // With batched reads, files are collected here and loaded together
+    std::vector<std::string> batch;
+    std::vector<io_utils::FileLoader::Callback> callbacks;
+#endif
+
+    for (size_t index = state->pos; index < end; ++index) {
+        if (state->pending.count(index)) {
+            continue;
+        }
+
+        // Until we have seen an image we can't estimate, so only decode one
+        if (state->options.prefetch_memory_limit != 0 &&
+                (budget + state->decoded_size > state->options.prefetch_memory_limit ||
+                 (state->decoded_size == 0 && !state->pending.empty()))) {
+            break;
+        }
+        budget += state->decoded_size;
+
+        std::shared_ptr<PendingDecode> pending = std::make_shared<PendingDecode>();
+        std::string filename = state->filenames[index];
+        int flags = ocv_utils::imread_flags(state->options.decode_scale);
+        JaniceIOOpenCVReadMode mode = state->options.read_mode;
+
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+        if (mode == JaniceIOOpenCVReadBatched) {
+            // Files decoded by another iterator don't need reading
+            if (ocv_utils::find_cached_still(filename, flags, pending->image)) {
+                pending->done = true;
+                state->pending[index] = pending;
+                continue;
+            }
+
+            batch.push_back(filename);
+            callbacks.push_back([pending, filename, flags](std::vector<uint8_t>& data, bool ok) {
+                // Decode on the pool so the loader can keep completing reads
+                std::shared_ptr<std::vector<uint8_t>> bytes = std::make_shared<std::vector<uint8_t>>();
+                bytes->swap(data);
+
+                io_utils::ThreadPool::instance().submit([pending, filename, flags, bytes, ok]() {
+                    // Decoding through the cache claims the still, so two
+                    // iterators that both read it only decode it once
+                    cv::Mat image;
+                    try {
+                        if (ok) {
+                            image = ocv_utils::decode_still_image(filename, flags, *bytes);
+                        }
+                    } catch (...) {
+                        // As below, the reader decodes it again and reports the error
+                    }
+
+                    std::lock_guard<std::mutex> lock(pending->mutex);
+                    pending->image = image;
+                    pending->done = true;
+                    pending->cv.notify_all();
+                });
+            });
+
+            state->pending[index] = pending;
+            continue;
+        }
+#endif
+
+        // The pool may be busy with other iterators, have the file on its way
+        // before a thread gets to it
+        const int fd = ocv_utils::open_still_image(filename, mode);
+
+        io_utils::ThreadPool::instance().submit([pending, filename, flags, mode, fd]() {
+            cv::Mat image;
+            try {
+                image = ocv_utils::read_still_image(filename, flags, mode, fd);
+            } catch (...) {
+                // An empty image makes the reader fall back to a synchronous
+                // decode, which reports the error
+            }
+
+            std::lock_guard<std::mutex> lock(pending->mutex);
+            pending->image = image;
+            pending->done = true;
+            pending->cv.notify_all();
+        });
+
+        state->pending[index] = pending;
+    }
+
+#ifdef JANICE_IO_OPENCV_WITH_POSIX
+    if (!batch.empty()) {
+        io_utils::FileLoader::instance().load(batch, callbacks);
+    }
+#endif
+}
+
+// Get a decoded image, from the decode-ahead queue if possible
+static JaniceError read_image(JaniceMediaIteratorStateType* state, size_t index, cv::Mat& image)
+{
+    auto entry = state->pending.find(index);
+    if (entry != state->pending.end()) {
+        std::unique_lock<std::mutex> lock(entry->second->mutex);
+        entry->second->cv.wait(lock, [&]() { return entry->second->done; });
+        image = entry->second->image;
+    }
+
+    if (!image.data) {
+        JaniceError ret = decode(state, index, image);
+        if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+    }
+
+    if (image.data) {
+        state->decoded_size = image.total() * image.elemSize();
+    }
+
+    return JANICE_SUCCESS;
+}
+
 JaniceError is_video(JaniceMediaIterator* it, bool* video)
 {
     *video = true; // Treat this as a video
@@ -43,15 +217,71 @@ JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
         return JANICE_MEDIA_AT_END;
     }
 
-    try {
-        cv::Mat cv_img = cv::imread(state->filenames[state->pos], cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
-        ocv_utils::cv_mat_to_janice_image(cv_img, *image);
-    } catch (...) {
-        return JANICE_UNKNOWN_ERROR;
+    cv::Mat cv_img;
+    JaniceError ret = read_image(state, state->pos, cv_img);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
     }
 
+    ret = ocv_utils::output_janice_image(cv_img, *image, state->options.borrow_frames, state->format.get());
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    state->pyramid.offer(state->pos, cv_img);
     ++state->pos;
 
+    if (state->options.prefetch_frames > 0) {
+        schedule_prefetch(state);
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError next_batch(JaniceMediaIterator* it, JaniceImage* images, uint32_t max_images, uint32_t* num_images)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (images == nullptr || num_images == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    *num_images = 0;
+
+    if (state->pos == state->filenames.size()) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    std::vector<cv::Mat> cv_imgs;
+    while (cv_imgs.size() < max_images && state->pos + cv_imgs.size() < state->filenames.size()) {
+        cv::Mat cv_img;
+        JaniceError ret = read_image(state, state->pos + cv_imgs.size(), cv_img);
+        if (ret != JANICE_SUCCESS) {
+            // Return the images we have, the error repeats on the next call
+            if (!cv_imgs.empty()) {
+                break;
+            }
+            return ret;
+        }
+        cv_imgs.push_back(cv_img);
+    }
+
+    if (!cv_imgs.empty()) {
+        JaniceError ret = ocv_utils::output_janice_batch(cv_imgs, images, state->format.get());
+        if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+
+        state->pyramid.offer(state->pos + cv_imgs.size() - 1, cv_imgs.back());
+    }
+
+    state->pos += cv_imgs.size();
+    *num_images = cv_imgs.size();
+
+    if (state->options.prefetch_frames > 0) {
+        schedule_prefetch(state);
+    }
+
     return JANICE_SUCCESS;
 }
 
@@ -65,6 +295,10 @@ JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
 
     state->pos = frame;
 
+    if (state->options.prefetch_frames > 0) {
+        schedule_prefetch(state);
+    }
+
     return JANICE_SUCCESS;
 }
 
@@ -76,14 +310,57 @@ JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
         return JANICE_BAD_ARGUMENT;
     }
 
-    try {
-        cv::Mat cv_img = cv::imread(state->filenames[frame], cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
-        ocv_utils::cv_mat_to_janice_image(cv_img, *image);
-    } catch (...) {
-        return JANICE_UNKNOWN_ERROR;
+    cv::Mat cv_img;
+    JaniceError ret = read_image(state, frame, cv_img);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
     }
 
-    return JANICE_SUCCESS;
+    return ocv_utils::output_janice_image(cv_img, *image, state->options.borrow_frames, state->format.get());
+}
+
+JaniceError get_roi(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, const JaniceRect* rect)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (frame >= state->filenames.size() || rect == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    cv::Mat cv_img;
+    JaniceError ret = read_image(state, frame, cv_img);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    cv::Mat cv_roi;
+    ret = ocv_utils::crop(cv_img, *rect, cv_roi);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    return ocv_utils::output_janice_image(cv_roi, *image, state->options.borrow_frames, state->format.get());
+}
+
+JaniceError get_pyramid(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, uint32_t level)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (frame >= state->filenames.size() || image == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    if (!state->pyramid.has(frame)) {
+        cv::Mat cv_img;
+        JaniceError ret = read_image(state, frame, cv_img);
+        if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+
+        state->pyramid.set(frame, cv_img);
+    }
+
+    return ocv_utils::output_pyramid_level(state->pyramid, level, *image, state->options.borrow_frames);
 }
 
 JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
@@ -100,25 +377,39 @@ JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
 }
 
 // Map a logical frame number (as from tell) to a physical frame number, allowing
-// for downsampling, clipping, etc. on videos. Here, we just return the physical frame.
-JaniceError physical_frame(JaniceMediaIterator*, uint32_t logical, uint32_t *physical)
+// for downsampling, clipping, etc. on videos. Here, that's the frame number the
+// file was given, or the logical frame if it wasn't given one.
+JaniceError physical_frame(JaniceMediaIterator* it, uint32_t logical, uint32_t *physical)
 {
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
     if (physical == nullptr) {
         return JANICE_BAD_ARGUMENT;
     }
 
-    *physical = logical;
+    if (state->frames.empty()) {
+        *physical = logical;
+        return JANICE_SUCCESS;
+    }
+
+    if (logical >= state->frames.size()) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    *physical = state->frames[logical];
     return JANICE_SUCCESS;
 }
 
-JaniceError free_image(JaniceImage* image)
+// convert the frames we return to format from now on
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
 {
-    if (image && image->owner) {
-        free(image->data);
-        image->data = nullptr;
-    }
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->format.set(format);
+}
 
-    return JANICE_SUCCESS;
+JaniceError free_image(JaniceImage* image)
+{
+    return ocv_utils::free_janice_image(image);
 }
 
 JaniceError free_iterator(JaniceMediaIterator* it)
@@ -135,38 +426,131 @@ JaniceError reset(JaniceMediaIterator* it)
     JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
     state->pos = 0;
 
+    if (state->options.prefetch_frames > 0) {
+        schedule_prefetch(state);
+    }
+
     return JANICE_SUCCESS;
 }
 
-} // anonymous namespace
-
-// ----------------------------------------------------------------------------
-// OpenCV I/O only, create a sparse opencv_io media iterator
-
-JaniceError janice_io_opencv_create_sparse_media_iterator(const char** filenames, size_t num_files, JaniceMediaIterator* it)
+static JaniceError create_iterator(const char** filenames,
+                                   const uint32_t* frames,
+                                   size_t num_files,
+                                   const JaniceIOOpenCVOptions* options,
+                                   JaniceMediaIterator* it)
 {
+    if (options == nullptr || !ocv_utils::valid_decode_scale(options->decode_scale)) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
     it->is_video = &is_video;
     it->get_frame_rate =  &get_frame_rate;
     it->get_physical_frame_rate =  &get_physical_frame_rate;
 
     it->next = &next;
+    it->next_batch = &next_batch;
     it->seek = &seek;
     it->get  = &get;
+    it->get_roi = &get_roi;
     it->tell = &tell;
     it->physical_frame = &physical_frame;
+    it->set_format = &set_format;
+    it->get_pyramid = &get_pyramid;
 
     it->free_image = &free_image;
     it->free       = &free_iterator;
 
     it->reset      = &reset;
 
-    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    // Files with frame numbers are iterated in frame order
+    std::vector<size_t> order(num_files);
     for (size_t i = 0; i < num_files; ++i) {
+        order[i] = i;
+    }
+    if (frames != nullptr) {
+        std::stable_sort(order.begin(), order.end(), [frames](size_t a, size_t b) {
+            return frames[a] < frames[b];
+        });
+    }
+
+    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    for (size_t i : order) {
         state->filenames.push_back(std::string(filenames[i]));
+        if (frames != nullptr) {
+            state->frames.push_back(frames[i]);
+        }
     }
     state->pos = 0;
+    state->options = *options;
+    state->decoded_size = 0;
+
+    if (state->options.prefetch_frames > 0) {
+        schedule_prefetch(state);
+    }
 
     it->_internal = (void*) (state);
 
     return JANICE_SUCCESS;
 }
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+// OpenCV I/O only, create a sparse opencv_io media iterator
+
+JaniceError janice_io_opencv_create_sparse_media_iterator(const char** filenames, size_t num_files, JaniceMediaIterator* it)
+{
+    JaniceIOOpenCVOptions options;
+    janice_io_opencv_init_default_options(&options);
+
+    return janice_io_opencv_create_sparse_media_iterator_with_options(filenames, num_files, &options, it);
+}
+
+JaniceError janice_io_opencv_create_sparse_media_iterator_with_options(const char** filenames,
+                                                                       size_t num_files,
+                                                                       const JaniceIOOpenCVOptions* options,
+                                                                       JaniceMediaIterator* it)
+{
+    return create_iterator(filenames, nullptr, num_files, options, it);
+}
+
+JaniceError janice_io_opencv_create_sparse_media_iterator_with_frames(const char** filenames,
+                                                                      const uint32_t* frames,
+                                                                      size_t num_files,
+                                                                      const JaniceIOOpenCVOptions* options,
+                                                                      JaniceMediaIterator* it)
+{
+    if (frames == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceIOOpenCVOptions default_options;
+    if (options == nullptr) {
+        janice_io_opencv_init_default_options(&default_options);
+        options = &default_options;
+    }
+
+    return create_iterator(filenames, frames, num_files, options, it);
+}
+
+JaniceError janice_io_opencv_sparse_find_frame(JaniceMediaIterator* it, uint32_t frame, uint32_t* logical)
+{
+    if (it == nullptr || logical == nullptr || it->free != &free_iterator) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    // Without frame numbers each image is its own frame
+    size_t index = frame;
+    if (!state->frames.empty()) {
+        index = std::lower_bound(state->frames.begin(), state->frames.end(), frame) - state->frames.begin();
+    }
+
+    if (index >= state->filenames.size()) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    *logical = index;
+    return JANICE_SUCCESS;
+}
@@ -0,0 +1,227 @@
+#include <janice_io.h>
+#include <janice_io_opencv.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+
+// ----------------------------------------------------------------------------
+// JaniceMediaIterator
+
+// Presents a subset of the frames of another iterator. Logical frame i maps
+// to physical frame floor(i * step) of the wrapped iterator.
+struct JaniceMediaIteratorStateType
+{
+    JaniceMediaIterator base;
+    double step;
+    float frame_rate;   // frame rate we present, 0 if unknown
+    uint32_t pos;
+    uint32_t base_next; // frame the wrapped iterator's next() returns
+};
+
+static uint32_t to_base_frame(const JaniceMediaIteratorStateType* state, uint32_t frame)
+{
+    return (uint32_t) std::floor(frame * state->step + 1e-6);
+}
+
+JaniceError is_video(JaniceMediaIterator* it, bool* video)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->base.is_video(&state->base, video);
+}
+
+JaniceError get_frame_rate(JaniceMediaIterator* it, float* frame_rate)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (state->frame_rate <= 0) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    *frame_rate = state->frame_rate;
+    return JANICE_SUCCESS;
+}
+
+JaniceError get_physical_frame_rate(JaniceMediaIterator* it, float* frame_rate)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->base.get_physical_frame_rate(&state->base, frame_rate);
+}
+
+JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    // Skipping is left to the wrapped iterator's seek. The opencv_io video
+    // iterator moves its capture lazily and grabs forward without converting
+    // frames when that is cheaper than a real seek.
+    uint32_t base_frame = to_base_frame(state, state->pos);
+    if (base_frame != state->base_next) {
+        JaniceError ret = state->base.seek(&state->base, base_frame);
+        if (ret == JANICE_OUT_OF_BOUNDS_ACCESS || ret == JANICE_BAD_ARGUMENT || ret == JANICE_INVALID_MEDIA) {
+            return JANICE_MEDIA_AT_END; // past the last frame we can present
+        } else if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+    }
+
+    JaniceError ret = state->base.next(&state->base, image);
+    if (ret == JANICE_SUCCESS) {
+        state->base_next = base_frame + 1;
+        ++state->pos;
+    }
+
+    return ret;
+}
+
+JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    JaniceError ret = state->base.seek(&state->base, to_base_frame(state, frame));
+    if (ret == JANICE_SUCCESS) {
+        state->pos = frame;
+        state->base_next = to_base_frame(state, frame);
+    }
+
+    return ret;
+}
+
+JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->base.get(&state->base, image, to_base_frame(state, frame));
+}
+
+JaniceError get_roi(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, const JaniceRect* rect)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->base.get_roi(&state->base, image, to_base_frame(state, frame), rect);
+}
+
+// Frames come straight from the wrapped iterator, so it converts them
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->base.set_format(&state->base, format);
+}
+
+JaniceError get_pyramid(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, uint32_t level)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->base.get_pyramid(&state->base, image, to_base_frame(state, frame), level);
+}
+
+JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    // Defer to the wrapped iterator for stills and other media without a position
+    uint32_t base_frame;
+    JaniceError ret = state->base.tell(&state->base, &base_frame);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    *frame = state->pos;
+    return JANICE_SUCCESS;
+}
+
+// Map a logical frame number (as from tell) through the subsampling and then
+// through whatever mapping the wrapped iterator applies.
+JaniceError physical_frame(JaniceMediaIterator* it, uint32_t logical, uint32_t *physical)
+{
+    if (physical == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->base.physical_frame(&state->base, to_base_frame(state, logical), physical);
+}
+
+JaniceError free_iterator(JaniceMediaIterator* it)
+{
+    if (it && it->_internal) {
+        JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+        state->base.free(&state->base);
+
+        delete state;
+        it->_internal = nullptr;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError reset(JaniceMediaIterator* it)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    state->pos = 0;
+    state->base_next = 0;
+
+    return state->base.reset(&state->base);
+}
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+// OpenCV I/O only, create a subsampled media iterator
+
+JaniceError janice_io_opencv_create_subsampled_media_iterator(JaniceMediaIterator* base,
+                                                              uint32_t stride,
+                                                              float target_frame_rate,
+                                                              JaniceMediaIterator* it)
+{
+    if (base == nullptr || it == nullptr || (stride == 0 && target_frame_rate <= 0)) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    state->base = *base;
+    state->pos = 0;
+    state->base_next = 0;
+
+    float base_frame_rate = 0;
+    if (base->get_frame_rate(base, &base_frame_rate) != JANICE_SUCCESS) {
+        base_frame_rate = 0;
+    }
+
+    if (stride != 0) {
+        state->step = stride;
+        state->frame_rate = base_frame_rate / stride;
+    } else {
+        // A target frame rate needs the source rate, and never upsamples
+        if (base_frame_rate <= 0) {
+            delete state;
+            return JANICE_INVALID_MEDIA;
+        }
+
+        state->step = std::max(1.0, (double) base_frame_rate / target_frame_rate);
+        state->frame_rate = base_frame_rate / state->step;
+    }
+
+    it->is_video = &is_video;
+    it->get_frame_rate =  &get_frame_rate;
+    it->get_physical_frame_rate =  &get_physical_frame_rate;
+
+    it->next = &next;
+    it->next_batch = nullptr; // skipped frames would split a batch, use next
+    it->seek = &seek;
+    it->get  = &get;
+    it->get_roi = base->get_roi ? &get_roi : nullptr;
+    it->tell = &tell;
+    it->physical_frame = &physical_frame;
+    it->set_format = base->set_format ? &set_format : nullptr;
+    it->get_pyramid = base->get_pyramid ? &get_pyramid : nullptr;
+
+    // Images come straight from the wrapped iterator
+    it->free_image = base->free_image;
+    it->free       = &free_iterator;
+
+    it->reset      = &reset;
+
+    it->_internal = (void*) (state);
+
+    return JANICE_SUCCESS;
+}
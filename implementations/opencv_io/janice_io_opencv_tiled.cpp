@@ -0,0 +1,492 @@
+#include <janice_io.h>
+#include <janice_io_opencv.h>
+#include <janice_io_opencv_utils.hpp>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <string>
+#include <vector>
+
+namespace
+{
+
+// ----------------------------------------------------------------------------
+// JaniceMediaIterator
+
+// Presents a large still as overlapping tiles in row-major order. Logical
+// frame i is the tile at (xs[i % xs.size()], ys[i / xs.size()]).
+struct JaniceMediaIteratorStateType
+{
+    std::string filename;
+    int tile_width;
+    int tile_height;
+    int overlap;
+
+    // The decoded still. It is only held while next() is walking the tiles,
+    // from the first tile it returns until the last one or a reset. Random
+    // access reads outside such a pass decode it and drop it again.
+    cv::Mat image;
+    bool streaming;
+
+    // Size of the still and the tile origins, read from the header of the
+    // still where we can so the grid is known without decoding it
+    bool initialized;
+    int width;
+    int height;
+    std::vector<int> xs;
+    std::vector<int> ys;
+
+    uint32_t pos;
+    io_utils::OutputFormat format; // set with set_format
+    io_utils::FramePyramid pyramid; // of the last tile asked for, see get_pyramid
+};
+
+// Start tiles every tile - overlap pixels. The last tile is moved back to end
+// at the edge of the image so every tile has the full size, unless the image
+// is smaller than a tile.
+static void tile_origins(int length, int tile, int overlap, std::vector<int>& origins)
+{
+    origins.clear();
+
+    if (length <= tile) {
+        origins.push_back(0);
+        return;
+    }
+
+    for (int origin = 0; ; origin += tile - overlap) {
+        if (origin + tile >= length) {
+            origins.push_back(length - tile);
+            break;
+        }
+        origins.push_back(origin);
+    }
+}
+
+static void set_size(JaniceMediaIteratorStateType* state, int width, int height)
+{
+    state->width = width;
+    state->height = height;
+    tile_origins(width, state->tile_width, state->overlap, state->xs);
+    tile_origins(height, state->tile_height, state->overlap, state->ys);
+    state->initialized = true;
+}
+
+// Decode the still if it isn't resident. cv::imread can't decode part of an
+// image, so the tiles of a pass share one decode.
+static JaniceError load(JaniceMediaIteratorStateType* state)
+{
+    if (!state->image.empty()) {
+        return JANICE_SUCCESS;
+    }
+
+    try {
+        state->image = cv::imread(state->filename, ocv_utils::imread_flags(1));
+    } catch (...) {
+        return JANICE_UNKNOWN_ERROR;
+    }
+
+    if (state->image.empty()) {
+        return JANICE_INVALID_MEDIA;
+    }
+
+    if (!state->initialized) {
+        set_size(state, state->image.cols, state->image.rows);
+    } else if (state->image.cols != state->width || state->image.rows != state->height) {
+        state->image.release(); // The header lied, or the file changed under us
+        return JANICE_INVALID_MEDIA;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+// The tile grid is needed to check bounds, but not the pixels. Formats we
+// can't read the size of are decoded to learn it, and the still is dropped
+// again unless the caller is about to read tiles with next.
+static JaniceError initialize(JaniceMediaIteratorStateType* state, bool keep = false)
+{
+    if (state->initialized) {
+        return JANICE_SUCCESS;
+    }
+
+    int width, height;
+    if (ocv_utils::read_still_size(state->filename, width, height)) {
+        set_size(state, width, height);
+        return JANICE_SUCCESS;
+    }
+
+    const JaniceError ret = load(state);
+    if (!keep && !state->streaming) {
+        state->image.release();
+    }
+    return ret;
+}
+
+// Called after get, get_roi and get_pyramid, which don't keep the still
+static void done_random_access(JaniceMediaIteratorStateType* state)
+{
+    if (!state->streaming) {
+        state->image.release();
+    }
+}
+
+static void end_pass(JaniceMediaIteratorStateType* state)
+{
+    state->streaming = false;
+    state->image.release();
+}
+
+static uint32_t tile_count(const JaniceMediaIteratorStateType* state)
+{
+    return state->xs.size() * state->ys.size();
+}
+
+static cv::Rect tile_rect(const JaniceMediaIteratorStateType* state, uint32_t tile)
+{
+    const int x = state->xs[tile % state->xs.size()];
+    const int y = state->ys[tile / state->xs.size()];
+
+    return cv::Rect(x, y, state->tile_width, state->tile_height) & cv::Rect(0, 0, state->width, state->height);
+}
+
+// Copy a tile out of the still, in the format requested with set_format
+static JaniceError output_tile(JaniceMediaIteratorStateType* state, uint32_t tile, const JaniceRect* rect, JaniceImage* image)
+{
+    JaniceError ret = load(state);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    cv::Mat view = state->image(tile_rect(state, tile));
+    if (rect) {
+        cv::Mat roi;
+        ret = ocv_utils::crop(view, *rect, roi);
+        if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+        view = roi;
+    }
+
+    // Tiles aren't contiguous in the still, so they are always copied
+    return ocv_utils::output_janice_image(view, *image, false, state->format.get());
+}
+
+JaniceError is_video(JaniceMediaIterator*, bool* video)
+{
+    *video = true; // Treat this as a video of tiles
+    return JANICE_SUCCESS;
+}
+
+JaniceError get_frame_rate(JaniceMediaIterator*, float*)
+{
+    return JANICE_INVALID_MEDIA;
+}
+
+JaniceError get_physical_frame_rate(JaniceMediaIterator* it, float* frame_rate)
+{
+    return get_frame_rate(it, frame_rate);
+}
+
+JaniceError next(JaniceMediaIterator* it, JaniceImage* image)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    JaniceError ret = initialize(state, true);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    if (state->pos == tile_count(state)) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    state->streaming = true;
+    ret = output_tile(state, state->pos, nullptr, image);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    // A view would keep the whole still alive, so the pyramid gets a copy
+    if (state->pyramid.active()) {
+        state->pyramid.offer(state->pos, state->image(tile_rect(state, state->pos)).clone());
+    }
+
+    if (++state->pos == tile_count(state)) {
+        end_pass(state);
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError next_batch(JaniceMediaIterator* it, JaniceImage* images, uint32_t max_images, uint32_t* num_images)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (images == nullptr || num_images == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    *num_images = 0;
+
+    JaniceError ret = initialize(state, true);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    if (state->pos == tile_count(state)) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    state->streaming = true;
+    ret = load(state);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    std::vector<cv::Mat> tiles;
+    while (tiles.size() < max_images && state->pos + tiles.size() < tile_count(state)) {
+        tiles.push_back(state->image(tile_rect(state, state->pos + tiles.size())));
+    }
+
+    if (!tiles.empty()) {
+        ret = ocv_utils::output_janice_batch(tiles, images, state->format.get());
+        if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+    }
+
+    state->pos += tiles.size();
+    *num_images = tiles.size();
+
+    if (state->pos == tile_count(state)) {
+        end_pass(state);
+    }
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError seek(JaniceMediaIterator* it, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    JaniceError ret = initialize(state);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    if (frame >= tile_count(state)) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    state->pos = frame;
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError get(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    JaniceError ret = initialize(state);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    if (frame >= tile_count(state)) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    ret = output_tile(state, frame, nullptr, image);
+    done_random_access(state);
+    return ret;
+}
+
+// rect is relative to the tile
+JaniceError get_roi(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, const JaniceRect* rect)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (rect == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceError ret = initialize(state);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    if (frame >= tile_count(state)) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    ret = output_tile(state, frame, rect, image);
+    done_random_access(state);
+    return ret;
+}
+
+// A tile's pyramid is built from a copy of the tile, so the still can be
+// released after it is built
+JaniceError get_pyramid(JaniceMediaIterator* it, JaniceImage* image, uint32_t frame, uint32_t level)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    if (image == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceError ret = initialize(state);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    if (frame >= tile_count(state)) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    if (!state->pyramid.has(frame)) {
+        ret = load(state);
+        if (ret != JANICE_SUCCESS) {
+            return ret;
+        }
+
+        state->pyramid.set(frame, state->image(tile_rect(state, frame)).clone());
+        done_random_access(state);
+    }
+
+    return ocv_utils::output_pyramid_level(state->pyramid, level, *image, false);
+}
+
+JaniceError tell(JaniceMediaIterator* it, uint32_t* frame)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    JaniceError ret = initialize(state);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    if (state->pos == tile_count(state)) {
+        return JANICE_MEDIA_AT_END;
+    }
+
+    *frame = state->pos;
+
+    return JANICE_SUCCESS;
+}
+
+// Every tile comes from the same still, frame 0. Use
+// janice_io_opencv_get_tile_offset to place a tile in it.
+JaniceError physical_frame(JaniceMediaIterator*, uint32_t, uint32_t *physical)
+{
+    if (physical == nullptr) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    *physical = 0;
+    return JANICE_SUCCESS;
+}
+
+JaniceError set_format(JaniceMediaIterator* it, const JaniceImageFormat* format)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    return state->format.set(format);
+}
+
+JaniceError free_image(JaniceImage* image)
+{
+    return ocv_utils::free_janice_image(image);
+}
+
+JaniceError free_iterator(JaniceMediaIterator* it)
+{
+    if (it && it->_internal) {
+        delete (JaniceMediaIteratorStateType*) it->_internal;
+        it->_internal = nullptr;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+// Ends the pass, the still is decoded again by the next read
+JaniceError reset(JaniceMediaIterator* it)
+{
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+    state->pos = 0;
+    end_pass(state);
+
+    return JANICE_SUCCESS;
+}
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+// OpenCV I/O only, create a tiled media iterator
+
+JaniceError janice_io_opencv_create_tiled_media_iterator(const char* filename,
+                                                         uint32_t tile_width,
+                                                         uint32_t tile_height,
+                                                         uint32_t overlap,
+                                                         JaniceMediaIterator* it)
+{
+    if (filename == nullptr || it == nullptr || tile_width == 0 || tile_height == 0 ||
+            overlap >= tile_width || overlap >= tile_height) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    it->is_video = &is_video;
+    it->get_frame_rate =  &get_frame_rate;
+    it->get_physical_frame_rate =  &get_physical_frame_rate;
+
+    it->next = &next;
+    it->next_batch = &next_batch;
+    it->seek = &seek;
+    it->get  = &get;
+    it->get_roi = &get_roi;
+    it->tell = &tell;
+    it->physical_frame = &physical_frame;
+    it->set_format = &set_format;
+    it->get_pyramid = &get_pyramid;
+
+    it->free_image = &free_image;
+    it->free       = &free_iterator;
+
+    it->reset      = &reset;
+
+    JaniceMediaIteratorStateType* state = new JaniceMediaIteratorStateType();
+    state->filename = filename;
+    state->tile_width = tile_width;
+    state->tile_height = tile_height;
+    state->overlap = overlap;
+    state->streaming = false;
+    state->initialized = false;
+    state->width = 0;
+    state->height = 0;
+    state->pos = 0;
+
+    it->_internal = (void*) (state);
+
+    return JANICE_SUCCESS;
+}
+
+JaniceError janice_io_opencv_get_tile_offset(JaniceMediaIterator* it, uint32_t tile, uint32_t* x, uint32_t* y)
+{
+    if (it == nullptr || x == nullptr || y == nullptr || it->free != &free_iterator) {
+        return JANICE_BAD_ARGUMENT;
+    }
+
+    JaniceMediaIteratorStateType* state = (JaniceMediaIteratorStateType*) it->_internal;
+
+    JaniceError ret = initialize(state);
+    if (ret != JANICE_SUCCESS) {
+        return ret;
+    }
+
+    if (tile >= tile_count(state)) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    *x = state->xs[tile % state->xs.size()];
+    *y = state->ys[tile / state->xs.size()];
+
+    return JANICE_SUCCESS;
+}
@@ -2,25 +2,475 @@
 #define JANICE_IO_OPENCV_UTILS_HPP
 
 #include <janice_io.h>
+#include <janice_io_opencv.h>
+#include <janice_io_buffer_pool.hpp>
+#include <janice_io_format_opencv.hpp>
+#include <janice_io_pyramid_opencv.hpp>
 #include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace ocv_utils
 {
 
-inline JaniceError cv_mat_to_janice_image(cv::Mat& m, JaniceImage& image)
+// Decoded frames that were handed to the caller without a copy. Each entry keeps
+// a reference on the cv::Mat that owns the pixels until the borrowed image is
+// passed to free_image. The same buffer can be lent more than once.
+class BorrowedFrames
+{
+public:
+    static BorrowedFrames& instance()
+    {
+        static BorrowedFrames frames;
+        return frames;
+    }
+
+    void lend(const cv::Mat& m)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        frames.emplace(m.data, m);
+    }
+
+    bool release(const uint8_t* data)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = frames.find(data);
+        if (it == frames.end()) {
+            return false;
+        }
+
+        frames.erase(it);
+        return true;
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_multimap<const uint8_t*, cv::Mat> frames;
+};
+
+// imread flags for a still decoded at 1/decode_scale of its full resolution. We
+// use ANYCOLOR to load either RGB or Grayscale images and IGNORE_ORIENTATION to
+// skip rotating the image based on EXIF data. The reduced modes decode JPEGs
+// directly at the lower resolution but always produce color images.
+inline int imread_flags(uint32_t decode_scale)
+{
+    switch (decode_scale) {
+        case 2:  return cv::IMREAD_REDUCED_COLOR_2 | cv::IMREAD_IGNORE_ORIENTATION;
+        case 4:  return cv::IMREAD_REDUCED_COLOR_4 | cv::IMREAD_IGNORE_ORIENTATION;
+        case 8:  return cv::IMREAD_REDUCED_COLOR_8 | cv::IMREAD_IGNORE_ORIENTATION;
+        default: return cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION;
+    }
+}
+
+// Check the magic bytes at the start of a file for a still image format that
+// cv::imread can decode. Animated formats like GIF are left to VideoCapture.
+inline bool has_still_image_signature(const uint8_t* header, size_t length)
+{
+    auto starts_with = [&](const char* magic, size_t magic_length, size_t offset) {
+        return length >= offset + magic_length && memcmp(header + offset, magic, magic_length) == 0;
+    };
+
+    return starts_with("\xFF\xD8\xFF", 3, 0)                        // JPEG
+        || starts_with("\x89PNG\r\n\x1A\n", 8, 0)                   // PNG
+        || starts_with("BM", 2, 0)                                  // BMP
+        || starts_with("II*\0", 4, 0) || starts_with("MM\0*", 4, 0) // TIFF
+        || (starts_with("RIFF", 4, 0) && starts_with("WEBP", 4, 8)) // WebP
+        || starts_with("\0\0\0\x0CjP  \r\n\x87\n", 12, 0)           // JPEG 2000
+        || starts_with("\xFF\x4F\xFF\x51", 4, 0)                    // JPEG 2000 codestream
+        || starts_with("\x59\xA6\x6A\x95", 4, 0)                    // Sun raster
+        || starts_with("\x76\x2F\x31\x01", 4, 0)                    // OpenEXR
+        || starts_with("#?RADIANCE", 10, 0) || starts_with("#?RGBE", 6, 0) // Radiance HDR
+        || (length >= 2 && header[0] == 'P' && header[1] >= '1' && header[1] <= '7'); // PNM
+}
+
+// Read the size of a JPEG, PNG, BMP or TIFF still from its header without
+// decoding it. Returns false for other formats or a header we can't parse, in
+// which case the still has to be decoded to learn its size. EXIF orientation
+// isn't applied, matching imread_flags.
+inline bool read_still_size(const std::string& filename, int& width, int& height)
+{
+    std::ifstream file(filename, std::ios::binary);
+    uint8_t header[26];
+    if (!file.read((char*) header, sizeof(header))) {
+        return false;
+    }
+
+    auto be16 = [](const uint8_t* p) { return (uint32_t) p[0] << 8 | p[1]; };
+    auto be32 = [](const uint8_t* p) { return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3]; };
+    auto le16 = [](const uint8_t* p) { return (uint32_t) p[1] << 8 | p[0]; };
+    auto le32 = [](const uint8_t* p) { return (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0]; };
+
+    uint32_t w = 0, h = 0;
+    if (memcmp(header, "\x89PNG\r\n\x1A\n", 8) == 0 && memcmp(header + 12, "IHDR", 4) == 0) {
+        w = be32(header + 16);
+        h = be32(header + 20);
+    } else if (header[0] == 'B' && header[1] == 'M') {
+        if (le32(header + 14) == 12) { // OS/2 BITMAPCOREHEADER
+            w = le16(header + 18);
+            h = le16(header + 20);
+        } else {
+            w = le32(header + 18);
+            h = le32(header + 22);
+            h = (int32_t) h < 0 ? -h : h; // top-down bitmaps have a negative height
+        }
+    } else if (header[0] == 0xFF && header[1] == 0xD8) {
+        // Walk the JPEG markers to the first start of frame
+        file.seekg(2);
+        while (w == 0) {
+            uint8_t marker[4];
+            if (!file.read((char*) marker, 2) || marker[0] != 0xFF) {
+                return false;
+            }
+            while (marker[1] == 0xFF) { // fill bytes
+                if (!file.read((char*) marker + 1, 1)) {
+                    return false;
+                }
+            }
+            if (marker[1] == 0x01 || (marker[1] >= 0xD0 && marker[1] <= 0xD7)) {
+                continue; // markers without a payload
+            }
+            if (marker[1] == 0xD9 || marker[1] == 0xDA || !file.read((char*) marker + 2, 2)) {
+                return false; // image data before any frame header
+            }
+
+            const uint32_t length = be16(marker + 2);
+            const bool frame = marker[1] >= 0xC0 && marker[1] <= 0xCF &&
+                               marker[1] != 0xC4 && marker[1] != 0xC8 && marker[1] != 0xCC;
+            if (frame) {
+                uint8_t sof[5]; // precision, height, width
+                if (length < 7 || !file.read((char*) sof, sizeof(sof))) {
+                    return false;
+                }
+                h = be16(sof + 1);
+                w = be16(sof + 3);
+                if (w == 0) {
+                    return false;
+                }
+            } else if (length < 2 || !file.seekg(length - 2, std::ios::cur)) {
+                return false;
+            }
+        }
+    } else if (memcmp(header, "II*\0", 4) == 0 || memcmp(header, "MM\0*", 4) == 0) {
+        // Look for ImageWidth and ImageLength in the first IFD
+        const bool little = header[0] == 'I';
+        auto u16 = [&](const uint8_t* p) { return little ? le16(p) : be16(p); };
+        auto u32 = [&](const uint8_t* p) { return little ? le32(p) : be32(p); };
+
+        uint8_t count[2];
+        if (!file.seekg(u32(header + 4)) || !file.read((char*) count, 2)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < u16(count) && (w == 0 || h == 0); ++i) {
+            uint8_t entry[12]; // tag, type, count, value
+            if (!file.read((char*) entry, sizeof(entry))) {
+                return false;
+            }
+            const uint32_t tag = u16(entry), type = u16(entry + 2);
+            const uint32_t value = type == 3 ? u16(entry + 8) : type == 4 ? u32(entry + 8) : 0;
+            if (tag == 256) {
+                w = value;
+            } else if (tag == 257) {
+                h = value;
+            }
+        }
+    }
+
+    if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX) {
+        return false;
+    }
+
+    width = w;
+    height = h;
+    return true;
+}
+
+inline bool valid_decode_scale(uint32_t decode_scale)
+{
+    return decode_scale == 1 || decode_scale == 2 || decode_scale == 4 || decode_scale == 8;
+}
+
+// Load a keyframe index from a sidecar file. The file lists the frame number of
+// every keyframe in the video, one per line, counting from 0. With FFmpeg it
+// can be produced with
+//   ffprobe -v error -select_streams v:0 -show_entries frame=key_frame
+//           -of csv=p=0 video.mp4 | awk -F, '$1 == 1 { print NR - 1 }'
+// run as one command, which prints one line per frame with its keyframe flag.
+// Returns false, leaving keyframes empty, if the file can't be opened.
+inline bool load_keyframe_index(const std::string& path, std::vector<uint32_t>& keyframes)
+{
+    std::ifstream sidecar(path);
+    if (!sidecar) {
+        return false;
+    }
+
+    uint32_t keyframe;
+    while (sidecar >> keyframe) {
+        keyframes.push_back(keyframe);
+    }
+
+    std::sort(keyframes.begin(), keyframes.end());
+    return true;
+}
+
+// Write a keyframe index in the format load_keyframe_index reads. Returns
+// false if the file can't be written, for example next to read-only media.
+inline bool save_keyframe_index(const std::string& path, const std::vector<uint32_t>& keyframes)
+{
+    std::ofstream sidecar(path);
+    for (uint32_t keyframe : keyframes) {
+        sidecar << keyframe << '\n';
+    }
+
+    return (bool) sidecar;
+}
+
+// Find the keyframes of a video by reading its packets without decoding them.
+// This needs the FFmpeg backend of OpenCV 4.7 or later, which can return raw
+// packets and their keyframe flag. Packets are numbered in decode order, which
+// matches the frame numbers of keyframes unless GOPs are open. Returns false
+// if the video can't be scanned.
+inline bool scan_keyframes(const std::string& filename, std::vector<uint32_t>& keyframes)
+{
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 7)
+    cv::VideoCapture video;
+    try {
+        if (!video.open(filename, cv::CAP_FFMPEG, { cv::CAP_PROP_FORMAT, -1 })) {
+            return false;
+        }
+
+        std::vector<uint32_t> found;
+        for (uint32_t frame = 0; video.grab(); ++frame) {
+            if (video.get(cv::CAP_PROP_LRF_HAS_KEY_FRAME) != 0) {
+                found.push_back(frame);
+            }
+        }
+
+        // A stream always starts on a keyframe, without one the flag isn't
+        // supported
+        if (found.empty() || found.front() != 0) {
+            return false;
+        }
+
+        keyframes.swap(found);
+        return true;
+    } catch (...) {
+        return false;
+    }
+#else
+    (void) filename;
+    (void) keyframes;
+    return false;
+#endif
+}
+
+// Get the keyframe index of a video, see JaniceIOOpenCVOptions::keyframe_index
+// and build_keyframe_index. The sidecar at index_path, or at
+// "<filename>.keyframes" if index_path is empty, is used if it exists.
+// Otherwise, if build is set, the video is scanned and the index is written to
+// the sidecar if save is set. keyframes is left empty if there is no index.
+inline void find_keyframes(const std::string& filename, const std::string& index_path,
+                           bool build, bool save, std::vector<uint32_t>& keyframes)
+{
+    const std::string path = index_path.empty() ? filename + ".keyframes" : index_path;
+    if (load_keyframe_index(path, keyframes) || !build) {
+        return;
+    }
+
+    if (scan_keyframes(filename, keyframes) && save) {
+        save_keyframe_index(path, keyframes);
+    }
+}
+
+// Find the closest keyframe at or before frame. Without an index we assume a
+// keyframe every interval frames.
+inline uint32_t keyframe_before(const std::vector<uint32_t>& keyframes, uint32_t interval, uint32_t frame)
+{
+    if (!keyframes.empty()) {
+        auto keyframe = std::upper_bound(keyframes.begin(), keyframes.end(), frame);
+        return keyframe == keyframes.begin() ? 0 : *(keyframe - 1);
+    }
+
+    return frame - frame % std::max(1u, interval);
+}
+
+inline JaniceError cv_mat_to_janice_image(cv::Mat& m, JaniceImage& image, bool borrow = false)
 {
     // Set up the dimensions
     image.channels = m.channels();
     image.rows = m.rows;
     image.cols = m.cols;
 
-    image.data = (uint8_t*) malloc(m.channels() * m.rows * m.cols);
-    memcpy(image.data, m.data, m.channels() * m.rows * m.cols);
+    if (borrow) {
+        // JaniceImage has no stride, so views into a larger buffer can't be lent
+        cv::Mat lent = m.isContinuous() ? m : m.clone();
+
+        BorrowedFrames::instance().lend(lent);
+        image.data = lent.data;
+        image.owner = false;
+
+        return JANICE_SUCCESS;
+    }
+
+    const size_t row_size = m.channels() * m.cols;
+
+    image.data = io_utils::BufferPool::instance().acquire(row_size * m.rows);
+    if (image.data == nullptr) {
+        return JANICE_OUT_OF_MEMORY;
+    }
+
+    if (m.isContinuous()) {
+        memcpy(image.data, m.data, row_size * m.rows);
+    } else { // a region of a larger image
+        for (int row = 0; row < m.rows; ++row) {
+            memcpy(image.data + row * row_size, m.ptr(row), row_size);
+        }
+    }
     image.owner = true;
 
     return JANICE_SUCCESS;
 }
 
+// Copy a batch of frames into one contiguous buffer from the pool. Each image
+// in the batch owns its slice and is released with free_janice_image.
+inline JaniceError cv_mats_to_janice_batch(const std::vector<cv::Mat>& mats, JaniceImage* images)
+{
+    std::vector<size_t> sizes(mats.size());
+    for (size_t i = 0; i < mats.size(); ++i) {
+        sizes[i] = mats[i].channels() * mats[i].cols * mats[i].rows;
+    }
+
+    std::vector<uint8_t*> buffers(mats.size());
+    if (!io_utils::BufferPool::instance().acquire_batch(sizes.data(), mats.size(), buffers.data())) {
+        return JANICE_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = 0; i < mats.size(); ++i) {
+        const cv::Mat& m = mats[i];
+        const size_t row_size = m.channels() * m.cols;
+
+        if (m.isContinuous()) {
+            memcpy(buffers[i], m.data, sizes[i]);
+        } else {
+            for (int row = 0; row < m.rows; ++row) {
+                memcpy(buffers[i] + row * row_size, m.ptr(row), row_size);
+            }
+        }
+
+        images[i].channels = m.channels();
+        images[i].rows = m.rows;
+        images[i].cols = m.cols;
+        images[i].data = buffers[i];
+        images[i].owner = true;
+    }
+
+    return JANICE_SUCCESS;
+}
+
+// Convert a decoded frame to the image an iterator returns, in the format
+// requested with set_format if there is one. Formatted frames are always new
+// buffers.
+inline JaniceError output_janice_image(cv::Mat& m, JaniceImage& image, bool borrow, const JaniceImageFormat* format)
+{
+    if (format) {
+        return io_utils::format_janice_image(m, *format, image);
+    }
+
+    return cv_mat_to_janice_image(m, image, borrow);
+}
+
+inline JaniceError output_janice_batch(const std::vector<cv::Mat>& mats, JaniceImage* images, const JaniceImageFormat* format)
+{
+    if (format) {
+        return io_utils::format_janice_batch(mats, *format, images);
+    }
+
+    return cv_mats_to_janice_batch(mats, images);
+}
+
+// Return a level of the pyramid of a frame, lending it if borrow is set. The
+// levels stay cached in the pyramid either way.
+inline JaniceError output_pyramid_level(io_utils::FramePyramid& pyramid, uint32_t level, JaniceImage& image, bool borrow)
+{
+    cv::Mat m;
+    if (!pyramid.level(level, m)) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    return cv_mat_to_janice_image(m, image, borrow);
+}
+
+// Select the part of m inside rect, clipped to the image. The result shares
+// pixels with m.
+inline JaniceError crop(const cv::Mat& m, const JaniceRect& rect, cv::Mat& roi)
+{
+    cv::Rect bounds = cv::Rect(rect.x, rect.y, rect.width, rect.height) & cv::Rect(0, 0, m.cols, m.rows);
+    if (bounds.area() <= 0) {
+        return JANICE_OUT_OF_BOUNDS_ACCESS;
+    }
+
+    roi = m(bounds);
+    return JANICE_SUCCESS;
+}
+
+// Release an image returned by an opencv_io iterator, whether it owns its
+// buffer or borrows it from a decoded cv::Mat
+inline JaniceError free_janice_image(JaniceImage* image)
+{
+    if (!image || !image->data) {
+        return JANICE_SUCCESS;
+    }
+
+    if (image->owner) {
+        io_utils::BufferPool::instance().release(image->data);
+    } else {
+        BorrowedFrames::instance().release(image->data);
+    }
+    image->data = nullptr;
+
+    return JANICE_SUCCESS;
+}
+
+// Decode a still with cv::imread flags, reading the file as mode asks, see
+// JaniceIOOpenCVOptions::read_mode, or get it from the shared cache of decoded
+// stills. A descriptor from open_still_image is read instead of opening the
+// file again, and is always closed. Like cv::imread, returns an empty image if
+// the file can't be read or decoded.
+cv::Mat read_still_image(const std::string& filename, int flags, JaniceIOOpenCVReadMode mode, int fd = -1);
+
+// Get a still from the shared cache of decoded stills, see
+// janice_io_opencv_set_still_cache_size. Returns false if it isn't cached or
+// the cache is disabled.
+bool find_cached_still(const std::string& filename, int flags, cv::Mat& image);
+
+// Like read_still_image for a file that was already read into data. If another
+// thread is decoding the same still, waits for it instead of decoding data.
+// Returns an empty image if data can't be decoded.
+cv::Mat decode_still_image(const std::string& filename, int flags, const std::vector<uint8_t>& data);
+
+// Open a still that will be read soon with mode and have the kernel start
+// reading it ahead. Returns the descriptor to pass to read_still_image, or -1
+// if mode doesn't read through one or the file can't be opened.
+int open_still_image(const std::string& filename, JaniceIOOpenCVReadMode mode);
+
+// Create an iterator that decodes segments of a video concurrently, see
+// JaniceIOOpenCVOptions::decode_segments. Returns JANICE_INVALID_MEDIA for
+// stills and streams, which can't be split.
+JaniceError create_segmented_media_iterator(const char* filename,
+                                            const JaniceIOOpenCVOptions& options,
+                                            JaniceMediaIterator* it);
+
+bool is_segmented_media_iterator(const JaniceMediaIterator* it);
+
 } // namespace ocv_utils
 
 #endif // JANICE_IO_OPENCV_UTILS_HPP
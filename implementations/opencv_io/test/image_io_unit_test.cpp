@@ -1,7 +1,17 @@
 #include <janice_io_opencv.h>
 
+#include <opencv2/imgcodecs.hpp>
+
+#ifdef JANICE_IO_TEST_WITH_MEMORY_IO
+#include <janice_io_memory.h>
+#endif
+
+#include <chrono>
+#include <cstdio>
 #include <string>
 #include <cstring>
+#include <thread>
+#include <vector>
 
 // ----------------------------------------------------------------------------
 // Helpful macros for repeated checks
@@ -178,20 +188,1911 @@ int check_media_pixel_values(const char* filename)
 }
 
 // ----------------------------------------------------------------------------
-// Main test function
+// Check region of interest access
 
-int main(int, char*[])
+int check_media_roi(const char* filename)
 {
-    const string test_image = "media/test_image.png";
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &it),
+                // Cleanup
+                [](){})
 
-    // Check that an iterator can be created and its functions work as expected
-    // for an image
-    if (check_media_iterator(test_image.c_str()) == 1)
-        return 1;
+    CHECK(it.get_roi != nullptr,
+          "opencv_io iterators should support get_roi",
+          [&]() {
+              it.free(&it);
+          })
 
-    // Check the loaded pixel values of the test image
-    if (check_media_pixel_values(test_image.c_str()) == 1)
+    // The center block of the test image, extending past the right edge
+    JaniceRect rect;
+    rect.x = 100;
+    rect.y = 100;
+    rect.width = 300;
+    rect.height = 100;
+
+    JaniceImage image;
+    JANICE_CALL(it.get_roi(&it, &image, 0, &rect),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                })
+
+    auto cleanup = [&]() {
+        it.free_image(&image);
+        it.free(&it);
+    };
+
+    CHECK(image.rows == 100 && image.cols == 200,
+          "The region should be clipped to the image",
+          cleanup)
+
+    CHECK(check_pixel(&image,  50, 50, 127, 127,   0) == 0,
+          "Pixel mismatch",
+          cleanup)
+    CHECK(check_pixel(&image, 150, 50, 127,   0, 127) == 0,
+          "Pixel mismatch",
+          cleanup)
+
+    cleanup();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check batched reads
+
+int check_media_batch(const char* filename)
+{
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &it),
+                // Cleanup
+                [](){})
+
+    CHECK(it.next_batch != nullptr,
+          "opencv_io iterators should support next_batch",
+          [&]() {
+              it.free(&it);
+          })
+
+    JaniceImage images[4];
+    uint32_t num_images = 0;
+    JANICE_CALL(it.next_batch(&it, images, 4, &num_images),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                })
+
+    CHECK(num_images == 1,
+          "A batch from an image should hold exactly one image",
+          [&]() {
+              for (uint32_t i = 0; i < num_images; ++i) {
+                  it.free_image(&images[i]);
+              }
+              it.free(&it);
+          })
+
+    auto cleanup = [&]() {
+        it.free_image(&images[0]);
+        it.free(&it);
+    };
+
+    CHECK(check_pixel(&images[0], 250, 250, 255, 255, 255) == 0,
+          "Pixel mismatch",
+          cleanup)
+
+    JaniceImage extra;
+    CHECK(it.next_batch(&it, &extra, 1, &num_images) == JANICE_MEDIA_AT_END && num_images == 0,
+          "Calling next_batch after the last image should return JANICE_MEDIA_AT_END",
+          cleanup)
+
+    cleanup();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check borrowed frames
+
+int check_borrowed_media(const char* filename)
+{
+    JaniceIOOpenCVOptions options;
+    JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                // Cleanup
+                [](){})
+    options.borrow_frames = true;
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it),
+                // Cleanup
+                [](){})
+
+    JaniceImage image;
+    CHECK(it.next(&it, &image) == JANICE_SUCCESS,
+          "Calling next on a borrowing media iterator for an image should return JANICE_SUCCESS",
+          // Cleanup
+          [&]() {
+              it.free(&it);
+          })
+
+    auto cleanup = [&]() {
+        it.free_image(&image);
+        it.free(&it);
+    };
+
+    CHECK(!image.owner,
+          "Borrowed frames should not own their pixel data",
+          cleanup)
+
+    CHECK(check_pixel(&image, 250, 250, 255, 255, 255) == 0,
+          "Pixel mismatch",
+          cleanup)
+
+    JANICE_CALL(it.free_image(&image),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                })
+
+    CHECK(image.data == nullptr,
+          "free_image should release a borrowed frame",
+          [&]() {
+              it.free(&it);
+          })
+
+    it.free(&it);
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check that a cached still is only decoded once
+
+int check_cached_still(const char* filename)
+{
+    JaniceIOOpenCVOptions options;
+    JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                // Cleanup
+                [](){})
+    options.borrow_frames = true;
+    options.cache_stills = true;
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it),
+                // Cleanup
+                [](){})
+
+    JaniceImage first, second;
+    JANICE_CALL(it.get(&it, &first, 0),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                })
+
+    JANICE_CALL(it.reset(&it),
+                // Cleanup
+                [&]() {
+                    it.free_image(&first);
+                    it.free(&it);
+                })
+
+    JANICE_CALL(it.next(&it, &second),
+                // Cleanup
+                [&]() {
+                    it.free_image(&first);
+                    it.free(&it);
+                })
+
+    auto cleanup = [&]() {
+        it.free_image(&first);
+        it.free_image(&second);
+        it.free(&it);
+    };
+
+    CHECK(first.data == second.data,
+          "A cached, borrowed still should share one decoded buffer",
+          cleanup)
+
+    CHECK(check_pixel(&second, 50, 50, 0, 0, 255) == 0,
+          "Pixel mismatch",
+          cleanup)
+
+    cleanup();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check frames converted to a requested format
+
+int check_formatted_media(const char* filename)
+{
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &it),
+                // Cleanup
+                [](){})
+
+    CHECK(it.set_format != nullptr,
+          "opencv_io iterators should support set_format",
+          [&]() {
+              it.free(&it);
+          })
+
+    // Planar RGB floats in [0, 1] at the size of the media
+    JaniceImageFormat format;
+    format.rows = 0;
+    format.cols = 0;
+    format.channel_order = JaniceChannelsRGB;
+    format.planar = true;
+    format.pixel_type = JanicePixelFloat32;
+    for (int c = 0; c < 3; ++c) {
+        format.mean[c] = 0.0f;
+        format.scale[c] = 1.0f / 255.0f;
+    }
+
+    JANICE_CALL(it.set_format(&it, &format),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                })
+
+    JaniceImage image;
+    JANICE_CALL(it.next(&it, &image),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                })
+
+    auto cleanup = [&]() {
+        it.free_image(&image);
+        it.free(&it);
+    };
+
+    CHECK(image.channels == 3 && image.owner,
+          "A formatted frame should be a new three channel buffer",
+          cleanup)
+
+    // The pixel at (50, 50) is pure blue, the last plane in RGB order
+    const float* data = (const float*) image.data;
+    const size_t plane = image.rows * image.cols;
+    const size_t index = 50 * image.cols + 50;
+    CHECK(data[index] < 0.01f && data[plane + index] < 0.01f && data[2 * plane + index] > 0.99f,
+          "Formatted pixel mismatch",
+          cleanup)
+
+    format.channel_order = JaniceChannelsGray;
+    format.rows = 1;
+    format.cols = 0;
+    CHECK(it.set_format(&it, &format) == JANICE_BAD_ARGUMENT,
+          "set_format should reject a format with only one dimension",
+          cleanup)
+
+    cleanup();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check image pyramids
+
+int check_media_pyramid(const char* filename)
+{
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &it),
+                // Cleanup
+                [](){})
+
+    CHECK(it.get_pyramid != nullptr,
+          "opencv_io iterators should support get_pyramid",
+          [&]() {
+              it.free(&it);
+          })
+
+    JaniceImage image;
+    JANICE_CALL(it.next(&it, &image),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                })
+
+    JaniceImage level;
+    JANICE_CALL(it.get_pyramid(&it, &level, 0, 1),
+                // Cleanup
+                [&]() {
+                    it.free_image(&image);
+                    it.free(&it);
+                })
+
+    auto cleanup = [&]() {
+        it.free_image(&level);
+        it.free_image(&image);
+        it.free(&it);
+    };
+
+    CHECK(level.rows == (image.rows + 1) / 2 && level.cols == (image.cols + 1) / 2 && level.channels == image.channels,
+          "Each pyramid level should be half the size of the one before",
+          cleanup)
+
+    JaniceImage deepest;
+    CHECK(it.get_pyramid(&it, &deepest, 0, 64) == JANICE_OUT_OF_BOUNDS_ACCESS,
+          "Asking for a level past the end of the pyramid should return JANICE_OUT_OF_BOUNDS_ACCESS",
+          cleanup)
+
+    cleanup();
+
+    return 0;
+}
+
+int check_still_cache(const char* filename)
+{
+    JANICE_CALL(janice_io_opencv_set_still_cache_size(64 * 1024 * 1024),
+                // Cleanup
+                [](){})
+
+    auto cleanup = []() {
+        janice_io_opencv_set_still_cache_size(0);
+    };
+
+    uint64_t hits_before, misses_before;
+    JANICE_CALL(janice_io_opencv_get_still_cache_stats(&hits_before, &misses_before, nullptr),
+                cleanup)
+
+    // The same file read by a regular iterator and twice by a sparse one
+    const char* filenames[] = { filename, filename };
+
+    JaniceMediaIterator it, sparse_it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &it),
+                cleanup)
+    JANICE_CALL(janice_io_opencv_create_sparse_media_iterator(filenames, 2, &sparse_it),
+                [&]() {
+                    it.free(&it);
+                    cleanup();
+                })
+
+    auto free_iterators = [&]() {
+        sparse_it.free(&sparse_it);
+        it.free(&it);
+        cleanup();
+    };
+
+    JaniceImage images[3];
+    JANICE_CALL(it.next(&it, &images[0]),
+                free_iterators)
+    JANICE_CALL(sparse_it.next(&sparse_it, &images[1]),
+                [&]() {
+                    it.free_image(&images[0]);
+                    free_iterators();
+                })
+    JANICE_CALL(sparse_it.next(&sparse_it, &images[2]),
+                [&]() {
+                    sparse_it.free_image(&images[1]);
+                    it.free_image(&images[0]);
+                    free_iterators();
+                })
+
+    auto free_all = [&]() {
+        sparse_it.free_image(&images[2]);
+        sparse_it.free_image(&images[1]);
+        it.free_image(&images[0]);
+        free_iterators();
+    };
+
+    uint64_t hits, misses;
+    size_t cached_bytes;
+    JANICE_CALL(janice_io_opencv_get_still_cache_stats(&hits, &misses, &cached_bytes),
+                free_all)
+
+    CHECK(misses - misses_before == 1 && hits - hits_before == 2,
+          "A still read by several iterators should only be decoded once",
+          free_all)
+
+    CHECK(cached_bytes == (size_t) images[0].rows * images[0].cols * images[0].channels,
+          "The cache should hold the decoded still",
+          free_all)
+
+    JANICE_CALL(janice_io_opencv_set_still_cache_size(0),
+                free_all)
+    JANICE_CALL(janice_io_opencv_get_still_cache_stats(nullptr, nullptr, &cached_bytes),
+                free_all)
+
+    CHECK(cached_bytes == 0,
+          "Disabling the cache should drop every still",
+          free_all)
+
+    free_all();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Compare frames read through different paths
+
+static bool same_image(const JaniceImage& a, const JaniceImage& b)
+{
+    return a.channels == b.channels && a.rows == b.rows && a.cols == b.cols &&
+           memcmp(a.data, b.data, (size_t) a.channels * a.rows * a.cols) == 0;
+}
+
+static bool same_image(const JaniceImage& image, const cv::Mat& expected)
+{
+    return expected.isContinuous() && (int) image.channels == expected.channels() &&
+           (int) image.rows == expected.rows && (int) image.cols == expected.cols &&
+           memcmp(image.data, expected.data, expected.total() * expected.elemSize()) == 0;
+}
+
+// Read the next frame of it and of expected and check they have the same pixels
+static int check_same_next(JaniceMediaIterator* it, JaniceMediaIterator* expected, const char* msg)
+{
+    JaniceImage reference;
+    JANICE_CALL(expected->next(expected, &reference),
+                // Cleanup
+                [](){})
+
+    JaniceImage image;
+    JANICE_CALL(it->next(it, &image),
+                // Cleanup
+                [&]() {
+                    expected->free_image(&reference);
+                })
+
+    const bool same = same_image(image, reference);
+    it->free_image(&image);
+    expected->free_image(&reference);
+
+    CHECK(same,
+          msg,
+          // Cleanup
+          [](){})
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check stills read in batches by a sparse iterator
+
+int check_batched_sparse_media(const char* filename)
+{
+    const size_t num_files = 8;
+    vector<const char*> filenames(num_files, filename);
+
+    JaniceIOOpenCVOptions options;
+    JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                // Cleanup
+                [](){})
+    options.read_mode = JaniceIOOpenCVReadBatched;
+    options.prefetch_frames = 4;
+
+    JaniceMediaIterator it, plain;
+    JANICE_CALL(janice_io_opencv_create_sparse_media_iterator_with_options(filenames.data(), num_files, &options, &it),
+                // Cleanup
+                [](){})
+    JANICE_CALL(janice_io_opencv_create_sparse_media_iterator(filenames.data(), num_files, &plain),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                })
+
+    auto cleanup = [&]() {
+        plain.free(&plain);
+        it.free(&it);
+    };
+
+    for (size_t i = 0; i < num_files; ++i) {
+        if (check_same_next(&it, &plain, "Stills read in batches should match stills read one at a time") == 1) {
+            cleanup();
+            return 1;
+        }
+    }
+
+    JaniceImage image;
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a sparse iterator should return JANICE_MEDIA_AT_END after the last file",
+          // Cleanup
+          cleanup)
+
+    cleanup();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check a sparse iterator that prefetches within a memory limit
+
+// Read the next image of it and of plain and check both are expected
+static int check_next_image(JaniceMediaIterator* it, JaniceMediaIterator* plain, const cv::Mat& expected, const char* msg)
+{
+    JaniceImage reference;
+    JANICE_CALL(plain->next(plain, &reference),
+                // Cleanup
+                [](){})
+
+    JaniceImage image;
+    JANICE_CALL(it->next(it, &image),
+                // Cleanup
+                [&]() {
+                    plain->free_image(&reference);
+                })
+
+    const bool same = same_image(image, reference) && same_image(image, expected);
+    it->free_image(&image);
+    plain->free_image(&reference);
+
+    CHECK(same,
+          msg,
+          // Cleanup
+          [](){})
+
+    return 0;
+}
+
+int check_prefetched_sparse_media(const char* filename)
+{
+    const cv::Mat still = cv::imread(filename, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
+    CHECK(still.data != nullptr,
+          "OpenCV should be able to read the test image",
+          // Cleanup
+          [](){})
+
+    // Copies of the still between two crops of it, so images that come back
+    // out of order are seen
+    const char* wide = "test_prefetch_wide.png";
+    const char* tall = "test_prefetch_tall.png";
+    const cv::Mat wide_crop = still(cv::Rect(0, 100, 300, 50)).clone();
+    const cv::Mat tall_crop = still(cv::Rect(150, 0, 100, 250)).clone();
+
+    auto remove_crops = [&]() {
+        remove(wide);
+        remove(tall);
+    };
+
+    CHECK(cv::imwrite(wide, wide_crop) && cv::imwrite(tall, tall_crop),
+          "OpenCV should be able to write a crop of the test image",
+          // Cleanup
+          remove_crops)
+
+    const char* filenames[] = { filename, wide, filename, filename, tall, wide, filename, tall, filename, filename };
+    const cv::Mat expected[] = { still, wide_crop, still, still, tall_crop, wide_crop, still, tall_crop, still, still };
+    const size_t num_files = 10;
+
+    // Room for two decoded stills, well short of the files prefetch_frames
+    // asks for
+    JaniceIOOpenCVOptions options;
+    JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                // Cleanup
+                remove_crops)
+    options.prefetch_frames = 6;
+    options.prefetch_memory_limit = 2 * still.total() * still.elemSize() + 1000;
+
+    JaniceMediaIterator it, plain;
+    JANICE_CALL(janice_io_opencv_create_sparse_media_iterator_with_options(filenames, num_files, &options, &it),
+                // Cleanup
+                remove_crops)
+    JANICE_CALL(janice_io_opencv_create_sparse_media_iterator(filenames, num_files, &plain),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                    remove_crops();
+                })
+
+    auto cleanup = [&]() {
+        plain.free(&plain);
+        it.free(&it);
+        remove_crops();
+    };
+
+    for (size_t i = 0; i < num_files; ++i) {
+        if (check_next_image(&it, &plain, expected[i], "A prefetching sparse iterator should return the same images in the same order as a plain one") == 1) {
+            cleanup();
+            return 1;
+        }
+    }
+
+    JaniceImage image;
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a prefetching sparse iterator should return JANICE_MEDIA_AT_END after the last file",
+          // Cleanup
+          cleanup)
+
+    // Seeking back flushes what was prefetched and starts again from there
+    JANICE_CALL(it.seek(&it, 3),
+                // Cleanup
+                cleanup)
+    JANICE_CALL(plain.seek(&plain, 3),
+                // Cleanup
+                cleanup)
+
+    for (size_t i = 3; i < num_files; ++i) {
+        if (check_next_image(&it, &plain, expected[i], "A prefetching sparse iterator should return the same images as a plain one after seeking back") == 1) {
+            cleanup();
+            return 1;
+        }
+    }
+
+    cleanup();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check stills decoded at a reduced resolution
+
+int check_decode_scale(const char* filename)
+{
+    const cv::Mat still = cv::imread(filename, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
+    const cv::Mat reduced = cv::imread(filename, cv::IMREAD_REDUCED_COLOR_2 | cv::IMREAD_IGNORE_ORIENTATION);
+    CHECK(still.data != nullptr && reduced.data != nullptr,
+          "OpenCV should be able to read the test image",
+          // Cleanup
+          [](){})
+
+    JaniceIOOpenCVOptions options;
+    JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                // Cleanup
+                [](){})
+    options.decode_scale = 2;
+
+    const char* filenames[] = { filename, filename };
+    JaniceMediaIterator its[2];
+    JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &its[0]),
+                // Cleanup
+                [](){})
+    JANICE_CALL(janice_io_opencv_create_sparse_media_iterator_with_options(filenames, 2, &options, &its[1]),
+                // Cleanup
+                [&]() {
+                    its[0].free(&its[0]);
+                })
+
+    auto cleanup = [&]() {
+        its[0].free(&its[0]);
+        its[1].free(&its[1]);
+    };
+
+    uint32_t scale;
+    JANICE_CALL(janice_io_opencv_get_decode_scale(&its[0], &scale),
+                // Cleanup
+                cleanup)
+
+    CHECK(scale == 2,
+          "janice_io_opencv_get_decode_scale on a still should return the decode scale it was created with",
+          // Cleanup
+          cleanup)
+
+    for (JaniceMediaIterator& it : its) {
+        JaniceImage image;
+        JANICE_CALL(it.next(&it, &image),
+                    // Cleanup
+                    cleanup)
+
+        const bool halved = image.rows == (uint32_t) (still.rows + 1) / 2 &&
+                            image.cols == (uint32_t) (still.cols + 1) / 2;
+        const bool same = same_image(image, reduced);
+        it.free_image(&image);
+
+        CHECK(halved,
+              "A still decoded at scale 2 should have half the rows and columns, rounded up",
+              // Cleanup
+              cleanup)
+
+        CHECK(same,
+              "A still decoded at scale 2 should have the pixels of cv::imread at the same scale",
+              // Cleanup
+              cleanup)
+    }
+
+    cleanup();
+
+    // Only powers of two up to 8 are supported
+    options.decode_scale = 3;
+
+    JaniceMediaIterator it;
+    CHECK(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it) == JANICE_BAD_ARGUMENT,
+          "Creating an iterator with a decode scale of 3 should return JANICE_BAD_ARGUMENT",
+          // Cleanup
+          [](){})
+
+    CHECK(janice_io_opencv_create_sparse_media_iterator_with_options(filenames, 2, &options, &it) == JANICE_BAD_ARGUMENT,
+          "Creating a sparse iterator with a decode scale of 3 should return JANICE_BAD_ARGUMENT",
+          // Cleanup
+          [](){})
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check that every way of reading a still decodes the same pixels
+
+int check_read_modes(const char* filename)
+{
+    const cv::Mat expected = cv::imread(filename, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
+    CHECK(expected.data != nullptr,
+          "OpenCV should be able to read the test image",
+          // Cleanup
+          [](){})
+
+    const JaniceIOOpenCVReadMode modes[] = { JaniceIOOpenCVReadImread,
+                                             JaniceIOOpenCVReadMapped,
+                                             JaniceIOOpenCVReadWhole,
+                                             JaniceIOOpenCVReadBatched };
+
+    for (JaniceIOOpenCVReadMode mode : modes) {
+        JaniceIOOpenCVOptions options;
+        JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                    // Cleanup
+                    [](){})
+        options.read_mode = mode;
+
+        JaniceMediaIterator it;
+        JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it),
+                    // Cleanup
+                    [](){})
+
+        JaniceImage image;
+        JANICE_CALL(it.next(&it, &image),
+                    // Cleanup
+                    [&]() {
+                        it.free(&it);
+                    })
+
+        const bool same = same_image(image, expected);
+        it.free_image(&image);
+        it.free(&it);
+
+        CHECK(same,
+              "A still read with any read mode should match cv::imread",
+              // Cleanup
+              [](){})
+
+        // Sparse iterators open the files they queue ahead of time
+        const size_t num_files = 3;
+        vector<const char*> filenames(num_files, filename);
+        options.prefetch_frames = 2;
+
+        JANICE_CALL(janice_io_opencv_create_sparse_media_iterator_with_options(filenames.data(), num_files, &options, &it),
+                    // Cleanup
+                    [](){})
+
+        for (size_t i = 0; i < num_files; ++i) {
+            JANICE_CALL(it.next(&it, &image),
+                        // Cleanup
+                        [&]() {
+                            it.free(&it);
+                        })
+
+            const bool same_sparse = same_image(image, expected);
+            it.free_image(&image);
+
+            CHECK(same_sparse,
+                  "A still prefetched by a sparse iterator with any read mode should match cv::imread",
+                  // Cleanup
+                  [&]() {
+                      it.free(&it);
+                  })
+        }
+
+        it.free(&it);
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check a still read as tiles
+
+int check_tiled_still(const char* filename)
+{
+    const cv::Mat still = cv::imread(filename, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
+    CHECK(still.rows == 300 && still.cols == 300,
+          "OpenCV should be able to read the test image",
+          // Cleanup
+          [](){})
+
+    // Neither size divides the 300x300 still. Columns start at 0 and 112,
+    // and the last one is pulled back to 172 to end at the edge. Rows start
+    // at 0, 80 and 160, and the last one at 204.
+    const uint32_t tile_width = 128, tile_height = 96, overlap = 16;
+    const uint32_t xs[] = { 0, 112, 172 };
+    const uint32_t ys[] = { 0, 80, 160, 204 };
+    const uint32_t num_tiles = 12;
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_tiled_media_iterator(filename, tile_width, tile_height, overlap, &it),
+                // Cleanup
+                [](){})
+
+    auto cleanup = [&]() {
+        it.free(&it);
+    };
+
+    // The grid comes from the PNG header, before anything is decoded
+    for (uint32_t tile = 0; tile < num_tiles; ++tile) {
+        uint32_t x, y;
+        JANICE_CALL(janice_io_opencv_get_tile_offset(&it, tile, &x, &y),
+                    // Cleanup
+                    cleanup)
+
+        CHECK(x == xs[tile % 3] && y == ys[tile / 3],
+              "Tiles should overlap by the given amount, with the last in each direction ending at the edge",
+              // Cleanup
+              cleanup)
+    }
+
+    uint32_t x, y;
+    CHECK(janice_io_opencv_get_tile_offset(&it, num_tiles, &x, &y) == JANICE_OUT_OF_BOUNDS_ACCESS,
+          "janice_io_opencv_get_tile_offset past the last tile should return JANICE_OUT_OF_BOUNDS_ACCESS",
+          // Cleanup
+          cleanup)
+
+    // Each tile is the crop of the still at its offset
+    JaniceImage image;
+    for (uint32_t tile = 0; tile < num_tiles; ++tile) {
+        JANICE_CALL(it.next(&it, &image),
+                    // Cleanup
+                    cleanup)
+
+        const cv::Rect rect(xs[tile % 3], ys[tile / 3], tile_width, tile_height);
+        const bool same = same_image(image, still(rect).clone());
+        it.free_image(&image);
+
+        CHECK(same,
+              "A tile should hold the pixels of the still at its offset",
+              // Cleanup
+              cleanup)
+    }
+
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a tiled iterator should return JANICE_MEDIA_AT_END after the last tile",
+          // Cleanup
+          cleanup)
+
+    // Regions are relative to the tile and clipped to it
+    JaniceRect rect;
+    rect.x = 10;
+    rect.y = 20;
+    rect.width = 200;
+    rect.height = 40;
+    JANICE_CALL(it.get_roi(&it, &image, 4, &rect),
+                // Cleanup
+                cleanup)
+
+    const bool same_roi = same_image(image, still(cv::Rect(xs[1] + 10, ys[1] + 20, tile_width - 10, 40)).clone());
+    it.free_image(&image);
+
+    CHECK(same_roi,
+          "get_roi on a tiled iterator should take a region of the tile, clipped to the tile",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+
+    // A still that no longer has the size its header gave when the grid was
+    // laid out is rejected instead of cut with the wrong grid
+    const char* changing = "test_tiled_changing.png";
+    CHECK(cv::imwrite(changing, still),
+          "OpenCV should be able to write a copy of the test image",
+          // Cleanup
+          [](){})
+
+    JANICE_CALL(janice_io_opencv_create_tiled_media_iterator(changing, tile_width, tile_height, overlap, &it),
+                // Cleanup
+                [&]() {
+                    remove(changing);
+                })
+
+    auto free_and_remove = [&]() {
+        it.free(&it);
+        remove(changing);
+    };
+
+    uint32_t frame;
+    JANICE_CALL(it.tell(&it, &frame),
+                // Cleanup
+                free_and_remove)
+
+    CHECK(cv::imwrite(changing, still(cv::Rect(0, 0, 200, 150)).clone()),
+          "OpenCV should be able to write a crop of the test image",
+          // Cleanup
+          free_and_remove)
+
+    CHECK(it.next(&it, &image) == JANICE_INVALID_MEDIA,
+          "A tiled still that decodes to a different size than its header said should return JANICE_INVALID_MEDIA",
+          // Cleanup
+          free_and_remove)
+
+    free_and_remove();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check a sparse iterator over frames given out of order
+
+int check_sparse_find_frame(const char* filename)
+{
+    const cv::Mat still = cv::imread(filename, cv::IMREAD_ANYCOLOR | cv::IMREAD_IGNORE_ORIENTATION);
+    CHECK(still.data != nullptr,
+          "OpenCV should be able to read the test image",
+          // Cleanup
+          [](){})
+
+    // Crops of different widths, so the order they come back in can be
+    // seen. Crops 1 and 3 were both taken from frame 20, so they keep their
+    // order.
+    const char* filenames[] = { "test_find_frame_0.png", "test_find_frame_1.png",
+                                "test_find_frame_2.png", "test_find_frame_3.png" };
+    const uint32_t frames[] = { 40, 20, 60, 20 };
+    cv::Mat crops[4];
+
+    auto remove_crops = [&]() {
+        for (const char* crop : filenames) {
+            remove(crop);
+        }
+    };
+
+    for (int i = 0; i < 4; ++i) {
+        crops[i] = still(cv::Rect(0, 0, 50 * (i + 1), 100)).clone();
+        CHECK(cv::imwrite(filenames[i], crops[i]),
+              "OpenCV should be able to write a crop of the test image",
+              // Cleanup
+              remove_crops)
+    }
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_sparse_media_iterator_with_frames(filenames, frames, 4, nullptr, &it),
+                // Cleanup
+                remove_crops)
+
+    auto cleanup = [&]() {
+        it.free(&it);
+        remove_crops();
+    };
+
+    // Images are iterated in frame order, equal frames in the order given
+    const int sorted[] = { 1, 3, 0, 2 };
+    const uint32_t sorted_frames[] = { 20, 20, 40, 60 };
+
+    JaniceImage image;
+    for (uint32_t i = 0; i < 4; ++i) {
+        JANICE_CALL(it.next(&it, &image),
+                    // Cleanup
+                    cleanup)
+
+        const bool in_order = same_image(image, crops[sorted[i]]);
+        it.free_image(&image);
+
+        uint32_t physical;
+        JANICE_CALL(it.physical_frame(&it, i, &physical),
+                    // Cleanup
+                    cleanup)
+
+        CHECK(in_order && physical == sorted_frames[i],
+              "A sparse iterator with frames should return its images sorted by frame, keeping the order of equal frames",
+              // Cleanup
+              cleanup)
+    }
+
+    // An exact hit, the first of two images from one frame, a frame between
+    // images and a frame past the last image
+    uint32_t logical;
+    JANICE_CALL(janice_io_opencv_sparse_find_frame(&it, 40, &logical),
+                // Cleanup
+                cleanup)
+
+    CHECK(logical == 2,
+          "janice_io_opencv_sparse_find_frame should find the image taken from a frame",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(janice_io_opencv_sparse_find_frame(&it, 20, &logical),
+                // Cleanup
+                cleanup)
+
+    CHECK(logical == 0,
+          "janice_io_opencv_sparse_find_frame should find the first of the images taken from a frame",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(janice_io_opencv_sparse_find_frame(&it, 41, &logical),
+                // Cleanup
+                cleanup)
+
+    CHECK(logical == 3,
+          "janice_io_opencv_sparse_find_frame should find the next image after a frame without one",
+          // Cleanup
+          cleanup)
+
+    CHECK(janice_io_opencv_sparse_find_frame(&it, 61, &logical) == JANICE_OUT_OF_BOUNDS_ACCESS,
+          "janice_io_opencv_sparse_find_frame past the last image should return JANICE_OUT_OF_BOUNDS_ACCESS",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+    remove_crops();
+
+    // Only sparse iterators have frames to search
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &it),
+                // Cleanup
+                [](){})
+
+    CHECK(janice_io_opencv_sparse_find_frame(&it, 0, &logical) == JANICE_BAD_ARGUMENT,
+          "janice_io_opencv_sparse_find_frame on an iterator that isn't sparse should return JANICE_BAD_ARGUMENT",
+          // Cleanup
+          [&]() {
+              it.free(&it);
+          })
+
+    it.free(&it);
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check video iterators against frames decoded in order by a plain iterator
+
+typedef vector<vector<uint8_t>> Frames;
+
+static int read_video_frames(const char* filename, Frames& frames)
+{
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &it),
+                // Cleanup
+                [](){})
+
+    JaniceImage image;
+    JaniceError status;
+    while ((status = it.next(&it, &image)) == JANICE_SUCCESS) {
+        frames.emplace_back(image.data, image.data + (size_t) image.channels * image.rows * image.cols);
+        it.free_image(&image);
+    }
+    it.free(&it);
+
+    CHECK(status == JANICE_MEDIA_AT_END && !frames.empty(),
+          "A plain iterator should read every frame of the test video",
+          // Cleanup
+          [](){})
+
+    return 0;
+}
+
+static bool same_frame(const JaniceImage& image, const vector<uint8_t>& expected)
+{
+    return (size_t) image.channels * image.rows * image.cols == expected.size() &&
+           memcmp(image.data, expected.data(), expected.size()) == 0;
+}
+
+// Check that tell is at frame, then read the next frame of it and check it
+// is that frame of the video
+static int check_next_frame(JaniceMediaIterator* it, const Frames& frames, uint32_t frame, const char* msg)
+{
+    uint32_t position;
+    JANICE_CALL(it->tell(it, &position),
+                // Cleanup
+                [](){})
+
+    CHECK(position == frame,
+          "tell should return the frame next reads",
+          // Cleanup
+          [](){})
+
+    JaniceImage image;
+    JANICE_CALL(it->next(it, &image),
+                // Cleanup
+                [](){})
+
+    const bool same = same_frame(image, frames[frame]);
+    it->free_image(&image);
+
+    CHECK(same,
+          msg,
+          // Cleanup
+          [](){})
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check videos decoded ahead on a background thread
+
+int check_prefetched_video(const char* filename, const Frames& frames)
+{
+    const uint32_t num_frames = frames.size();
+
+    // The memory limit only applies to sparse and segmented iterators, it
+    // mustn't hold back a video's queue
+    JaniceIOOpenCVOptions options;
+    JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                // Cleanup
+                [](){})
+    options.prefetch_frames = 8;
+    options.prefetch_memory_limit = frames[0].size();
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it),
+                // Cleanup
+                [](){})
+
+    auto cleanup = [&]() {
+        it.free(&it);
+    };
+
+    const char* msg = "A prefetching iterator should return the frames of a plain iterator";
+    for (uint32_t i = 0; i < 3; ++i) {
+        if (check_next_frame(&it, frames, i, msg) == 1) {
+            cleanup();
+            return 1;
+        }
+    }
+
+    // Give the worker time to fill its queue, then seek into it
+    this_thread::sleep_for(chrono::milliseconds(100));
+
+    JANICE_CALL(it.seek(&it, 6),
+                // Cleanup
+                cleanup)
+    if (check_next_frame(&it, frames, 6, msg) == 1 ||
+        check_next_frame(&it, frames, 7, msg) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    // Past the queue, across a keyframe, and back to before it
+    JANICE_CALL(it.seek(&it, 60),
+                // Cleanup
+                cleanup)
+    if (check_next_frame(&it, frames, 60, msg) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    JANICE_CALL(it.seek(&it, 20),
+                // Cleanup
+                cleanup)
+
+    for (uint32_t i = 20; i < num_frames; ++i) {
+        if (check_next_frame(&it, frames, i, msg) == 1) {
+            cleanup();
+            return 1;
+        }
+    }
+
+    JaniceImage image;
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a prefetching iterator should return JANICE_MEDIA_AT_END after the last frame",
+          // Cleanup
+          cleanup)
+
+    it.free(&it);
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check the end of a video
+
+// Read from frame first to the end of the video, checking tell after each read
+static int check_read_to_end(JaniceMediaIterator* it, uint32_t first, uint32_t num_frames)
+{
+    JaniceImage image;
+    uint32_t frame;
+    for (uint32_t i = first; i < num_frames; ++i) {
+        JANICE_CALL(it->next(it, &image),
+                    // Cleanup
+                    [](){})
+        it->free_image(&image);
+
+        JANICE_CALL(it->tell(it, &frame),
+                    // Cleanup
+                    [](){})
+
+        CHECK(frame == i + 1,
+              "tell after next should return the number of the following frame",
+              // Cleanup
+              [](){})
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        CHECK(it->next(it, &image) == JANICE_MEDIA_AT_END,
+              "next after the last frame of a video should return JANICE_MEDIA_AT_END",
+              // Cleanup
+              [](){})
+    }
+
+    JANICE_CALL(it->tell(it, &frame),
+                // Cleanup
+                [](){})
+
+    CHECK(frame == num_frames,
+          "tell at the end of a video should return the frame count",
+          // Cleanup
+          [](){})
+
+    return 0;
+}
+
+int check_video_end(const char* filename, uint32_t num_frames)
+{
+    // With and without decoding ahead
+    const uint32_t prefetch_frames[] = { 0, 4 };
+    for (uint32_t prefetch : prefetch_frames) {
+        JaniceIOOpenCVOptions options;
+        JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                    // Cleanup
+                    [](){})
+        options.prefetch_frames = prefetch;
+
+        JaniceMediaIterator it;
+        JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it),
+                    // Cleanup
+                    [](){})
+
+        auto cleanup = [&]() {
+            it.free(&it);
+        };
+
+        if (check_read_to_end(&it, 0, num_frames) == 1) {
+            cleanup();
+            return 1;
+        }
+
+        CHECK(it.seek(&it, num_frames) == JANICE_OUT_OF_BOUNDS_ACCESS,
+              "seek past the last frame of a video should return JANICE_OUT_OF_BOUNDS_ACCESS",
+              // Cleanup
+              cleanup)
+
+        JANICE_CALL(it.seek(&it, num_frames - 2),
+                    // Cleanup
+                    cleanup)
+        if (check_read_to_end(&it, num_frames - 2, num_frames) == 1) {
+            cleanup();
+            return 1;
+        }
+
+        JANICE_CALL(it.reset(&it),
+                    // Cleanup
+                    cleanup)
+
+        uint32_t frame;
+        JANICE_CALL(it.tell(&it, &frame),
+                    // Cleanup
+                    cleanup)
+
+        CHECK(frame == 0,
+              "tell after reset should return the first frame",
+              // Cleanup
+              cleanup)
+
+        if (check_read_to_end(&it, 0, num_frames) == 1) {
+            cleanup();
+            return 1;
+        }
+
+        it.free(&it);
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check iterators whose videos are closed to stay under the open decoder limit
+
+int check_decoder_limit(const char* filename, const Frames& frames)
+{
+    JANICE_CALL(janice_io_opencv_set_max_open_decoders(1),
+                // Cleanup
+                [](){})
+
+    JaniceMediaIterator first, second;
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &first),
+                // Cleanup
+                []() {
+                    janice_io_opencv_set_max_open_decoders(64);
+                })
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &second),
+                // Cleanup
+                [&]() {
+                    first.free(&first);
+                    janice_io_opencv_set_max_open_decoders(64);
+                })
+
+    auto cleanup = [&]() {
+        second.free(&second);
+        first.free(&first);
+        janice_io_opencv_set_max_open_decoders(64);
+    };
+
+    // Each read closes the other iterator's video, which is reopened where it
+    // left off on its next read
+    const uint32_t offset = 45;
+    JANICE_CALL(second.seek(&second, offset),
+                // Cleanup
+                cleanup)
+
+    const char* msg = "An iterator whose video was closed by another should go on where it left off";
+    for (uint32_t i = 0; i + offset < frames.size(); ++i) {
+        if (check_next_frame(&first, frames, i, msg) == 1 ||
+            check_next_frame(&second, frames, i + offset, msg) == 1) {
+            cleanup();
+            return 1;
+        }
+
+        // Random access in between doesn't move either iterator
+        if (i == 20) {
+            JaniceImage image;
+            JANICE_CALL(second.get(&second, &image, 10),
+                        // Cleanup
+                        cleanup)
+
+            const bool same = same_frame(image, frames[10]);
+            second.free_image(&image);
+
+            CHECK(same,
+                  "get on an iterator whose video was closed should return the frame asked for",
+                  // Cleanup
+                  cleanup)
+        }
+    }
+
+    cleanup();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check random access through a saved keyframe index
+
+int check_keyframe_index(const char* filename)
+{
+    const char* index = "test_video_index.keyframes";
+    remove(index);
+
+    JaniceIOOpenCVOptions options;
+    JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                // Cleanup
+                [](){})
+    options.keyframe_index = index;
+    options.build_keyframe_index = true;
+    options.save_keyframe_index = true;
+
+    // The first random access builds the index and saves it
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it),
+                // Cleanup
+                [](){})
+
+    JaniceImage image;
+    JANICE_CALL(it.get(&it, &image, 33),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                    remove(index);
+                })
+    it.free_image(&image);
+    it.free(&it);
+
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 7)
+    // Older versions of OpenCV can't scan for keyframes. The test video has
+    // them at frames 0 and 50.
+    vector<uint32_t> keyframes;
+    if (FILE* file = fopen(index, "r")) {
+        unsigned keyframe;
+        while (fscanf(file, "%u", &keyframe) == 1) {
+            keyframes.push_back(keyframe);
+        }
+        fclose(file);
+    }
+
+    CHECK(keyframes == vector<uint32_t>({ 0, 50 }),
+          "build_keyframe_index with save_keyframe_index should save the keyframes of the video",
+          // Cleanup
+          [&]() {
+              remove(index);
+          })
+#endif
+
+    // A new iterator reads the saved index. Frames from get must match a
+    // plain iterator that seeks to them, whether they are decoded forward or
+    // from a keyframe.
+    options.build_keyframe_index = false;
+    options.save_keyframe_index = false;
+
+    JaniceMediaIterator plain;
+    JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it),
+                // Cleanup
+                [&]() {
+                    remove(index);
+                })
+    JANICE_CALL(janice_io_opencv_create_media_iterator(filename, &plain),
+                // Cleanup
+                [&]() {
+                    it.free(&it);
+                    remove(index);
+                })
+
+    auto cleanup = [&]() {
+        plain.free(&plain);
+        it.free(&it);
+        remove(index);
+    };
+
+    const uint32_t frames[] = { 7, 12, 49, 51, 77, 33 };
+    for (uint32_t frame : frames) {
+        JANICE_CALL(plain.seek(&plain, frame),
+                    // Cleanup
+                    cleanup)
+
+        JaniceImage expected;
+        JANICE_CALL(plain.next(&plain, &expected),
+                    // Cleanup
+                    cleanup)
+
+        JANICE_CALL(it.get(&it, &image, frame),
+                    // Cleanup
+                    [&]() {
+                        plain.free_image(&expected);
+                        cleanup();
+                    })
+
+        const bool same = same_image(image, expected);
+        it.free_image(&image);
+        plain.free_image(&expected);
+
+        CHECK(same,
+              "get with a keyframe index should return the frame a plain seek does",
+              // Cleanup
+              cleanup)
+    }
+
+    cleanup();
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Check videos decoded in segments
+
+int check_segmented_video(const char* filename, const Frames& frames)
+{
+    const uint32_t num_frames = frames.size();
+
+    JaniceIOOpenCVOptions options;
+    JANICE_CALL(janice_io_opencv_init_default_options(&options),
+                // Cleanup
+                [](){})
+    options.decode_segments = 3;
+
+    JaniceMediaIterator it;
+    JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it),
+                // Cleanup
+                [](){})
+
+    auto cleanup = [&]() {
+        it.free(&it);
+    };
+
+    const char* in_order = "A segmented iterator should return the frames of a plain iterator";
+    for (uint32_t i = 0; i < 2; ++i) {
+        if (check_next_frame(&it, frames, i, in_order) == 1) {
+            cleanup();
+            return 1;
+        }
+    }
+
+    // Give the decoders time to queue frames of the first segment, then seek
+    // forward into them and back to before them
+    this_thread::sleep_for(chrono::milliseconds(100));
+
+    JANICE_CALL(it.seek(&it, 10),
+                // Cleanup
+                cleanup)
+    if (check_next_frame(&it, frames, 10, in_order) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    JANICE_CALL(it.seek(&it, 5),
+                // Cleanup
+                cleanup)
+
+    // The rest crosses every segment boundary
+    for (uint32_t i = 5; i < num_frames; ++i) {
+        if (check_next_frame(&it, frames, i, in_order) == 1) {
+            cleanup();
+            return 1;
+        }
+
+        uint32_t physical;
+        JANICE_CALL(it.physical_frame(&it, i, &physical),
+                    // Cleanup
+                    cleanup)
+
+        CHECK(physical == i,
+              "physical_frame on a segmented iterator in order should return the logical frame",
+              // Cleanup
+              cleanup)
+    }
+
+    JaniceImage image;
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a segmented iterator should return JANICE_MEDIA_AT_END after the last frame",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(it.reset(&it),
+                // Cleanup
+                cleanup)
+    if (check_next_frame(&it, frames, 0, in_order) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    it.free(&it);
+
+    // Out of order, every frame is returned once and physical_frame says which
+    options.segments_out_of_order = true;
+    JANICE_CALL(janice_io_opencv_create_media_iterator_with_options(filename, &options, &it),
+                // Cleanup
+                [](){})
+
+    for (int pass = 0; pass < 2; ++pass) {
+        vector<bool> seen(num_frames, false);
+        for (uint32_t i = 0; i < num_frames; ++i) {
+            uint32_t position;
+            JANICE_CALL(it.tell(&it, &position),
+                        // Cleanup
+                        cleanup)
+
+            CHECK(position == i,
+                  "tell on a segmented iterator out of order should count the frames returned",
+                  // Cleanup
+                  cleanup)
+
+            JANICE_CALL(it.next(&it, &image),
+                        // Cleanup
+                        cleanup)
+
+            uint32_t physical = num_frames;
+            it.physical_frame(&it, i, &physical);
+            const bool same = physical < num_frames && !seen[physical] && same_frame(image, frames[physical]);
+            it.free_image(&image);
+
+            CHECK(same,
+                  "A segmented iterator out of order should return each frame once, where physical_frame says",
+                  // Cleanup
+                  cleanup)
+            seen[physical] = true;
+        }
+
+        CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+              "next on a segmented iterator should return JANICE_MEDIA_AT_END after the last frame",
+              // Cleanup
+              cleanup)
+
+        // Reading again after a reset returns every frame again
+        JANICE_CALL(it.reset(&it),
+                    // Cleanup
+                    cleanup)
+    }
+
+    it.free(&it);
+
+    return 0;
+}
+
+#ifdef JANICE_IO_TEST_WITH_MEMORY_IO
+
+// ----------------------------------------------------------------------------
+// Check the frame numbers of wrapped sparse iterators
+
+// A sparse memory_io iterator over ten uniform gray images taken from every
+// tenth frame of a video, the i-th image filled with values[i]
+static int create_sparse_frames(const uint8_t* values, JaniceMediaIterator* it)
+{
+    const uint32_t num_images = 10, size = 16;
+
+    std::vector<std::vector<uint8_t>> pixels(num_images);
+    std::vector<JaniceImage> images(num_images);
+    std::vector<uint32_t> frames(num_images);
+    for (uint32_t i = 0; i < num_images; ++i) {
+        pixels[i].assign(size * size * 3, values[i]);
+
+        images[i].channels = 3;
+        images[i].rows = size;
+        images[i].cols = size;
+        images[i].data = pixels[i].data();
+        images[i].owner = false;
+
+        frames[i] = i * 10;
+    }
+
+    JANICE_CALL(janice_io_memory_create_sparse_media_iterator_with_frames(images.data(), frames.data(), num_images, it),
+                // Cleanup
+                [](){})
+
+    return 0;
+}
+
+// Read the next frame of it and check its fill value, its logical frame from
+// tell before the read and its physical frame
+static int check_wrapped_next(JaniceMediaIterator* it, uint8_t value, uint32_t logical, uint32_t physical)
+{
+    uint32_t frame;
+    JANICE_CALL(it->tell(it, &frame),
+                // Cleanup
+                [](){})
+
+    CHECK(frame == logical,
+          "tell on a wrapped sparse iterator should return the logical frame next reads",
+          // Cleanup
+          [](){})
+
+    JaniceImage image;
+    JANICE_CALL(it->next(it, &image),
+                // Cleanup
+                [](){})
+
+    const bool expected = image.data[0] == value;
+    JANICE_CALL(it->free_image(&image),
+                // Cleanup
+                [](){})
+
+    CHECK(expected,
+          "next on a wrapped sparse iterator should return the frame tell reported",
+          // Cleanup
+          [](){})
+
+    JANICE_CALL(it->physical_frame(it, logical, &frame),
+                // Cleanup
+                [](){})
+
+    CHECK(frame == physical,
+          "physical_frame on a wrapped sparse iterator should return the video frame of the image",
+          // Cleanup
+          [](){})
+
+    return 0;
+}
+
+int check_subsampled_sparse_frames()
+{
+    const uint8_t values[10] = { 0, 10, 20, 30, 40, 50, 60, 70, 80, 90 };
+
+    JaniceMediaIterator base, it;
+    if (create_sparse_frames(values, &base) == 1)
+        return 1;
+
+    // Logical frame i is image 3 * i, from video frame 30 * i
+    JANICE_CALL(janice_io_opencv_create_subsampled_media_iterator(&base, 3, 0, &it),
+                // Cleanup
+                [&]() {
+                    base.free(&base);
+                })
+
+    auto cleanup = [&]() {
+        it.free(&it);
+    };
+
+    if (check_wrapped_next(&it, 0, 0, 0) == 1 ||
+        check_wrapped_next(&it, 30, 1, 30) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    uint32_t frame;
+    JANICE_CALL(it.physical_frame(&it, 3, &frame),
+                // Cleanup
+                cleanup)
+
+    CHECK(frame == 90,
+          "physical_frame on a subsampled iterator should map frames that weren't read yet",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(it.seek(&it, 3),
+                // Cleanup
+                cleanup)
+
+    if (check_wrapped_next(&it, 90, 3, 90) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    JaniceImage image;
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a subsampled iterator should return JANICE_MEDIA_AT_END past the last frame",
+          // Cleanup
+          cleanup)
+
+    JANICE_CALL(it.seek(&it, 1),
+                // Cleanup
+                cleanup)
+
+    if (check_wrapped_next(&it, 30, 1, 30) == 1 ||
+        check_wrapped_next(&it, 60, 2, 60) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    it.free(&it);
+
+    return 0;
+}
+
+int check_motion_gated_sparse_frames()
+{
+    // Images 2, 3, 5, 7 and 8 repeat the image before them, so the iterator
+    // presents images 0, 1, 4, 6 and 9
+    const uint8_t values[10] = { 0, 100, 100, 100, 200, 200, 50, 50, 50, 150 };
+
+    JaniceMediaIterator base, it;
+    if (create_sparse_frames(values, &base) == 1)
+        return 1;
+
+    JANICE_CALL(janice_io_opencv_create_motion_gated_media_iterator(&base, 0.5f, 0, &it),
+                // Cleanup
+                [&]() {
+                    base.free(&base);
+                })
+
+    auto cleanup = [&]() {
+        it.free(&it);
+    };
+
+    if (check_wrapped_next(&it, 0, 0, 0) == 1 ||
+        check_wrapped_next(&it, 100, 1, 10) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    uint32_t frame;
+    CHECK(it.physical_frame(&it, 2, &frame) == JANICE_OUT_OF_BOUNDS_ACCESS,
+          "physical_frame on a motion gated iterator should fail for frames that weren't read yet",
+          // Cleanup
+          cleanup)
+
+    // Seeking forward reads and gates the frames in between
+    JANICE_CALL(it.seek(&it, 4),
+                // Cleanup
+                cleanup)
+
+    JANICE_CALL(it.physical_frame(&it, 3, &frame),
+                // Cleanup
+                cleanup)
+
+    CHECK(frame == 60,
+          "physical_frame on a motion gated iterator should map the frames seek read past",
+          // Cleanup
+          cleanup)
+
+    if (check_wrapped_next(&it, 150, 4, 90) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    JaniceImage image;
+    CHECK(it.next(&it, &image) == JANICE_MEDIA_AT_END,
+          "next on a motion gated iterator should return JANICE_MEDIA_AT_END after the last frame",
+          // Cleanup
+          cleanup)
+
+    // Seeking back lands on a frame that was presented, and gating goes on from there
+    JANICE_CALL(it.seek(&it, 1),
+                // Cleanup
+                cleanup)
+
+    if (check_wrapped_next(&it, 100, 1, 10) == 1 ||
+        check_wrapped_next(&it, 200, 2, 40) == 1) {
+        cleanup();
+        return 1;
+    }
+
+    it.free(&it);
+
+    return 0;
+}
+
+#endif // JANICE_IO_TEST_WITH_MEMORY_IO
+
+// ----------------------------------------------------------------------------
+// Main test function
+
+int main(int, char*[])
+{
+    const string test_image = "media/test_image.png";
+    const string test_video = "media/test_video.mp4";
+
+    // Check that an iterator can be created and its functions work as expected
+    // for an image
+    if (check_media_iterator(test_image.c_str()) == 1)
+        return 1;
+
+    // Check the loaded pixel values of the test image
+    if (check_media_pixel_values(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that regions of the image can be read on their own
+    if (check_media_roi(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that images can be read in batches
+    if (check_media_batch(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that borrowed frames are valid until they are freed
+    if (check_borrowed_media(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that a cached still is decoded once and shared between reads
+    if (check_cached_still(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that stills read by several iterators are decoded once
+    if (check_still_cache(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that sparse iterators reading stills in batches decode them correctly
+    if (check_batched_sparse_media(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that a sparse iterator prefetching within a memory limit keeps its order
+    if (check_prefetched_sparse_media(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that stills can be decoded at a reduced resolution
+    if (check_decode_scale(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that every read mode decodes stills like cv::imread
+    if (check_read_modes(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that frames can be converted to a requested format
+    if (check_formatted_media(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that pyramid levels of a frame can be read from the iterator
+    if (check_media_pyramid(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that a still read as tiles is cut up correctly
+    if (check_tiled_still(test_image.c_str()) == 1)
+        return 1;
+
+    // Check that frames given out of order are sorted and can be found
+    if (check_sparse_find_frame(test_image.c_str()) == 1)
+        return 1;
+
+    // Video iterators are checked against the frames of a plain iterator
+    Frames video_frames;
+    if (read_video_frames(test_video.c_str(), video_frames) == 1)
+        return 1;
+
+    // Check that videos decoded ahead return the same frames
+    if (check_prefetched_video(test_video.c_str(), video_frames) == 1)
+        return 1;
+
+    // Check that tell reaches the frame count at the end of a video
+    if (check_video_end(test_video.c_str(), video_frames.size()) == 1)
+        return 1;
+
+    // Check that iterators are unaffected by closing videos to stay under the limit
+    if (check_decoder_limit(test_video.c_str(), video_frames) == 1)
+        return 1;
+
+    // Check that a saved keyframe index gives the same frames on random access
+    if (check_keyframe_index(test_video.c_str()) == 1)
+        return 1;
+
+    // Check that videos decoded in segments return the same frames
+    if (check_segmented_video(test_video.c_str(), video_frames) == 1)
+        return 1;
+
+#ifdef JANICE_IO_TEST_WITH_MEMORY_IO
+    // Check that subsampled sparse iterators map frames through both iterators
+    if (check_subsampled_sparse_frames() == 1)
+        return 1;
+
+    // Check that motion gated sparse iterators map frames through both iterators
+    if (check_motion_gated_sparse_frames() == 1)
         return 1;
+#endif
 
     return 0;
 }
@@ -0,0 +1,204 @@
+// Measure how fast a list of files can be read into memory, the way sparse
+// iterators read stills before decoding them. Each pass reads every file once
+// with one of the loaders:
+//   sequential  one blocking pread loop per file on the calling thread
+//   pool        the same reads spread over the shared thread pool
+//   batched     batches handed to io_utils::FileLoader, through io_uring
+//               where the kernel allows it
+// With --cold the files are dropped from the page cache before every pass, so
+// the numbers include the storage rather than just memory copies.
+
+#include <janice_io_file_loader.hpp>
+#include <janice_io_thread_pool.hpp>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "usage: %s [--batch N] [--passes P] [--cold] <file or directory>...\n", program);
+}
+
+// Add path, or the regular files directly inside it if it is a directory
+static void add_files(const std::string& path, std::vector<std::string>& files)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        fprintf(stderr, "Unable to stat %s\n", path.c_str());
+        return;
+    }
+
+    if (!S_ISDIR(info.st_mode)) {
+        files.push_back(path);
+        return;
+    }
+
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        fprintf(stderr, "Unable to open %s\n", path.c_str());
+        return;
+    }
+
+    std::vector<std::string> entries;
+    while (struct dirent* entry = readdir(dir)) {
+        const std::string file = path + "/" + entry->d_name;
+        if (stat(file.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+            entries.push_back(file);
+        }
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end());
+    files.insert(files.end(), entries.begin(), entries.end());
+}
+
+static void drop_from_cache(const std::vector<std::string>& files)
+{
+    for (const std::string& file : files) {
+        const int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+// Counts finished files so a pass can wait for all of them
+struct Tally
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t files = 0;
+    size_t bytes = 0;
+    size_t failures = 0;
+
+    void add(const std::vector<uint8_t>& data, bool ok)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++files;
+        bytes += data.size();
+        failures += ok ? 0 : 1;
+        cv.notify_all();
+    }
+
+    void wait(size_t count)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return files >= count; });
+    }
+};
+
+static void read_sequential(const std::vector<std::string>& files, size_t, Tally& tally)
+{
+    for (const std::string& file : files) {
+        std::vector<uint8_t> data;
+        const bool ok = io_utils::read_file(file, data);
+        tally.add(data, ok);
+    }
+}
+
+static void read_pool(const std::vector<std::string>& files, size_t, Tally& tally)
+{
+    for (const std::string& file : files) {
+        io_utils::ThreadPool::instance().submit([&tally, file]() {
+            std::vector<uint8_t> data;
+            const bool ok = io_utils::read_file(file, data);
+            tally.add(data, ok);
+        });
+    }
+    tally.wait(files.size());
+}
+
+// Hand the files to the loader batch at a time, waiting for each batch like a
+// sparse iterator waits for the files it queued
+static void read_batched(const std::vector<std::string>& files, size_t batch, Tally& tally)
+{
+    for (size_t start = 0; start < files.size(); start += batch) {
+        const size_t end = std::min(files.size(), start + batch);
+
+        std::vector<std::string> filenames(files.begin() + start, files.begin() + end);
+        std::vector<io_utils::FileLoader::Callback> callbacks(filenames.size(), [&tally](std::vector<uint8_t>& data, bool ok) {
+            tally.add(data, ok);
+        });
+
+        io_utils::FileLoader::instance().load(filenames, callbacks);
+        tally.wait(end);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t batch = 64;
+    int passes = 3;
+    bool cold = false;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--passes") == 0 && i + 1 < argc) {
+            passes = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--cold") == 0) {
+            cold = true;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            add_files(argv[i], files);
+        }
+    }
+
+    if (files.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("%zu files, batches of %zu, io_uring %s\n", files.size(), batch,
+           io_utils::FileLoader::instance().batched() ? "available" : "unavailable, batches use pread");
+
+    struct Loader
+    {
+        const char* name;
+        void (*read)(const std::vector<std::string>&, size_t, Tally&);
+    };
+    const Loader loaders[] = { { "sequential", read_sequential },
+                               { "pool",       read_pool       },
+                               { "batched",    read_batched    } };
+
+    for (const Loader& loader : loaders) {
+        double best = 0;
+        size_t bytes = 0, failures = 0;
+
+        for (int pass = 0; pass < passes; ++pass) {
+            if (cold) {
+                drop_from_cache(files);
+            }
+
+            Tally tally;
+            const auto start = std::chrono::steady_clock::now();
+            loader.read(files, batch, tally);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            best = pass == 0 ? seconds : std::min(best, seconds);
+            bytes = tally.bytes;
+            failures = tally.failures;
+        }
+
+        printf("%-10s  %9.1f MB/s  %9.1f files/s  (best of %d, %zu failed)\n", loader.name,
+               bytes / best / (1024 * 1024), files.size() / best, passes, failures);
+    }
+
+    return 0;
+}